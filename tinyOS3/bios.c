@@ -2,16 +2,17 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <pthread.h>
+#include <sched.h>
 #include <signal.h>
 #include <time.h>
-#include <sys/select.h>
 #include <sys/types.h>
 #include <sys/stat.h>
-#include <sys/select.h>
-#include <sys/signalfd.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <poll.h>
+#include <sys/eventfd.h>
 
 #include "util.h"
 #include "bios.h"
@@ -22,10 +23,11 @@
 
 	Basic idea:
 	- Each core is simulated by a pthread
-	- One POSIX timer per core thread
+	- One timerfd per core thread for the quantum timer, and one for the
+	queue of deadline timers (hrtimers) of the core
 	- Core threads mask all signals except for USR1.
-	- The PIC thread receives all signals and dispatches them to
-	the right core thread by raising SIGUSR1.
+	- The PIC thread waits (with epoll) on the timers and terminals, and
+	dispatches interrupts to the right core thread, by raise_interrupt().
 
  */
 
@@ -33,27 +35,45 @@
 /*
 	Per-core data.
  */
+/*
+	The paths by which a pending interrupt reaches a core:
+	- by the SIGUSR1 handler, or
+	- by the core itself, when it re-enables interrupts or wakes up from halt.
+ */
+enum { IRQ_PATH_SIGNAL, IRQ_PATH_POLL, IRQ_PATHS };
+
 typedef struct core
 {
 	uint id;
 	interrupt_handler* bootfunc;
 	pthread_t thread;
 
-	struct sigevent timer_sigevent;
-	timer_t timer_id;
+	int timerfd;                    /* The core timer */
+
+	int hrtimerfd;                  /* Expires at the earliest deadline of hrtimers */
+	pthread_spinlock_t hrlock;      /* Protects the hrtimer queue */
+	bios_hrtimer hrqueue;           /* Sentinel of the hrtimer queue, sorted by deadline */
+	unsigned long hrt_fired;        /* Expired hrtimers */
 
 	interrupt_handler* intvec[maximum_interrupt_no];
-	sig_atomic_t intpending[maximum_interrupt_no];
+	unsigned int intpending;        /* Bitmask of pending interrupts */
+	uint64_t raise_time[maximum_interrupt_no];  /* When each pending interrupt was raised (nsec) */
 
 	sig_atomic_t int_disabled;
+	sig_atomic_t sig_blocked;
 	sig_atomic_t halted;
+	sig_atomic_t restart_pending;
 	rlnode halted_node;
 	pthread_cond_t halt_cond;
 
 	/* Statistics */
 	int irq_count;
+	int irq_signals;
 	int irq_raised[maximum_interrupt_no];
 	int irq_delivered[maximum_interrupt_no];
+	unsigned long irq_lat_count[IRQ_PATHS];   /* Deliveries, by path */
+	uint64_t irq_lat_sum[IRQ_PATHS];          /* Total delivery latency (nsec), by path */
+	uint64_t irq_lat_max[IRQ_PATHS];          /* Maximum delivery latency (nsec), by path */
 } Core;
 
 
@@ -66,11 +86,6 @@ static sigset_t core_signal_set;
 /* Uset to store the singleton set containing SIGUSR1 */
 static sigset_t sigusr1_set;
 
-/* Uset to store the singleton set containing SIGALRM */
-static sigset_t sigalrm_set;
-
-/* Used to create the signalfd */
-static sigset_t signalfd_set;
 
 /* Array of Core objects, one per core */
 static Core CORE[MAX_CORES];
@@ -90,22 +105,14 @@ static pthread_mutex_t core_halt_mutex = PTHREAD_MUTEX_INITIALIZER;
 /* List of halted cores */
 static rlnode halted_list;
 
-/* PIC thread id */
-static pthread_t PIC_thread;
-
 /* Save the sigaction for SIGUSR1 */
 static struct sigaction USR1_saved_sigaction;
 
 /* The sigaction for SIGUSR1 (core interrupts) */
 static struct sigaction USR1_sigaction;
 
-/* A simulated coarse clock measuring time with a res. of 0.1 sec,
-   since "boot". Used for serial device timeouts. */
+/* A coarse clock measuring time in msec. Used for serial device timeouts. */
 typedef unsigned long coarse_clock_t;
-static volatile coarse_clock_t  system_clock;
-
-/* This is how fast the coarse clock is updated (in usec) */
-#define SLOW_HZ 10000
 
 /* This gives a rough serial port timeout of 300 msec */
 #define SERIAL_TIMEOUT 300
@@ -113,8 +120,37 @@ static volatile coarse_clock_t  system_clock;
 static void sigusr1_handler(int signo, siginfo_t* si, void* ctx);
 
 
+/* The interrupt delivery method */
+static irq_delivery irq_mode = IRQ_DELIVERY_SHARED;
+
+/* If set, print interrupt statistics when the VM shuts down */
+static int vm_print_stats = 0;
+
+/* An eventfd used to wake up the PIC daemon */
+static int pic_eventfd = -1;
+
+/* The epoll instance of the PIC daemon */
+static int pic_epollfd = -1;
+
+/* The number of fds watched by pic_epollfd */
+static unsigned int pic_nwatched = 0;
+
+/* 
+	The sources of events for the PIC. The epoll data of each fd 
+	holds the source kind and the index of the core or terminal. 
+*/
+enum { PIC_SRC_WAKE, PIC_SRC_TIMER, PIC_SRC_HRTIMER, PIC_SRC_CON, PIC_SRC_KBD };
+#define PIC_SRC(kind, idx)  ((((uint64_t)(kind))<<32) | (idx))
+
+static void pic_watch(int fd, uint32_t events, uint64_t src)
+{
+	struct epoll_event ev = { .events = events, .data.u64 = src };
+	CHECK(epoll_ctl(pic_epollfd, EPOLL_CTL_ADD, fd, &ev));
+	__atomic_fetch_add(&pic_nwatched, 1, __ATOMIC_RELAXED);
+}
+
 /* PIC daemon statistics */
-static unsigned long PIC_loops, PIC_usr1_drained, PIC_usr1_queued;
+static unsigned long PIC_loops, PIC_wakes_drained, PIC_wakes_queued;
 
 
 /* Initialize static vars. This is called via pthread_once() */
@@ -125,7 +161,7 @@ static void initialize()
 	CHECKRC(pthread_key_create(&Core_key, NULL));
 
 	USR1_sigaction.sa_sigaction = sigusr1_handler;
-	USR1_sigaction.sa_flags = SA_SIGINFO;
+	USR1_sigaction.sa_flags = SA_SIGINFO | SA_NODEFER;
 	sigemptyset(& USR1_sigaction.sa_mask);
 
 	/* Create the sigmask to block all signals, except USR1 */
@@ -136,21 +172,13 @@ static void initialize()
 	CHECK(sigemptyset(&sigusr1_set));
 	CHECK(sigaddset(&sigusr1_set, SIGUSR1));
 
-	/* Create the mask for  SIGALRM */
-	CHECK(sigemptyset(&sigalrm_set));
-	CHECK(sigaddset(&sigalrm_set, SIGALRM));
-
-
-	/* Create signaldf_set */
-	CHECK(sigemptyset(&signalfd_set));
-	CHECK(sigaddset(&signalfd_set, SIGUSR1));
-	CHECK(sigaddset(&signalfd_set, SIGALRM));
 }
 
 
 
 
 static void PIC_daemon();  /* forward def */
+static inline void core_restart(Core* core);  /* forward def */
 
 
 /*
@@ -167,11 +195,9 @@ static inline Core* curr_core() {
  */
 static inline void interrupt_pic_thread()
 {
-	union sigval coreval;
-	coreval.sival_ptr = NULL; /* This is silly, but silences valgrind */
-	coreval.sival_int = -1;
-	CHECKRC(pthread_sigqueue(PIC_thread, SIGUSR1, coreval));
-	__atomic_fetch_add(&PIC_usr1_queued,1,__ATOMIC_RELAXED);
+	uint64_t one = 1;
+	CHECK(write(pic_eventfd, &one, sizeof(one)));
+	__atomic_fetch_add(&PIC_wakes_queued,1,__ATOMIC_RELAXED);
 }
 
 
@@ -186,11 +212,12 @@ static void* bootfunc_wrapper(void* _core)
 	/* Default interrupt handlers */
 	for(int i=0; i<maximum_interrupt_no; i++) {
 		core->intvec[i] = NULL;
-		core->intpending[i] = 0;
 	}
+	core->intpending = 0;
 
 	/* Mark interrupts as enabled */
 	core->int_disabled = 0;
+	core->sig_blocked = 0;
 
 	/* establish the thread-local id */
 	CHECKRC(pthread_setspecific(Core_key, core));
@@ -199,11 +226,18 @@ static void* bootfunc_wrapper(void* _core)
 	/* Set core signal mask */
 	CHECKRC(pthread_sigmask(SIG_BLOCK, &core_signal_set, NULL));
 
-	/* create a thread-specific timer */
-	core->timer_sigevent.sigev_notify = SIGEV_SIGNAL;
-	core->timer_sigevent.sigev_signo = SIGALRM;
-	core->timer_sigevent.sigev_value.sival_int = core->id;
-	CHECK(timer_create(CLOCK_REALTIME, & core->timer_sigevent, & core->timer_id));
+	/* create a thread-specific timer, watched by the PIC */
+	core->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+	CHECK(core->timerfd);
+	pic_watch(core->timerfd, EPOLLIN, PIC_SRC(PIC_SRC_TIMER, core->id));
+
+	/* the hrtimer queue */
+	core->hrtimerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+	CHECK(core->hrtimerfd);
+	pic_watch(core->hrtimerfd, EPOLLIN, PIC_SRC(PIC_SRC_HRTIMER, core->id));
+	CHECKRC(pthread_spin_init(& core->hrlock, PTHREAD_PROCESS_PRIVATE));
+	core->hrqueue.next = core->hrqueue.prev = & core->hrqueue;
+	core->hrt_fired = 0;
 
 	/* sync with all cores */
 	pthread_barrier_wait(& system_barrier);
@@ -216,8 +250,10 @@ static void* bootfunc_wrapper(void* _core)
 		core->intvec[i] = NULL;
 	}		
 
-	/* Delete the core timer */
-	CHECK(timer_delete(core->timer_id));
+	/* Delete the core timers */
+	CHECK(close(core->timerfd));
+	CHECK(close(core->hrtimerfd));
+	CHECKRC(pthread_spin_destroy(& core->hrlock));
 
 	pthread_barrier_wait(& core_barrier);
 
@@ -236,30 +272,74 @@ static void* bootfunc_wrapper(void* _core)
 
 /*
 	Raise an interrupt to a core.
+
+	The interrupt is marked in the pending bitmask of the core, and the
+	core is restarted if it is halted. With IRQ_DELIVERY_SIGNAL, the core
+	is always sent SIGUSR1. With IRQ_DELIVERY_SHARED, a signal is sent
+	only if the core is running with interrupts enabled, that is, only
+	when it must be preempted; else, the core will find the interrupt
+	in its bitmask when it wakes up or re-enables interrupts.
+
+	Setting the bit and checking int_disabled are both sequentially 
+	consistent; cpu_enable_interrupts() does the same in the opposite order.
+	Therefore, either we see interrupts enabled, or the core sees the bit.
+	The raise time is stored (release) before the bit is set, and the core 
+	loads it (acquire) after it clears the bit.
  */
 static inline void raise_interrupt(Core* core, Interrupt intno) 
 {
-	union sigval coreval;
-	coreval.sival_ptr = NULL; /* This is to silence valgrind */
-	coreval.sival_int = core->id;
-	core->intpending[intno] = 1;
-	core->irq_raised[intno] ++;
-	CHECKRC(pthread_sigqueue(core->thread, SIGUSR1, coreval));
-	cpu_core_restart(core->id);
+	unsigned int bit = 1u << intno;
+
+	if(! (__atomic_load_n(& core->intpending, __ATOMIC_RELAXED) & bit))
+		__atomic_store_n(& core->raise_time[intno], bios_clock_ns(), __ATOMIC_RELEASE);
+	__atomic_fetch_or(& core->intpending, bit, __ATOMIC_SEQ_CST);
+	__atomic_fetch_add(& core->irq_raised[intno], 1, __ATOMIC_RELAXED);
+
+	pthread_mutex_lock(& core_halt_mutex);
+	int was_halted = core->halted;
+	core_restart(core);
+	pthread_mutex_unlock(& core_halt_mutex);
+
+	if(irq_mode == IRQ_DELIVERY_SIGNAL || 
+		(! was_halted && ! __atomic_load_n(& core->int_disabled, __ATOMIC_SEQ_CST))) 
+	{
+		union sigval coreval;
+		coreval.sival_ptr = NULL; /* This is to silence valgrind */
+		coreval.sival_int = core->id;
+		__atomic_fetch_add(& core->irq_signals, 1, __ATOMIC_RELAXED);
+		CHECKRC(pthread_sigqueue(core->thread, SIGUSR1, coreval));
+	}
 }
 
 
 /*
-	Dispatch the pending iterrupts for the given core.
+	Dispatch the pending iterrupts for the given core, which were
+	noticed via the given path.
  */
-static void dispatch_interrupts(Core* core)
+static void hrtimer_expire(Core* core);  /* forward def */
+
+static void dispatch_interrupts(Core* core, int path)
 {
+	if(__atomic_load_n(& core->intpending, __ATOMIC_RELAXED) == 0)
+		return;
+
 	for(int intno = 0; intno < maximum_interrupt_no; intno++) {
 		if(core->int_disabled) break; /* will continue at
 										 cpu_interrupt_enable()*/
-		if(core->intpending[intno]) {
-			core->intpending[intno] = 0;
+		/* Test-and-clear atomically, as a nested signal may dispatch it too */
+		unsigned int bit = 1u << intno;
+		if(__atomic_fetch_and(& core->intpending, ~bit, __ATOMIC_ACQUIRE) & bit) {
 			core->irq_delivered[intno]++;
+
+			uint64_t lat = bios_clock_ns() 
+				- __atomic_load_n(& core->raise_time[intno], __ATOMIC_ACQUIRE);
+			core->irq_lat_count[path]++;
+			core->irq_lat_sum[path] += lat;
+			if(lat > core->irq_lat_max[path]) core->irq_lat_max[path] = lat;
+
+			if(intno == HRTIMER)
+				hrtimer_expire(core);
+
 			interrupt_handler* handler =  core->intvec[intno];
 			if(handler != NULL) { 
 				handler();
@@ -271,14 +351,30 @@ static void dispatch_interrupts(Core* core)
 
 /*
 	This is the handler run by core threads to handle interrupts.
+
+	Interrupts are masked in software: cpu_disable_interrupts() only sets
+	core->int_disabled. If a signal arrives while the flag is set, the
+	interrupt stays pending, and SIGUSR1 is blocked (by changing the mask
+	restored when the handler returns), so that no more signals interrupt
+	the masked section. cpu_enable_interrupts() unblocks it and dispatches
+	the pending interrupts. Thus, the signal mask is only changed when an
+	interrupt actually arrives in a masked section.
+
+	The handler is installed with SA_NODEFER, because it may not return
+	for a long time (when an interrupt handler switches context), and
+	SIGUSR1 must not stay blocked meanwhile.
  */
 static void sigusr1_handler(int signo, siginfo_t* si, void* ctx)
 {
 	Core* core = & CORE[si->si_value.sival_int];
 
 	core->irq_count++;
-	if(core->int_disabled) return;
-	dispatch_interrupts(core);
+	if(core->int_disabled) {
+		sigaddset(& ((ucontext_t*)ctx)->uc_sigmask, SIGUSR1);
+		core->sig_blocked = 1;
+		return;
+	}
+	dispatch_interrupts(core, IRQ_PATH_SIGNAL);
 }
 
 
@@ -291,7 +387,7 @@ static void sigusr1_handler(int signo, siginfo_t* si, void* ctx)
 static coarse_clock_t get_coarse_time()
 {
 	struct timespec curtime;
-	CHECK(clock_gettime(CLOCK_REALTIME, &curtime));
+	CHECK(clock_gettime(CLOCK_MONOTONIC_COARSE, &curtime));
 	return curtime.tv_nsec / 1000000 + curtime.tv_sec*1000;
 }
 
@@ -300,7 +396,7 @@ static coarse_clock_t get_coarse_time()
 /*
 	An io_device handles a file descriptor that is connected to some
 	'peripheral' in stream (byte-oriented) mode. The file descriptor must be
-	'select-able' (i.e. not a disk file) and support non-blocking mode.
+	'pollable' (i.e. not a disk file) and support non-blocking mode.
 
 	Model outline:
 
@@ -311,9 +407,10 @@ static coarse_clock_t get_coarse_time()
 	by this program (bidirectional fds, such as sockets, can be handled by a pair of
 	io_device objects).  
 
-	An io_device is ready if I/O operations may succeed (as reported by select()).
+	An io_device is ready if I/O operations may succeed (as reported by epoll).
 
-	A not-ready device is made ready when select() returns it as such.
+	A device is made ready when epoll reports that it became ready (the
+	fds are watched edge-triggered).
 
 	A ready device is made not-ready on each failed attempt to do an I/O transfer.
 
@@ -355,7 +452,7 @@ static void io_device_init(io_device* this, int fd, io_direction iodir)
 	this->iodir = iodir;
 	this->int_core = &CORE[0];
 	this->ready = io_ready(fd, iodir);
-	this->last_int = system_clock;
+	this->last_int = get_coarse_time();
 
 	/* Set file descriptor to non-blocking */
 	CHECK(fcntl(fd, F_SETFL, O_NONBLOCK));
@@ -369,10 +466,9 @@ static int io_device_read(io_device* this, char* ptr)
 	while((rc=read(this->fd, ptr, 1))==-1 && errno == EINTR);
 	assert(rc==0 || rc==1 || (rc==-1 && (errno==EAGAIN || errno==EWOULDBLOCK)));
 
-	if(rc!=1 && this->ready) {
+	/* The PIC will see the edge when the device becomes ready again */
+	if(rc!=1 && this->ready)
 		this->ready = 0;
-		interrupt_pic_thread();
-	}
 	return rc==1;
 }
 
@@ -387,10 +483,9 @@ static int io_device_write(io_device* this, char value)
 
 	assert(rc==1 || (rc==-1 && (errno == EAGAIN || errno==EWOULDBLOCK || errno == EPIPE))); 
 
-	if(rc!=1 && this->ready) {
+	/* The PIC will see the edge when the device becomes ready again */
+	if(rc!=1 && this->ready)
 		this->ready = 0;
-		interrupt_pic_thread();
-	} 
 
 	return rc==1;
 }
@@ -456,38 +551,12 @@ static void close_terminal(terminal* term)
 {
 	CHECK(terminal_destroy(term));
 }
-static inline void fdset_add(fd_set* set, int fd, int* nfds)
+/* Raise a serial interrupt for an io_device */
+static void pic_serial_ready(io_device* dev, Interrupt intno, coarse_clock_t now)
 {
-	FD_SET(fd, set);
-	if(fd >= *nfds) *nfds = fd+1;
-}
-
-
-static int check_terminal(terminal* term)
-{
-	/* poll the read side */
-	struct pollfd fds = { .fd=term->kbd.fd, .events=POLLIN };
-	int rc;
-	while( (rc=poll(&fds, 1, 0)) == -1 && errno==EINTR );
-	CHECK(rc);
-	return (fds.revents & (POLLHUP|POLLERR))==0;
-}
-
-
-
-/* Helper for PIC_daemon */
-static void pic_drain_sigusr1(int sigusr1fd)
-{
-	struct signalfd_siginfo sfdinfo;
-	while(1) {
-		int rc = read(sigusr1fd, &sfdinfo, sizeof(sfdinfo));
-		if(rc==-1) {
-			assert(errno==EAGAIN || errno==EWOULDBLOCK);
-			break;
-		}
-		assert(rc==sizeof(sfdinfo));
-		__atomic_fetch_add(&PIC_usr1_drained,1,__ATOMIC_RELAXED);
-	}				
+	dev->ready = 1;
+	dev->last_int = now;
+	raise_interrupt((Core*) dev->int_core, intno);
 }
 
 
@@ -500,6 +569,11 @@ static void pic_drain_sigusr1(int sigusr1fd)
 	(b) SERIAL_RX_READY  &  SERIAL_TX_READY, when some 
 		io_device becomes ready.
 
+	The daemon sleeps in epoll_wait() until some timerfd expires, some
+	terminal becomes ready, or it is woken up via pic_eventfd. In 
+	addition, every serial device gets an interrupt if it has not had 
+	one for SERIAL_TIMEOUT msec. Without terminals, an idle VM does not
+	wake up the daemon at all.
  */
 static void PIC_daemon(uint serialno)
 {
@@ -513,112 +587,93 @@ static void PIC_daemon(uint serialno)
 	CHECKRC(pthread_getname_np(pthread_self(), oldname, 16));
 	CHECKRC(pthread_setname_np(pthread_self(), "tinyos_vm"));
 
-	for(uint i=0; i<nterm; i++)
+	for(uint i=0; i<nterm; i++) {
 		open_terminal(& TERM[i], i);
+		pic_watch(TERM[i].con.fd, EPOLLOUT|EPOLLET, PIC_SRC(PIC_SRC_CON, i));
+		pic_watch(TERM[i].kbd.fd, EPOLLIN|EPOLLET, PIC_SRC(PIC_SRC_KBD, i));
+	}
 
-	sigset_t saved_mask;
-
-	int sigusr1fd = signalfd(-1, &sigusr1_set, SFD_NONBLOCK);
-	CHECK(sigusr1fd);
-	int sigalrmfd = signalfd(-1, &sigalrm_set, SFD_NONBLOCK);
-	CHECK(sigalrmfd);
-
-	CHECKRC(pthread_sigmask(SIG_BLOCK, &signalfd_set, &saved_mask));
-		
 	/* sync with all cores */
 	pthread_barrier_wait(& system_barrier);
 	
-	/* The PIC multiplexing loop */
-	while(__atomic_load_n(&PIC_active, __ATOMIC_ACQUIRE)) {
-		int maxfd = 0;
-		fd_set readfds, writefds;
+	/* The PIC loop. All the fds are watched by now, so one epoll_wait() 
+	   can return every ready event. */
+	int max_events = __atomic_load_n(&pic_nwatched, __ATOMIC_RELAXED);
+	struct epoll_event events[max_events];
 
-		/* Prepare to select */
-		FD_ZERO(&readfds);
-		FD_ZERO(&writefds);
+	while(__atomic_load_n(&PIC_active, __ATOMIC_ACQUIRE)) {
 
+		/* Sleep until the next serial timeout, if there are terminals */
+		int timeout = -1;
+		coarse_clock_t now = get_coarse_time();
 		for(uint i=0; i<nterm; i++) {
-			terminal* term = & TERM[i];
-			if(!check_terminal(term)) continue;
-			if(! term->kbd.ready) fdset_add(&readfds, term->kbd.fd, &maxfd);
-			if(! term->con.ready) fdset_add(&writefds, term->con.fd, &maxfd);
+			coarse_clock_t last = TERM[i].con.last_int < TERM[i].kbd.last_int 
+				? TERM[i].con.last_int : TERM[i].kbd.last_int;
+			int left = (last + SERIAL_TIMEOUT >= now) ? (int)(last + SERIAL_TIMEOUT + 1 - now) : 0;
+			if(timeout < 0 || left < timeout) timeout = left;
 		}
 
-		fdset_add(&readfds, sigalrmfd, &maxfd);
-		fdset_add(&readfds, sigusr1fd, &maxfd);
-
-		/* select will sleep for about SLOW_HZ usec (half the system_clock res.) */
-		struct timeval sleeptime = { .tv_sec=0, .tv_usec = SLOW_HZ };
-		int selcode = select(maxfd, &readfds, &writefds, NULL, &sleeptime);
-
-		/* update system clock */
-		system_clock = get_coarse_time();
-
-		/* process */
-		if(selcode<0) continue;
+		int nevents = epoll_wait(pic_epollfd, events, max_events, timeout);
+		if(nevents<0) {
+			assert(errno==EINTR);
+			continue;
+		}
 		__atomic_fetch_add(&PIC_loops,1,__ATOMIC_RELAXED);
+		now = get_coarse_time();
 
 		/* First raise ALRM as needed (timers have priority :-) */
-		if( FD_ISSET(sigalrmfd, &readfds) ) {
-			struct signalfd_siginfo sfdinfo;
+		for(int e=0; e<nevents; e++) {
+			uint64_t src = events[e].data.u64;
+			if((src>>32) != PIC_SRC_TIMER) continue;
 
-			while(1) {
-				int rc = read(sigalrmfd, &sfdinfo, sizeof(sfdinfo));
-				if(rc==-1) {
-					assert(errno==EAGAIN || errno==EWOULDBLOCK);
-					break;
-				}
-				assert(rc==sizeof(sfdinfo));
-
-				Core* core = & CORE[sfdinfo.ssi_int];
+			Core* core = & CORE[(uint32_t)src];
+			uint64_t expirations;
+			if(read(core->timerfd, &expirations, sizeof(expirations)) == sizeof(expirations))
 				raise_interrupt(core, ALARM);
-			}
+		}
+		for(int e=0; e<nevents; e++) {
+			uint64_t src = events[e].data.u64;
+			if((src>>32) != PIC_SRC_HRTIMER) continue;
+
+			Core* core = & CORE[(uint32_t)src];
+			uint64_t expirations;
+			if(read(core->hrtimerfd, &expirations, sizeof(expirations)) == sizeof(expirations))
+				raise_interrupt(core, HRTIMER);
 		}
 
-		/* Discard any USR1 signals to PIC (their purpose was to unblock PIC 
-		   from select) */
-		if( FD_ISSET(sigusr1fd, &readfds) ) {
-			pic_drain_sigusr1(sigusr1fd);
+		/* Then, the rest */
+		for(int e=0; e<nevents; e++) {
+			uint64_t src = events[e].data.u64;
+			uint32_t idx = (uint32_t) src;
+			switch(src>>32) {
+				case PIC_SRC_WAKE: {
+					uint64_t count;
+					if(read(pic_eventfd, &count, sizeof(count)) == sizeof(count))
+						__atomic_fetch_add(&PIC_wakes_drained, count, __ATOMIC_RELAXED);
+					break;
+				}
+				case PIC_SRC_CON:
+					pic_serial_ready(& TERM[idx].con, SERIAL_TX_READY, now);
+					break;
+				case PIC_SRC_KBD:
+					pic_serial_ready(& TERM[idx].kbd, SERIAL_RX_READY, now);
+					break;
+			}
 		}
 
-		/* Handle the devices */
+		/* Serial timeouts */
 		for(uint i=0; i<nterm; i++) {
-
 			terminal* term = & TERM[i];
-			if( FD_ISSET(term->con.fd, &writefds) 
-				|| (system_clock-term->con.last_int)>SERIAL_TIMEOUT
-				) 
-			{
-				term->con.ready = 1;
-				term->con.last_int = system_clock;
-				Core* core = (Core*) term->con.int_core;
-				raise_interrupt(core, SERIAL_TX_READY);
-			}
-
-
-			if( FD_ISSET(term->kbd.fd, &readfds) 
-				|| (system_clock-term->kbd.last_int)>SERIAL_TIMEOUT
-				) 
-			{
-				term->kbd.ready = 1;
-				term->kbd.last_int = system_clock;
-				Core* core = (Core*) term->kbd.int_core;
-				raise_interrupt(core, SERIAL_RX_READY);
-			}
+			if(now - term->con.last_int > SERIAL_TIMEOUT)
+				pic_serial_ready(& term->con, SERIAL_TX_READY, now);
+			if(now - term->kbd.last_int > SERIAL_TIMEOUT)
+				pic_serial_ready(& term->kbd, SERIAL_RX_READY, now);
 		}
 	}
 
 	/* sync with all cores */
 	pthread_barrier_wait(& system_barrier);
 
-	/* Close signal fds */
-	pic_drain_sigusr1(sigusr1fd);
-	CHECK(close(sigalrmfd));
-	CHECK(close(sigusr1fd));
-
-	/* Restore sigmask */
-	CHECKRC(pthread_sigmask(SIG_SETMASK, &saved_mask, NULL));
-
 	/* destroy terminals */
 	for(uint i=0; i<nterm; i++)
 		close_terminal(& TERM[i]);
@@ -652,13 +707,17 @@ void vm_boot(interrupt_handler bootfunc, uint cores, uint serialno)
 	/* Install signal handler for SIGUSR1 */
 	CHECK(sigaction(SIGUSR1, &USR1_sigaction, &USR1_saved_sigaction));
 
+	/* The PIC waits on this, and is woken up by pic_eventfd */
+	pic_epollfd = epoll_create1(0);
+	CHECK(pic_epollfd);
+	pic_nwatched = 0;
+	pic_eventfd = eventfd(0, EFD_NONBLOCK);
+	CHECK(pic_eventfd);
+	pic_watch(pic_eventfd, EPOLLIN, PIC_SRC(PIC_SRC_WAKE, 0));
+
 	/* Set pic_active to 1 */
-	PIC_thread = pthread_self();
 	PIC_active = 1;	
 
-	/* Initialize system_clock */
-	system_clock = get_coarse_time();
-
 	/* Initialize the barriers */
 	pthread_barrier_init(& system_barrier, NULL, cores+1);
 	pthread_barrier_init(& core_barrier, NULL, cores);
@@ -675,14 +734,21 @@ void vm_boot(interrupt_handler bootfunc, uint cores, uint serialno)
 
 		pthread_cond_init(& CORE[c].halt_cond, NULL);
 		CORE[c].halted = 0;
+		CORE[c].restart_pending = 0;
 		rlnode_init(& CORE[c].halted_node, &CORE[c]);
 
 		/* Initialize Core statistics */
 		CORE[c].irq_count = 0;
+		CORE[c].irq_signals = 0;
 		for(uint intno=0; intno<maximum_interrupt_no;intno++) {
 			CORE[c].irq_delivered[intno] = 0;
 			CORE[c].irq_raised[intno] = 0;
 		}
+		for(uint p=0; p<IRQ_PATHS; p++) {
+			CORE[c].irq_lat_count[p] = 0;
+			CORE[c].irq_lat_sum[p] = 0;
+			CORE[c].irq_lat_max[p] = 0;
+		}
 
 		/* Create the core thread */
 		CHECKRC(pthread_create(& CORE[c].thread, NULL, bootfunc_wrapper, &CORE[c]));
@@ -692,7 +758,7 @@ void vm_boot(interrupt_handler bootfunc, uint cores, uint serialno)
 	}
 
 	/* Initialize PIC statistics */
-	PIC_loops = 0; PIC_usr1_queued = PIC_usr1_drained = 0;
+	PIC_loops = 0; PIC_wakes_queued = PIC_wakes_drained = 0;
 
 	/* Run the interrupt controller daemon on this thread */	
 	PIC_daemon(serialno);
@@ -712,18 +778,44 @@ void vm_boot(interrupt_handler bootfunc, uint cores, uint serialno)
 	/* Delete the Core table */
 	ncores = 0;
 
+	CHECK(close(pic_eventfd));
+	pic_eventfd = -1;
+	CHECK(close(pic_epollfd));
+	pic_epollfd = -1;
+
 	/* emit statistics */
-#if 0
-	fprintf(stderr,"PIC loops: %lu  queued/drained= %lu / %lu\n", 
-		PIC_loops, PIC_usr1_queued, PIC_usr1_drained);
-	for(uint c=0;c<cores;c++) {
-		fprintf(stderr,"Core %3d: irq_count=%6d. deliv(raised):\t",
-			c, CORE[c].irq_count);
-		for(uint i=0;i<maximum_interrupt_no;i++) 
-			fprintf(stderr," %d(%d)",CORE[c].irq_delivered[i], CORE[c].irq_raised[i]);
-		fprintf(stderr,"\n");
+	if(vm_print_stats) {
+		fprintf(stderr,"PIC loops: %lu  queued/drained= %lu / %lu  delivery: %s\n", 
+			PIC_loops, PIC_wakes_queued, PIC_wakes_drained,
+			irq_mode==IRQ_DELIVERY_SHARED ? "shared" : "signal");
+		for(uint c=0;c<cores;c++) {
+			Core* core = & CORE[c];
+			fprintf(stderr,"Core %3d: irq_count=%6d signals=%6d hrtimers=%6lu. deliv(raised):\t",
+				c, core->irq_count, core->irq_signals, core->hrt_fired);
+			for(uint i=0;i<maximum_interrupt_no;i++) 
+				fprintf(stderr," %d(%d)",core->irq_delivered[i], core->irq_raised[i]);
+			fprintf(stderr,"\n");
+			static const char* path_name[IRQ_PATHS] = { "signal", "poll" };
+			for(uint p=0; p<IRQ_PATHS; p++) {
+				unsigned long n = core->irq_lat_count[p];
+				fprintf(stderr,"          %-6s: %6lu delivered, latency avg %8.1f usec, max %8.1f usec\n",
+					path_name[p], n, n ? core->irq_lat_sum[p]/(1000.0*n) : 0.0,
+					core->irq_lat_max[p]/1000.0);
+			}
+		}
 	}
-#endif
+}
+
+
+void vm_set_irq_delivery(irq_delivery mode)
+{
+	CHECK_CONDITION(ncores==0);
+	irq_mode = mode;
+}
+
+void vm_set_print_stats(int flag)
+{
+	vm_print_stats = flag;
 }
 
 
@@ -734,19 +826,26 @@ uint cpu_cores()
 
 void cpu_core_halt()
 {
-	/* unmask signals and call sigsuspend */
+	/* 
+		Interrupts are masked while we wait, so that the handler does not run
+		while we hold core_halt_mutex. Interrupts raised meanwhile set 
+		restart_pending, so we do not sleep on them.
+	*/
 	Core* core = curr_core();
 	assert(! core->int_disabled);
-	CHECKRC(pthread_sigmask(SIG_BLOCK, &sigusr1_set, NULL));
+	cpu_disable_interrupts();
 	pthread_mutex_lock(& core_halt_mutex);
-	core->halted = 1;
-	rlist_push_front(&halted_list, & core->halted_node);
-	while(core->halted)
-		pthread_cond_wait(& core->halt_cond, & core_halt_mutex);
+	/* A restart sent while we were running is not lost */
+	if(! core->restart_pending) {
+		core->halted = 1;
+		rlist_push_front(&halted_list, & core->halted_node);
+		while(core->halted)
+			pthread_cond_wait(& core->halt_cond, & core_halt_mutex);
+	}
+	core->restart_pending = 0;
 	assert(! core->halted);
 	pthread_mutex_unlock(& core_halt_mutex);
-	CHECKRC(pthread_sigmask(SIG_UNBLOCK, &sigusr1_set, NULL));
-	dispatch_interrupts(core);
+	cpu_enable_interrupts();
 }
 
 static inline void core_restart(Core* core)
@@ -756,6 +855,8 @@ static inline void core_restart(Core* core)
 		rlist_remove(& core->halted_node);
 		pthread_cond_signal(& core->halt_cond);
 	}	
+	else
+		core->restart_pending = 1;
 }
 
 void cpu_core_restart(uint c)
@@ -782,6 +883,16 @@ void cpu_core_restart_all()
 	pthread_mutex_unlock(& core_halt_mutex);	
 }
 
+void cpu_relax()
+{
+	__builtin_ia32_pause();
+}
+
+void cpu_yield()
+{
+	sched_yield();
+}
+
 void cpu_core_barrier_sync()
 {
 	pthread_barrier_wait(& core_barrier);
@@ -802,23 +913,91 @@ void cpu_interrupt_handler(Interrupt interrupt, interrupt_handler handler)
 void cpu_disable_interrupts()
 {
 	Core* core = curr_core();
-	if(! core->int_disabled) {
-		CHECKRC(pthread_sigmask(SIG_BLOCK, &sigusr1_set, NULL));
-		core->int_disabled = 1;
-	}
+	core->int_disabled = 1;
+	__atomic_signal_fence(__ATOMIC_SEQ_CST);
 }
 
 void cpu_enable_interrupts()
 {
 	Core* core = curr_core();
 	if(core->int_disabled) {        
-		core->int_disabled = 0;
-		CHECKRC(pthread_sigmask(SIG_UNBLOCK, &sigusr1_set, NULL));      
-		dispatch_interrupts(curr_core());
+		/* This must be ordered before reading intpending; see raise_interrupt() */
+		__atomic_store_n(& core->int_disabled, 0, __ATOMIC_SEQ_CST);
+
+		/* An interrupt arrived while masked (see sigusr1_handler) */
+		if(core->sig_blocked) {
+			core->sig_blocked = 0;
+			CHECKRC(pthread_sigmask(SIG_UNBLOCK, &sigusr1_set, NULL));
+		}
+		dispatch_interrupts(core, IRQ_PATH_POLL);
 	}
 }
 
 
+#ifdef CPU_FAST_CONTEXT
+
+/*
+	Fast context switch for x86-64.
+
+	The callee-saved registers (rbx, rbp, r12-r15) and the control words 
+	of the SSE and x87 units are pushed on the stack of the old context, 
+	and its stack pointer is stored in oldctx->sp. Then, the same are 
+	popped from the stack of the new context, and we return to wherever 
+	the new context called cpu_swap_context() from.
+
+	Unlike swapcontext(), this makes no system call, since the signal mask
+	is left alone; all contexts are switched with interrupts disabled.
+ */
+__asm__(
+	".text\n"
+	".globl cpu_swap_context\n"
+	".type cpu_swap_context, @function\n"
+	"cpu_swap_context:\n"
+	"	pushq %rbp\n"
+	"	pushq %rbx\n"
+	"	pushq %r12\n"
+	"	pushq %r13\n"
+	"	pushq %r14\n"
+	"	pushq %r15\n"
+	"	subq $8, %rsp\n"
+	"	stmxcsr (%rsp)\n"
+	"	fnstcw 4(%rsp)\n"
+	"	movq %rsp, (%rdi)\n"
+	"	movq (%rsi), %rsp\n"
+	"	ldmxcsr (%rsp)\n"
+	"	fldcw 4(%rsp)\n"
+	"	addq $8, %rsp\n"
+	"	popq %r15\n"
+	"	popq %r14\n"
+	"	popq %r13\n"
+	"	popq %r12\n"
+	"	popq %rbx\n"
+	"	popq %rbp\n"
+	"	ret\n"
+	".size cpu_swap_context, .-cpu_swap_context\n"
+);
+
+
+void cpu_initialize_context(cpu_context_t* ctx, void* ss_sp, size_t ss_size, void (*ctx_func)())
+{
+	/* The top of the stack, aligned as the ABI requires */
+	uint64_t* top = (uint64_t*) (((uintptr_t)ss_sp + ss_size) & ~(uintptr_t)15);
+
+	/* 
+		Build the frame that cpu_swap_context() pops. The function is entered
+		by 'ret', as if it was called, with a null return address.
+	 */
+	uint64_t* sp = top - 9;
+	sp[8] = 0;                        /* return address of ctx_func */
+	sp[7] = (uint64_t) ctx_func;      /* popped by 'ret' */
+	for(int i=1; i<7; i++) sp[i] = 0; /* rbp, rbx, r12-r15 */
+	sp[0] = 0x1F80 | (0x037FUL << 32);  /* default MXCSR and x87 control word */
+
+	ctx->sp = sp;
+}
+
+#else
+
 void cpu_initialize_context(cpu_context_t* ctx, void* ss_sp, size_t ss_size, void (*ctx_func)())
 {
   /* Init the context from this context! */
@@ -837,9 +1016,13 @@ void cpu_initialize_context(cpu_context_t* ctx, void* ss_sp, size_t ss_size, voi
 
 void cpu_swap_context(cpu_context_t* oldctx, cpu_context_t* newctx)
 {
+	/* The signal mask belongs to the core, not the context (see sigusr1_handler) */
+	pthread_sigmask(0, NULL, & newctx->uc_sigmask);
 	swapcontext(oldctx, newctx);
 }
 
+#endif
+
 
 
 /*
@@ -859,8 +1042,8 @@ TimerDuration bios_set_timer(TimerDuration usec)
 
 	struct itimerspec oldtime;
 	
-	timer_settime(curr_core()->timer_id, 0, &newtime, &oldtime);
-	curr_core()->intpending[ALARM] = 0;
+	CHECK(timerfd_settime(curr_core()->timerfd, 0, &newtime, &oldtime));
+	__atomic_fetch_and(& curr_core()->intpending, ~(1u << ALARM), __ATOMIC_RELAXED);
 
 	assert(oldtime.it_interval.tv_sec ==0 && oldtime.it_interval.tv_nsec==0);
 	return 1000000*oldtime.it_value.tv_sec + oldtime.it_value.tv_nsec/1000ull;
@@ -874,10 +1057,157 @@ TimerDuration bios_cancel_timer()
 
 TimerDuration bios_clock()
 {
-	return system_clock * 1000ul;
+	return bios_clock_ns() / 1000ull;
 }	
 
 
+uint64_t bios_clock_ns()
+{
+	struct timespec ts;
+	CHECK(clock_gettime(CLOCK_MONOTONIC, &ts));
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+
+/*
+	hrtimers.
+
+	Each core keeps its armed hrtimers in a doubly linked list, sorted by
+	deadline, under the core's hrlock. The hrtimerfd of the core is armed
+	at the deadline of the first timer in the queue. When it expires, the 
+	PIC raises HRTIMER and the core runs the expired timers, in 
+	hrtimer_expire(), just before the HRTIMER handler.
+
+	The hrlock is taken with interrupts disabled, since hrtimer_expire()
+	takes it from interrupt context. Cancelling a timer does not re-arm
+	the hrtimerfd; if it then expires early, hrtimer_expire() finds no 
+	expired timer and re-arms it. This saves a system call per cancel, 
+	which is the common case for timeouts.
+ */
+
+/* Disable interrupts, returning the previous state */
+static inline int hrtimer_irq_save(Core* core)
+{
+	int was_disabled = core->int_disabled;
+	cpu_disable_interrupts();
+	return was_disabled;
+}
+
+static inline void hrtimer_irq_restore(int was_disabled)
+{
+	if(! was_disabled) cpu_enable_interrupts();
+}
+
+/* Arm the hrtimerfd at the first deadline of the queue. Called under hrlock. */
+static void hrtimer_program(Core* core)
+{
+	struct itimerspec newtime = { .it_interval = {0,0} };
+	bios_hrtimer* first = core->hrqueue.next;
+	if(first != & core->hrqueue) {
+		/* A zero it_value would disarm the timer */
+		uint64_t deadline = first->deadline ? first->deadline : 1;
+		newtime.it_value.tv_sec = deadline / 1000000000ull;
+		newtime.it_value.tv_nsec = deadline % 1000000000ull;
+	}
+	CHECK(timerfd_settime(core->hrtimerfd, TFD_TIMER_ABSTIME, &newtime, NULL));
+}
+
+/* Unlink an armed timer. Called under hrlock. */
+static inline void hrtimer_unlink(bios_hrtimer* timer)
+{
+	timer->prev->next = timer->next;
+	timer->next->prev = timer->prev;
+	timer->next = timer->prev = timer;
+	timer->core = -1;
+}
+
+static void hrtimer_expire(Core* core)
+{
+	int was_disabled = hrtimer_irq_save(core);
+
+	pthread_spin_lock(& core->hrlock);
+	uint64_t now = bios_clock_ns();
+	bios_hrtimer* first;
+	while((first = core->hrqueue.next) != & core->hrqueue) {
+		if(first->deadline > now) {
+			/* Maybe time has passed while running callbacks */
+			now = bios_clock_ns();
+			if(first->deadline > now) break;
+		}
+		hrtimer_unlink(first);
+		core->hrt_fired++;
+
+		/* The callback may re-arm the timer, or arm others */
+		pthread_spin_unlock(& core->hrlock);
+		if(first->func) first->func(first);
+		pthread_spin_lock(& core->hrlock);
+	}
+	hrtimer_program(core);
+	pthread_spin_unlock(& core->hrlock);
+
+	hrtimer_irq_restore(was_disabled);
+}
+
+
+void bios_hrtimer_init(bios_hrtimer* timer, bios_hrtimer_func* func)
+{
+	timer->deadline = 0;
+	timer->func = func;
+	timer->next = timer->prev = timer;
+	timer->core = -1;
+}
+
+
+void bios_hrtimer_start(bios_hrtimer* timer, uint64_t deadline)
+{
+	Core* core = curr_core();
+
+	/* Cancel it, if it is armed (maybe on another core) */
+	bios_hrtimer_cancel(timer);
+
+	int was_disabled = hrtimer_irq_save(core);
+	pthread_spin_lock(& core->hrlock);
+
+	timer->deadline = deadline;
+	timer->core = core->id;
+
+	/* Search from the back; new deadlines are usually later than older ones */
+	bios_hrtimer* pos = core->hrqueue.prev;
+	while(pos != & core->hrqueue && pos->deadline > deadline)
+		pos = pos->prev;
+	timer->prev = pos;
+	timer->next = pos->next;
+	pos->next->prev = timer;
+	pos->next = timer;
+
+	if(core->hrqueue.next == timer)
+		hrtimer_program(core);
+
+	pthread_spin_unlock(& core->hrlock);
+	hrtimer_irq_restore(was_disabled);
+}
+
+
+int bios_hrtimer_cancel(bios_hrtimer* timer)
+{
+	int c = __atomic_load_n(& timer->core, __ATOMIC_ACQUIRE);
+	if(c < 0) return 0;
+
+	Core* core = & CORE[c];
+	int was_disabled = hrtimer_irq_save(curr_core());
+	pthread_spin_lock(& core->hrlock);
+
+	/* Re-check, it may have expired meanwhile */
+	int armed = (timer->core == c);
+	if(armed) 
+		hrtimer_unlink(timer);
+
+	pthread_spin_unlock(& core->hrlock);
+	hrtimer_irq_restore(was_disabled);
+	return armed;
+}
+
+
 
 uint bios_serial_ports()
 {
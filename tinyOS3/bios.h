@@ -61,6 +61,12 @@
 	it with some time interval. When the timer expires, the ALARM interrupt is raised 
 	for the core.
 
+	In addition, each core has a queue of _deadline timers_ (hrtimers), each with
+	its own callback. Any number of hrtimers can be armed at the same time,
+	independently of the core timer. When some hrtimers expire, the HRTIMER 
+	interrupt is raised for the core, and their callbacks are run just before 
+	its handler.
+
 	Serial ports
 	------------- 
 
@@ -119,6 +125,7 @@ typedef enum Interrupt
 {
 	ICI,				/**< Raised by some core, via cpu_ici() */
 	ALARM,            	/**< Raised when the core's timer expires. */
+	HRTIMER,			/**< Raised when some hrtimers of the core expire */
 	SERIAL_RX_READY,	/**< Raised when data is available for reading 
 						   from a serial port */
 	SERIAL_TX_READY,	/**< Raised when a serial port is ready to accept 
@@ -134,6 +141,38 @@ typedef enum Interrupt
 /** @brief Maximum number of terminals for a virtual machine. */
 #define MAX_TERMINALS 4
 
+/**
+	@brief The methods for delivering interrupts to cores.
+
+	@see vm_set_irq_delivery
+*/
+typedef enum irq_delivery
+{
+	IRQ_DELIVERY_SHARED,	/**< Pending interrupts are marked in shared memory.
+							   A halted core is woken up, and a signal is sent
+							   only to preempt a running core with interrupts 
+							   enabled. This is the default. */
+	IRQ_DELIVERY_SIGNAL		/**< Every interrupt is delivered by a signal to the
+							   core thread. */
+} irq_delivery;
+
+/**
+	@brief Set the method for delivering interrupts to cores.
+
+	This must be called before @c vm_boot.
+*/
+void vm_set_irq_delivery(irq_delivery mode);
+
+/**
+	@brief Print interrupt statistics when the VM shuts down.
+
+	If @c flag is non-zero, @c vm_boot prints to @c stderr, for each core, 
+	the interrupts raised and delivered, and the average and maximum 
+	latency of delivery via signals and via shared memory.
+*/
+void vm_set_print_stats(int flag);
+
+
 /**
 	@brief Boot a CPU with the given number of cores and boot function.
 
@@ -213,6 +252,9 @@ void cpu_interrupt_handler(Interrupt interrupt, interrupt_handler handler);
 	If an interrupt arrives while interrupts are disabled, it will be
 	marked as _pending_ and will be raised when interrupts are re-enabled.
 
+	This call is cheap: it only sets a flag of the core, and does not
+	make a system call.
+
 	@see cpu_enable_interrupts
  */
 void cpu_disable_interrupts();
@@ -237,6 +279,10 @@ void cpu_enable_interrupts();
 
 	This function is useful when a core becomes idle. An idle core does not
 	consume simulation resources (in particular CPU time).
+
+	If the core was restarted (see @c cpu_core_restart) since the last
+	time it halted, this function returns immediately. Thus, a restart
+	that is sent just before the core halts is not lost.
 */
 void cpu_core_halt();
 
@@ -244,7 +290,8 @@ void cpu_core_halt();
 /**
 	@brief Restart the given core.
 
-	This call will restart the given core, if it was halted.
+	This call will restart the given core, if it was halted. If it was
+	not halted, its next call to @c cpu_core_halt will return immediately.
 	@param c the core to restart
 */
 void cpu_core_restart(uint c);
@@ -264,10 +311,48 @@ void cpu_core_restart_one();
 void cpu_core_restart_all();
 
 
+/**
+	@brief Tell the core that it is spinning, waiting for another core.
+
+	This is a hint to the processor (a @c pause instruction), to be
+	called in every iteration of a spin loop.
+
+	@see cpu_yield
+*/
+void cpu_relax();
+
+
+/**
+	@brief Give up the host processor for a moment.
+
+	On the simulated machine, the cores may share host processors, so a
+	core that waits for another core may keep it from running. Spinlocks
+	that cannot yield to another thread should call this when they give up
+	spinning, after spinning with @c cpu_relax() for a while.
+*/
+void cpu_yield();
+
+
+/**
+	@brief Defined if the fast, assembly-based context switch is used.
+
+	On x86-64, contexts are switched by saving and restoring only the 
+	callee-saved registers on the stack of each thread. Otherwise, and 
+	in builds with valgrind support (where @c NVALGRIND is not defined), 
+	the portable @c ucontext calls are used.
+*/
+#if defined(__x86_64__) && defined(NVALGRIND)
+#define CPU_FAST_CONTEXT
+#endif
+
 /**
 	@brief A type for saving CPU context into.
 */
+#ifdef CPU_FAST_CONTEXT
+typedef struct { void* sp; } cpu_context_t;
+#else
 typedef ucontext_t cpu_context_t;
+#endif
 
 
 /**
@@ -289,6 +374,11 @@ void cpu_initialize_context(cpu_context_t* ctx, void* ss_sp, size_t ss_size, voi
 	Save the current context into @c oldctx and load the contents of @c newctx
 	into the CPU.
 
+	The signal mask is not saved or restored by the fast context switch.
+	Contexts must be switched with interrupts disabled, and the interrupt
+	state is restored by the new context itself (see 
+	@c cpu_enable_interrupts).
+
 	@param oldctx pointer to the storage for the old context
 	@param newctx pointer to the new context to be loaded
 */
@@ -301,10 +391,10 @@ void cpu_swap_context(cpu_context_t* oldctx, cpu_context_t* newctx);
 /** 
 	@brief Reset the core timer to the specified interval.
 
-	The interval for the timer is given in microseconds, but the 
-	accuracy of the alarm is much coarser, to the order of 10 msec
-	(that is, 10,000 microseconds). After the interval expires, the
-	core receives an ALARM interrupt.
+	The interval for the timer is given in microseconds. The 
+	accuracy of the alarm is that of the host timers, plus the 
+	interrupt delivery latency (tens of microseconds). After the
+	interval expires, the core receives an ALARM interrupt.
 
 	This function can be called even if the timer is already activated;
 	in this case, the previous timer countdown is canceled and the timer resets
@@ -332,17 +422,92 @@ TimerDuration bios_cancel_timer();
 /**
 	@brief Get the current time from the hardware clock.
 
-	This function returns a real-time clock value, in usec.
-	The value of the clock is 10 times the number of seconds since
-	the epoch. 
+	This function returns a monotonic clock value, in usec, since
+	some arbitrary point in the past. It is equal to 
+	@c bios_clock_ns()/1000.
 
-	The resolution of the clock is very low, currently 
-	around 100 msec. Therefore, it is inappropriate for any type of
-	precise timing.
+	@see bios_clock_ns
  */
 TimerDuration bios_clock();
 
 
+/**
+	@brief Get the current time from the hardware clock, in nsec.
+
+	This function returns a monotonic clock value, in nanoseconds, since
+	some arbitrary point in the past (the same for all cores). Its
+	accuracy is that of the host clock, normally well below a microsecond.
+	The deadlines of hrtimers are given in this clock.
+ */
+uint64_t bios_clock_ns();
+
+
+/** @brief An hrtimer, see @c bios_hrtimer_init */
+typedef struct bios_hrtimer bios_hrtimer;
+
+/** @brief The callback of an hrtimer */
+typedef void bios_hrtimer_func(bios_hrtimer* timer);
+
+/**
+	@brief A deadline timer.
+
+	An hrtimer is allocated by the caller (typically, embedded in some
+	larger object), initialized by @c bios_hrtimer_init and armed by
+	@c bios_hrtimer_start. Only @c deadline may be read by the caller; the
+	rest of the fields are private to the BIOS.
+ */
+struct bios_hrtimer {
+	uint64_t deadline;             /**< @brief The deadline, in @c bios_clock_ns() time */
+	bios_hrtimer_func* func;       /**< @brief The callback */
+	bios_hrtimer* prev;            /**< @brief Links in the queue of the core */
+	bios_hrtimer* next;            /**< @brief Links in the queue of the core */
+	int core;                      /**< @brief The core it is armed on, or -1 */
+};
+
+
+/**
+	@brief Initialize an hrtimer.
+
+	The timer is initially not armed.
+
+	@param timer the timer to initialize
+	@param func the callback to run when the timer expires, or @c NULL if
+	   only the HRTIMER handler is needed
+ */
+void bios_hrtimer_init(bios_hrtimer* timer, bios_hrtimer_func* func);
+
+
+/**
+	@brief Arm an hrtimer on the current core.
+
+	When @c bios_clock_ns() reaches @c deadline, the HRTIMER interrupt is 
+	raised for the current core, and the callback of the timer is called,
+	on this core, just before the HRTIMER handler (even if the handler is 
+	@c NULL). Callbacks run with interrupts disabled, in the order of their
+	deadlines; they must not switch context or block, but they may
+	arm or cancel hrtimers. A deadline in the past expires immediately.
+
+	If the timer is already armed, it is first canceled.
+
+	@param timer the timer
+	@param deadline the expiration time, in @c bios_clock_ns() time
+ */
+void bios_hrtimer_start(bios_hrtimer* timer, uint64_t deadline);
+
+
+/**
+	@brief Cancel an hrtimer.
+
+	This can be called from any core, and even if the timer is not armed.
+	If it returns 0, the callback of the timer may already have run, or 
+	may be running on some other core at the time of the call.
+
+	@param timer the timer
+	@returns 1 if the timer was armed and has been canceled, else 0
+ */
+int bios_hrtimer_cancel(bios_hrtimer* timer);
+
+
 
 
 /**
@@ -19,6 +19,234 @@
   */
 
 
+/*
+	Lock profiling.
+	----------------
+
+	When @c lock_profiling is set, every lock acquisition is recorded in
+	a table of per-lock statistics, keyed by the address of the lock. 
+	Slots are claimed with a CAS on the key and never freed, so the table
+	needs no lock of its own. The rest of an entry is only updated by the
+	holder of its lock, so plain updates suffice.
+
+	Since the key is only the address, a lock whose memory is reused by
+	another lock (e.g., a Mutex on the stack, or in a freed object) shares
+	its entry with it. Each entry records the site of its first
+	acquisition, and unnamed locks are summed up by it in the report. When
+	the table is full, the acquisitions of new locks are only counted.
+
+	Sleeps on the kernel wait channels are recorded in a similar table,
+	keyed by the name of the channel. Many threads may sleep on the same
+	channel, so these entries are updated atomically.
+ */
+int lock_profiling = 0;
+
+#define LOCKPROF_SLOTS 4096
+#define WCHAN_SLOTS 128
+#define WCHAN_HIST 16
+
+/** \cond HELPER The waiting done by one acquisition */
+typedef struct __lock_wait {
+	int contended;			/* the lock was not taken at the first attempt */
+	unsigned int spins;		/* pause instructions */
+	unsigned int yields;	/* calls to yield(SCHED_MUTEX) */
+	unsigned int sleeps;	/* sleeps on a wait queue */
+} __lock_wait;
+
+typedef struct __lock_stats {
+	const void* lock;		/* the key */
+	const char* name;
+	const void* site;		/* the caller of the first acquisition */
+	unsigned long acquired, contended, spins, yields, sleeps;
+	uint64_t wait_ns, hold_ns, hold_max_ns;
+	uint64_t hold_start;
+} __lock_stats;
+
+typedef struct __wchan_stats {
+	const char* wchan;		/* the key */
+	unsigned long sleeps;
+	uint64_t blocked_ns;
+	unsigned long hist[WCHAN_HIST];	/* by log2 of the blocked usec */
+} __wchan_stats;
+/** \endcond */
+
+static __lock_stats lockprof[LOCKPROF_SLOTS];
+static __wchan_stats wchanprof[WCHAN_SLOTS];
+static unsigned long lockprof_dropped, wchanprof_dropped;
+
+/* Find the slot of a lock, or claim a free one for it */
+static __lock_stats* lockprof_entry(const void* lock)
+{
+	size_t h = (size_t)(((uintptr_t)lock >> 3) * 2654435761u);
+	for(size_t i=0; i < LOCKPROF_SLOTS; i++) {
+		__lock_stats* s = & lockprof[(h+i) % LOCKPROF_SLOTS];
+		const void* key = __atomic_load_n(& s->lock, __ATOMIC_ACQUIRE);
+		if(key == NULL && __atomic_compare_exchange_n(& s->lock, &key, lock,
+				0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+			return s;
+		if(key == lock) return s;
+	}
+	__atomic_fetch_add(& lockprof_dropped, 1, __ATOMIC_RELAXED);
+	return NULL;
+}
+
+/* Find the slot of a wait channel, or claim a free one for it */
+static __wchan_stats* wchanprof_entry(const char* wchan)
+{
+	size_t h = (size_t)(((uintptr_t)wchan >> 3) * 2654435761u);
+	for(size_t i=0; i < WCHAN_SLOTS; i++) {
+		__wchan_stats* s = & wchanprof[(h+i) % WCHAN_SLOTS];
+		const char* key = __atomic_load_n(& s->wchan, __ATOMIC_ACQUIRE);
+		if(key == NULL && __atomic_compare_exchange_n(& s->wchan, &key, wchan,
+				0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+			return s;
+		if(key == wchan) return s;
+	}
+	__atomic_fetch_add(& wchanprof_dropped, 1, __ATOMIC_RELAXED);
+	return NULL;
+}
+
+void lock_profile_name(const void* lock, const char* name)
+{
+	if(! lock_profiling) return;
+	__lock_stats* s = lockprof_entry(lock);
+	if(s) s->name = name;
+}
+
+int lock_profile_get(const void* lock, unsigned long* acquired, unsigned long* contended)
+{
+	size_t h = (size_t)(((uintptr_t)lock >> 3) * 2654435761u);
+	for(size_t i=0; i < LOCKPROF_SLOTS; i++) {
+		__lock_stats* s = & lockprof[(h+i) % LOCKPROF_SLOTS];
+		const void* key = __atomic_load_n(& s->lock, __ATOMIC_ACQUIRE);
+		if(key == NULL) break;
+		if(key == lock) {
+			*acquired = s->acquired;
+			*contended = s->contended;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* Called by the new holder of lock, which started waiting at start */
+static void lockprof_acquired(const void* lock, const char* name, const void* site,
+	__lock_wait* w, uint64_t start)
+{
+	__lock_stats* s = lockprof_entry(lock);
+	if(s == NULL) return;
+	if(name) s->name = name;
+	if(s->site == NULL) s->site = site;
+
+	uint64_t now = bios_clock_ns();
+	s->acquired++;
+	s->contended += w->contended;
+	s->spins += w->spins;
+	s->yields += w->yields;
+	s->sleeps += w->sleeps;
+	s->wait_ns += now - start;
+	s->hold_start = now;
+}
+
+/* Called by the holder of lock, before it releases it */
+static void lockprof_released(const void* lock)
+{
+	__lock_stats* s = lockprof_entry(lock);
+	if(s == NULL || s->hold_start == 0) return;
+
+	uint64_t held = bios_clock_ns() - s->hold_start;
+	s->hold_start = 0;
+	s->hold_ns += held;
+	if(held > s->hold_max_ns) s->hold_max_ns = held;
+}
+
+static void wchanprof_blocked(const char* wchan, uint64_t blocked_ns)
+{
+	__wchan_stats* s = wchanprof_entry(wchan);
+	if(s == NULL) return;
+
+	uint64_t usec = blocked_ns / 1000;
+	int bucket = (usec == 0) ? 0 : 64 - __builtin_clzll(usec);
+	if(bucket >= WCHAN_HIST) bucket = WCHAN_HIST-1;
+
+	__atomic_fetch_add(& s->sleeps, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(& s->blocked_ns, blocked_ns, __ATOMIC_RELAXED);
+	__atomic_fetch_add(& s->hist[bucket], 1, __ATOMIC_RELAXED);
+}
+
+static int lockprof_by_wait(const void* a, const void* b)
+{
+	const __lock_stats* x = a;
+	const __lock_stats* y = b;
+	return (x->wait_ns < y->wait_ns) - (x->wait_ns > y->wait_ns);
+}
+
+void lock_profile_report()
+{
+	/* Sum up the locks with the same name, and the unnamed ones by site */
+	static __lock_stats sum[LOCKPROF_SLOTS];
+	int nsum = 0;
+	for(int i=0; i < LOCKPROF_SLOTS; i++) {
+		__lock_stats* s = & lockprof[i];
+		if(s->lock == NULL || s->acquired == 0) continue;
+
+		int j;
+		for(j=0; j < nsum; j++)
+			if(s->name ? (sum[j].name && strcmp(sum[j].name, s->name) == 0)
+					: (sum[j].name == NULL && sum[j].site == s->site))
+				break;
+		if(j == nsum) sum[nsum++] = (__lock_stats) { .name = s->name, .site = s->site };
+		sum[j].acquired += s->acquired;
+		sum[j].contended += s->contended;
+		sum[j].spins += s->spins;
+		sum[j].yields += s->yields;
+		sum[j].sleeps += s->sleeps;
+		sum[j].wait_ns += s->wait_ns;
+		sum[j].hold_ns += s->hold_ns;
+		if(s->hold_max_ns > sum[j].hold_max_ns) sum[j].hold_max_ns = s->hold_max_ns;
+	}
+	qsort(sum, nsum, sizeof(__lock_stats), lockprof_by_wait);
+
+	fprintf(stderr, "Locks: %-20s %10s %10s %12s %8s %8s %10s %10s %10s\n",
+		"name", "acquired", "contended", "spins", "yields", "sleeps", 
+		"wait ms", "hold ms", "max us");
+	for(int j=0; j < nsum; j++) {
+		char site[24];
+		if(sum[j].name == NULL)
+			snprintf(site, sizeof(site), "@%p", sum[j].site);
+		fprintf(stderr, "Locks: %-20s %10lu %10lu %12lu %8lu %8lu %10.3f %10.3f %10.1f\n",
+			sum[j].name ? sum[j].name : site, sum[j].acquired, sum[j].contended, sum[j].spins,
+			sum[j].yields, sum[j].sleeps, sum[j].wait_ns*1E-6, sum[j].hold_ns*1E-6,
+			sum[j].hold_max_ns*1E-3);
+	}
+	if(lockprof_dropped)
+		fprintf(stderr, "Locks: %lu acquisitions not recorded (table full, %d locks)\n", 
+			lockprof_dropped, LOCKPROF_SLOTS);
+
+	fprintf(stderr, "Wchan: %-20s %10s %10s  %s\n", 
+		"name", "sleeps", "blocked ms", "histogram (usec: count)");
+	for(int i=0; i < WCHAN_SLOTS; i++) {
+		__wchan_stats* s = & wchanprof[i];
+		if(s->wchan == NULL || s->sleeps == 0) continue;
+		fprintf(stderr, "Wchan: %-20s %10lu %10.3f ", s->wchan, s->sleeps, s->blocked_ns*1E-6);
+		for(int b=0; b < WCHAN_HIST; b++) {
+			if(s->hist[b] == 0) continue;
+			if(b < WCHAN_HIST-1)
+				fprintf(stderr, " <%lu:%lu", 1ul << b, s->hist[b]);
+			else
+				fprintf(stderr, " >=%lu:%lu", 1ul << (b-1), s->hist[b]);
+		}
+		fprintf(stderr, "\n");
+	}
+	if(wchanprof_dropped)
+		fprintf(stderr, "Wchan: %lu sleeps not recorded (table full)\n", wchanprof_dropped);
+}
+
+#undef LOCKPROF_SLOTS
+#undef WCHAN_SLOTS
+#undef WCHAN_HIST
+
+
 /*
  	Pre-emption aware mutex.
  	-------------------------
@@ -29,35 +257,251 @@
  	Therefore, we can call the same function from both the preemptive and
  	the non-preemptive domain of the kernel.
 
+ 	There are two kinds of mutex. A test-and-set lock is a single flag.
+ 	A ticket lock hands out tickets from @c next, and the lock belongs to
+ 	the thread whose ticket equals @c owner. The waiters of a ticket lock
+ 	only read @c owner, and they get the lock in FIFO order.
+
+ 	A waiter that is preempted, or interrupted by a handler that takes the
+	same lock, holds up everybody behind it in the queue. Therefore, ticket 
+	locks must only be taken with preemption off (e.g., the scheduler locks).
+
+ 	Waiters spin with exponential backoff. In the preemptive domain, a
+ 	waiter yields when the lock has not changed hands for MUTEX_SPINS
+ 	pauses, since the holder has probably been preempted. With preemption
+ 	off, it gives up the host processor instead (see cpu_yield).
+
+ 	The third kind, the blocking lock, is futex-like. Its state in @c next
+ 	is 0 if it is free, 1 if it is held, and 2 if it is held and threads may
+ 	be sleeping on it. The sleepers are kept in a small hash table of wait
+ 	queues, keyed by the address of the mutex, so that the mutex itself
+ 	stays small. A waiter spins only while the holder is running on another
+ 	core; then it marks the lock contended and sleeps. The unlocker of a
+ 	contended lock frees it and wakes up one sleeper, which competes for 
+ 	the lock again. Cond_Broadcast moves the waiters of a held blocking lock
+ 	to these queues, instead of waking them all up (see cv_requeue).
+
  	The implementation is based on GCC atomics, as the standard C11 primitives
  	are not supported by all recent compilers. Eventually, this will change.
  */
-void Mutex_Lock(Mutex* lock)
-{
 #define MUTEX_SPINS 1000
+#define MUTEX_BACKOFF_MAX 64
 
-  while(__atomic_test_and_set(lock,__ATOMIC_ACQUIRE)) {
-    int spin=MUTEX_SPINS;
-    while(__atomic_load_n(lock, __ATOMIC_RELAXED)) {
-      __builtin_ia32_pause();      
-      if(spin>0) 
-      	spin--; 
-      else { 
-      	spin=MUTEX_SPINS; 
-      	if(get_core_preemption())
-      		yield(SCHED_MUTEX); 
-      }
-    }
-  }
-#undef MUTEX_SPINS
+static inline void mutex_backoff(unsigned int* backoff, unsigned int* spin, __lock_wait* w)
+{
+	for(unsigned int i=0; i < *backoff; i++)
+		cpu_relax();
+
+	w->spins += *backoff;
+	*spin += *backoff;
+	if(*backoff < MUTEX_BACKOFF_MAX) *backoff <<= 1;
+
+	if(*spin >= MUTEX_SPINS) {
+		*spin = 0;
+		if(get_core_preemption()) {
+			w->yields++;
+			yield(SCHED_MUTEX);
+		}
+		else
+			cpu_yield();
+	}
+}
+
+
+enum { MUTEX_TAS=0, MUTEX_TICKET=1, MUTEX_BLOCKING=2 };
+enum { MUTEX_FREE=0, MUTEX_LOCKED=1, MUTEX_CONTENDED=2 };
+
+#define MUTEX_BUCKETS 64
+
+/** \cond HELPER The wait queues of blocking locks. */
+typedef struct __mutex_bucket {
+	Mutex lock;				/* a spinlock, taken with preemption off */
+	rlnode waiters;			/* the sleepers of all mutexes hashed here */
+} __mutex_bucket;
+
+typedef struct __mutex_waiter {
+	rlnode node;
+	TCB* thread;
+	Mutex* mutex;			/* the mutex waited for */
+	int woken;				/* set by the unlocker */
+} __mutex_waiter;
+/** \endcond */
+
+static __mutex_bucket mutex_buckets[MUTEX_BUCKETS];
+
+static void mutex_lock_as(Mutex* lock, unsigned short taken, const char* name, const void* site);
+
+static inline __mutex_bucket* mutex_bucket_lock(Mutex* mx)
+{
+	__mutex_bucket* b = & mutex_buckets[((uintptr_t)mx >> 4) % MUTEX_BUCKETS];
+	mutex_lock_as(& b->lock, MUTEX_LOCKED, "mutex_bucket", NULL);
+	if(b->waiters.next == NULL) rlnode_new(& b->waiters);
+	return b;
+}
+
+/* Return 1 if the holder of a blocking lock is running on another core */
+static int mutex_holder_running(Mutex* mx)
+{
+	TCB* holder = __atomic_load_n((TCB**) & mx->holder, __ATOMIC_RELAXED);
+	if(holder == NULL) return 1;	/* Just taken, the holder is not recorded yet */
+
+	uint ncores = cpu_cores();
+	for(uint c=0; c < ncores; c++)
+		if(c != cpu_core_id && cctx[c].current_thread == holder) return 1;
+	return 0;
+}
+
+/* 
+	Lock a blocking mutex, taking it as @c taken. A thread that has slept on
+	the mutex must leave it contended when it takes it, since there may be
+	more sleepers.
+ */
+static void mutex_lock_blocking(Mutex* mx, unsigned short taken, __lock_wait* w)
+{
+	unsigned int backoff = 1;
+
+	w->contended = 1;
+	while(1) {
+		/* Spin while the holder is running */
+		for(unsigned int spin = 0; spin < MUTEX_SPINS; spin += backoff) {
+			unsigned short state = __atomic_load_n(& mx->next, __ATOMIC_RELAXED);
+			if(state == MUTEX_FREE) {
+				if(__atomic_compare_exchange_n(& mx->next, &state, taken,
+						0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+					goto acquired;
+				continue;
+			}
+			if(! mutex_holder_running(mx)) break;
+			for(unsigned int i=0; i < backoff; i++)
+				__builtin_ia32_pause();
+			w->spins += backoff;
+			if(backoff < MUTEX_BACKOFF_MAX) backoff <<= 1;
+		}
+
+		/* Sleep until an unlocker wakes us up */
+		int preempt = preempt_off;
+		__mutex_waiter waiter = { .thread = CURTHREAD, .mutex = mx, .woken = 0 };
+		rlnode_init(& waiter.node, &waiter);
+
+		__mutex_bucket* b = mutex_bucket_lock(mx);
+		if(__atomic_exchange_n(& mx->next, MUTEX_CONTENDED, __ATOMIC_ACQUIRE) == MUTEX_FREE) {
+			Mutex_Unlock(& b->lock);
+			if(preempt) preempt_on;
+			goto acquired;
+		}
+		rlist_push_back(& b->waiters, & waiter.node);
+		w->sleeps++;
+		sleep_releasing_wchan(STOPPED, & b->lock, SCHED_MUTEX, "Mutex_Lock", NO_TIMEOUT);
+
+		/* Only the unlocker can wake us up, but be careful anyway */
+		if(! __atomic_load_n(& waiter.woken, __ATOMIC_ACQUIRE)) {
+			mutex_lock_as(& b->lock, MUTEX_LOCKED, "mutex_bucket", NULL);
+			if(! waiter.woken) rlist_remove(& waiter.node);
+			Mutex_Unlock(& b->lock);
+		}
+		if(preempt) preempt_on;
+
+		taken = MUTEX_CONTENDED;
+		backoff = 1;
+	}
+
+acquired:
+	__atomic_store_n((TCB**) & mx->holder, CURTHREAD, __ATOMIC_RELAXED);
+}
+
+static void mutex_unlock_blocking(Mutex* mx)
+{
+	__atomic_store_n((TCB**) & mx->holder, NULL, __ATOMIC_RELAXED);
+	if(__atomic_exchange_n(& mx->next, MUTEX_FREE, __ATOMIC_RELEASE) != MUTEX_CONTENDED)
+		return;
+
+	/* Wake up the first sleeper on this mutex */
+	int preempt = preempt_off;
+	__mutex_bucket* b = mutex_bucket_lock(mx);
+	for(rlnode* p = b->waiters.next; p != & b->waiters; p = p->next) {
+		__mutex_waiter* waiter = p->obj;
+		if(waiter->mutex != mx) continue;
+		rlist_remove(p);
+		__atomic_store_n(& waiter->woken, 1, __ATOMIC_RELEASE);
+		wakeup(waiter->thread);
+		break;
+	}
+	Mutex_Unlock(& b->lock);
+	if(preempt) preempt_on;
+}
+
+
+/*
+	Take a mutex. A blocking mutex is taken as @c taken (see @c
+	mutex_lock_blocking). When profiling, @c name (if not NULL) names
+	the lock in the report, and @c site is the caller.
+ */
+static void mutex_lock_as(Mutex* lock, unsigned short taken, const char* name, const void* site)
+{
+	unsigned int backoff = 1, spin = 0;
+	__lock_wait w = { 0, 0, 0, 0 };
+	uint64_t start = lock_profiling ? bios_clock_ns() : 0;
+
+	if(lock->kind == MUTEX_BLOCKING) {
+		unsigned short state = MUTEX_FREE;
+		if(! __atomic_compare_exchange_n(& lock->next, &state, taken,
+				0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			mutex_lock_blocking(lock, taken, &w);
+		else
+			__atomic_store_n((TCB**) & lock->holder, CURTHREAD, __ATOMIC_RELAXED);
+	}
+	else if(lock->kind == MUTEX_TICKET) {
+		unsigned short ticket = __atomic_fetch_add(& lock->next, 1, __ATOMIC_RELAXED);
+		unsigned short owner;
+		while((owner = __atomic_load_n(& lock->owner, __ATOMIC_ACQUIRE)) != ticket) {
+			/* The further back in the queue, the longer we can wait */
+			unsigned short ahead = ticket - owner;
+			if(backoff < ahead) 
+				backoff = (ahead < MUTEX_BACKOFF_MAX) ? ahead : MUTEX_BACKOFF_MAX;
+			w.contended = 1;
+			mutex_backoff(&backoff, &spin, &w);
+
+			/* Start over when the lock changes hands */
+			if(__atomic_load_n(& lock->owner, __ATOMIC_RELAXED) != owner) {
+				backoff = 1;
+				spin = 0;
+			}
+		}
+	} 
+	else {
+		while(__atomic_exchange_n(& lock->next, 1, __ATOMIC_ACQUIRE)) {
+			w.contended = 1;
+			while(__atomic_load_n(& lock->next, __ATOMIC_RELAXED))
+				mutex_backoff(&backoff, &spin, &w);
+		}
+	}
+
+	if(lock_profiling) lockprof_acquired(lock, name, site, &w, start);
+}
+
+
+void Mutex_Lock(Mutex* lock)
+{
+	mutex_lock_as(lock, MUTEX_LOCKED, NULL, __builtin_return_address(0));
 }
 
 
 void Mutex_Unlock(Mutex* lock)
 {
-  __atomic_clear(lock, __ATOMIC_RELEASE);
+	if(lock_profiling) lockprof_released(lock);
+
+	if(lock->kind == MUTEX_BLOCKING)
+		mutex_unlock_blocking(lock);
+	else if(lock->kind == MUTEX_TICKET)
+		__atomic_store_n(& lock->owner, lock->owner + 1, __ATOMIC_RELEASE);
+	else
+		__atomic_store_n(& lock->next, 0, __ATOMIC_RELEASE);
 }
 
+#undef MUTEX_SPINS
+#undef MUTEX_BACKOFF_MAX
+#undef MUTEX_BUCKETS
+
 
 /*
 	Condition variables.	
@@ -71,9 +515,17 @@ typedef struct __cv_waiter {
 	sig_atomic_t signalled;		/* this is set if the thread is signalled */
 	sig_atomic_t removed;		/* this is set if the waiter is removed 
 								   from the ring */
+	Mutex* mutex;				/* the blocking mutex to requeue on, or NULL */
+	__mutex_waiter requeued;	/* the waiter on the mutex, if requeued */
 } __cv_waiter;
 /** \endcond */
 
+/* Lock the waitset of a condition variable */
+static inline void cv_lock(CondVar* cv)
+{
+	mutex_lock_as(&(cv->waitset_lock), MUTEX_LOCKED, "cv waitset_lock", NULL);
+}
+
 /**
    @internal
    A helper routine to remove a condition waiter from the CondVar ring.
@@ -89,6 +541,63 @@ static inline void remove_from_ring(CondVar* cv, __cv_waiter* w)
 }
 
 
+/**
+   @internal
+   Put a waiter in the waitset of @c cv. On return, the waitset lock is
+   held; it is released by @c cv_sleep.
+ */
+static inline void cv_enqueue(CondVar* cv, __cv_waiter* waiter)
+{
+	waiter->thread = CURTHREAD;
+	waiter->signalled = 0;
+	waiter->removed = 0;
+	waiter->mutex = NULL;
+	waiter->requeued.mutex = NULL;
+	rlnode_init(& waiter->node, waiter);
+
+	cv_lock(cv);
+	/* We just push the current thread to the back of the list */
+	if(cv->waitset) {
+		__cv_waiter* wset = cv->waitset;
+		rlist_push_back(& wset->node, & waiter->node);
+	} else {
+		cv->waitset = waiter;
+	}
+}
+
+/**
+   @internal
+   Sleep on a waiter queued by @c cv_enqueue, releasing the waitset lock.
+   @returns 1 if signalled, 0 otherwise
+ */
+static inline int cv_sleep(CondVar* cv, __cv_waiter* waiter, 
+		enum SCHED_CAUSE cause, const char* wchan, TimerDuration timeout)
+{
+	sleep_releasing_wchan(STOPPED, &(cv->waitset_lock), cause, wchan, timeout);
+
+	/* Woke up, we must check wether we were signaled, and tidy up */
+	cv_lock(cv);
+	if(! waiter->removed) {
+		assert(! waiter->signalled);
+
+		/* We must remove ourselves from the ring! */
+		remove_from_ring(cv, waiter);
+	}
+	Mutex_Unlock(&(cv->waitset_lock));
+
+	/* If we were requeued, we may have to leave the mutex queue as well */
+	Mutex* mx = waiter->requeued.mutex;
+	if(mx != NULL && ! __atomic_load_n(& waiter->requeued.woken, __ATOMIC_ACQUIRE)) {
+		int preempt = preempt_off;
+		__mutex_bucket* b = mutex_bucket_lock(mx);
+		if(! waiter->requeued.woken) rlist_remove(& waiter->requeued.node);
+		Mutex_Unlock(& b->lock);
+		if(preempt) preempt_on;
+	}
+
+	return waiter->signalled;
+}
+
 /** 
    @internal
    @brief Wait on a condition variable, specifying the cause. 
@@ -109,6 +618,7 @@ static inline void remove_from_ring(CondVar* cv, __cv_waiter* w)
   @param mx The mutex to be unlocked as the thread sleeps.
   @param cv The condition variable to sleep on.
   @param cause A cause provided to the kernel scheduler.
+  @param wchan The wait channel the sleep is accounted to.
   @param timeout The time to sleep, or @c NO_TIMEOUT to sleep for ever.
 
   @returns 1 if this thread was woken up by signal/broadcast, 0 otherwise
@@ -116,37 +626,20 @@ static inline void remove_from_ring(CondVar* cv, __cv_waiter* w)
   @see Cond_Signal
   @see Cond_Broadcast
   */
-static int cv_wait(Mutex* mutex, CondVar* cv, 
-		enum SCHED_CAUSE cause, TimerDuration timeout)
+int cv_wait_wchan(Mutex* mutex, CondVar* cv, 
+		enum SCHED_CAUSE cause, const char* wchan, TimerDuration timeout)
 {
-	__cv_waiter waiter = { .thread=CURTHREAD, .signalled = 0, .removed=0 };
-	rlnode_init(& waiter.node, &waiter);
-
-	Mutex_Lock(&(cv->waitset_lock));
-	/* We just push the current thread to the back of the list */
-	if(cv->waitset) {
-		__cv_waiter* wset = cv->waitset;
-		rlist_push_back(& wset->node, & waiter.node);
-	} else {
-		cv->waitset = &waiter;
-	}
+	__cv_waiter waiter;
+	cv_enqueue(cv, &waiter);
+	if(mutex->kind == MUTEX_BLOCKING) waiter.mutex = mutex;
 
 	/* Now atomically release mutex and sleep */
 	Mutex_Unlock(mutex);
-	sleep_releasing(STOPPED, &(cv->waitset_lock), cause, timeout);
-
-	/* Woke up, we must check wether we were signaled, and tidy up */
-	Mutex_Lock(&(cv->waitset_lock));
-	if(! waiter.removed) {
-		assert(! waiter.signalled);
-
-		/* We must remove ourselves from the ring! */
-		remove_from_ring(cv, &waiter);
-	}
-	Mutex_Unlock(&(cv->waitset_lock));
+	int ret = cv_sleep(cv, &waiter, cause, wchan, timeout);
 
-	Mutex_Lock(mutex);
-	return waiter.signalled;
+	/* A requeued waiter may not be the last sleeper on the mutex */
+	mutex_lock_as(mutex, (waiter.requeued.mutex != NULL) ? MUTEX_CONTENDED : MUTEX_LOCKED, NULL, NULL);
+	return ret;
 }
 
 
@@ -156,14 +649,14 @@ static int cv_wait(Mutex* mutex, CondVar* cv,
   will actually find a waiter to signal, if one exists. 
   Else, it leaves the cv->waitset == NULL.
  */
-static inline void cv_signal(CondVar* cv)
+static inline void cv_signal(CondVar* cv, int handoff)
 {
 	/* Wakeup first process in the waiters' queue, if it exists. */
 	while(cv->waitset) {
 		__cv_waiter* waiter = cv->waitset;
 		remove_from_ring(cv, waiter);
 		waiter->removed = 1;
-		if(wakeup(waiter->thread)) {
+		if(handoff ? wakeup_handoff(waiter->thread) : wakeup(waiter->thread)) {
 			waiter->signalled = 1;
 			return;
 		}
@@ -184,21 +677,181 @@ int Cond_TimedWait(Mutex* mutex, CondVar* cv, timeout_t timeout)
 }
 
 
+usec_t GetTime()
+{
+	return bios_clock();
+}
+
+void Sleep(usec_t usec)
+{
+	SleepUntil(bios_clock() + usec);
+}
+
+void SleepUntil(usec_t abstime)
+{
+	/* No CondVar is needed; only the timeout can wake us up, but loop anyway */
+	TimerDuration now;
+	while((now = bios_clock()) < abstime)
+		sleep_releasing(STOPPED, NULL, SCHED_USER, abstime - now);
+}
+
+
 void Cond_Signal(CondVar* cv)
 {
-  Mutex_Lock(&(cv->waitset_lock));
-  cv_signal(cv);
+  cv_lock(cv);
+  cv_signal(cv, 0);
   Mutex_Unlock(&(cv->waitset_lock));
 }
 
 
-void Cond_Broadcast(CondVar* cv)
+/**
+  @internal
+  Helper for Cond_Broadcast. Move the first waiter of @c cv to the wait
+  queue of its mutex, without waking it up. This is only possible while
+  the mutex is held, since only an unlock will wake the waiter up.
+  @returns 1 if the waiter was requeued, 0 otherwise
+ */
+static int cv_requeue(CondVar* cv)
+{
+	__cv_waiter* waiter = cv->waitset;
+	Mutex* mx = waiter->mutex;
+	int requeued = 0;
+
+	int preempt = preempt_off;
+	__mutex_bucket* b = mutex_bucket_lock(mx);
+
+	/* Mark the mutex contended, so that its unlocker checks the queue */
+	unsigned short state = __atomic_load_n(& mx->next, __ATOMIC_RELAXED);
+	while(state != MUTEX_FREE) {
+		if(state == MUTEX_CONTENDED || 
+			__atomic_compare_exchange_n(& mx->next, &state, MUTEX_CONTENDED,
+				0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+			requeued = 1;
+			break;
+		}
+	}
+
+	if(requeued) {
+		remove_from_ring(cv, waiter);
+		waiter->removed = 1;
+		waiter->signalled = 1;
+		waiter->requeued = (__mutex_waiter) { .thread = waiter->thread, .mutex = mx, .woken = 0 };
+		rlnode_init(& waiter->requeued.node, & waiter->requeued);
+		rlist_push_back(& b->waiters, & waiter->requeued.node);
+	}
+
+	Mutex_Unlock(& b->lock);
+	if(preempt) preempt_on;
+	return requeued;
+}
+
+
+/**
+  @internal
+  Helper for Cond_Broadcast and cv_broadcast_handoff. Only the first 
+  waiter may get a handoff.
+ */
+static void cv_broadcast(CondVar* cv, int handoff)
 {
-  Mutex_Lock(&(cv->waitset_lock));
-  while(cv->waitset) cv_signal(cv);
+  cv_lock(cv);
+  cv_signal(cv, handoff);
+  while(cv->waitset) {
+    /* The rest would only wake up to sleep on the mutex, if it is held */
+    __cv_waiter* waiter = cv->waitset;
+    if(waiter->mutex == NULL || ! cv_requeue(cv))
+      cv_signal(cv, 0);
+  }
   Mutex_Unlock(&(cv->waitset_lock));
 }
 
+void Cond_Broadcast(CondVar* cv)
+{
+  cv_broadcast(cv, 0);
+}
+
+void cv_broadcast_handoff(CondVar* cv)
+{
+  cv_broadcast(cv, 1);
+}
+
+
+
+/*
+	Reader-writer locks.
+
+	A reader announces itself by incrementing the counter of its core, and
+	then checks that there are no writers; a writer announces itself in
+	@c writers, and then waits for the sum of the counters to drop to 0.
+	Both sides use sequentially consistent atomics, so at least one of
+	them sees the other. A reader that sees a writer retracts, and sleeps
+	until all the writers are gone.
+
+	A reader may migrate while it holds the lock, and leave from another
+	core than the one it entered from. Thus, a single counter may go 
+	negative; only the sum of the counters is meaningful.
+*/
+
+static int rwlock_readers(RwLock* rw)
+{
+	int sum = 0;
+	for(int i=0; i < RWLOCK_SLOTS; i++)
+		sum += __atomic_load_n(& rw->readers[i].count, __ATOMIC_SEQ_CST);
+	return sum;
+}
+
+static void rwlock_read_leave(RwLock* rw)
+{
+	__atomic_fetch_sub(& rw->readers[cpu_core_id % RWLOCK_SLOTS].count, 1, __ATOMIC_SEQ_CST);
+
+	/* The last reader to leave wakes up a waiting writer */
+	if(__atomic_load_n(& rw->writers, __ATOMIC_SEQ_CST)) {
+		Mutex_Lock(& rw->wait_lock);
+		if(rwlock_readers(rw) == 0) Cond_Signal(& rw->writer_cv);
+		Mutex_Unlock(& rw->wait_lock);
+	}
+}
+
+void RwLock_ReadLock(RwLock* rw)
+{
+	while(1) {
+		__atomic_fetch_add(& rw->readers[cpu_core_id % RWLOCK_SLOTS].count, 1, __ATOMIC_SEQ_CST);
+		if(__atomic_load_n(& rw->writers, __ATOMIC_SEQ_CST) == 0) return;
+
+		/* Writers have preference */
+		rwlock_read_leave(rw);
+		Mutex_Lock(& rw->wait_lock);
+		while(__atomic_load_n(& rw->writers, __ATOMIC_SEQ_CST))
+			cv_wait(& rw->wait_lock, & rw->readers_cv, SCHED_MUTEX, NO_TIMEOUT);
+		Mutex_Unlock(& rw->wait_lock);
+	}
+}
+
+void RwLock_ReadUnlock(RwLock* rw)
+{
+	rwlock_read_leave(rw);
+}
+
+void RwLock_WriteLock(RwLock* rw)
+{
+	__atomic_fetch_add(& rw->writers, 1, __ATOMIC_SEQ_CST);
+	Mutex_Lock(& rw->writer_lock);
+
+	Mutex_Lock(& rw->wait_lock);
+	while(rwlock_readers(rw) != 0)
+		cv_wait(& rw->wait_lock, & rw->writer_cv, SCHED_MUTEX, NO_TIMEOUT);
+	Mutex_Unlock(& rw->wait_lock);
+}
+
+void RwLock_WriteUnlock(RwLock* rw)
+{
+	Mutex_Lock(& rw->wait_lock);
+	if(__atomic_sub_fetch(& rw->writers, 1, __ATOMIC_SEQ_CST) == 0)
+		Cond_Broadcast(& rw->readers_cv);
+	Mutex_Unlock(& rw->wait_lock);
+
+	Mutex_Unlock(& rw->writer_lock);
+}
+
 
 
 
@@ -238,53 +891,126 @@ int get_core_preemption()
 /**
  * @brief The kernel lock.
  *
- * Kernel locking is provided by a semaphore, implemented as a monitor.
- * A semaphre for kernel locking has the advantage that 
+ * The kernel lock is a sleeping mutex. Its state is a single word:
+ * 0 if the lock is free, 1 if it is held, and 2 if it is held and there
+ * are (or may be) threads waiting for it. Taking a free lock, and
+ * releasing a lock nobody waits for, costs one CAS.
+ *
+ * Waiters queue in FIFO order on @c kernel_waiters. The unlocker does not
+ * release a contended lock; it hands it over to the first waiter, which
+ * wakes up already owning it. Thus, a waiter cannot be overtaken by
+ * threads arriving later, except through the fast path while the lock
+ * is momentarily free.
  */
 
-/* This mutex is used to implement the kernel semaphore as a monitor. */
-static Mutex kernel_mutex = MUTEX_INIT;
+enum { KL_FREE=0, KL_LOCKED=1, KL_CONTENDED=2 };
 
-/* Semaphore counter */
-static int kernel_sem = 1;
+static int kernel_lock_state = KL_FREE;
 
-/* Semaphore condition */
-static CondVar kernel_sem_cv = COND_INIT;
+/* This spinlock protects the queue of waiters */
+static Mutex kernel_waiters_lock = MUTEX_TICKET_INIT;
+static rlnode kernel_waiters = { .prev = &kernel_waiters, .next = &kernel_waiters };
 
-void kernel_lock()
+typedef struct __kernel_waiter {
+	rlnode node;
+	TCB* thread;
+	int granted;		/* Set by the unlocker, when the lock is handed over */
+} __kernel_waiter;
+
+
+static void kernel_lock_slow(__lock_wait* w)
 {
-	Mutex_Lock(& kernel_mutex);
-	while(kernel_sem<=0) {
-		Cond_Wait(& kernel_mutex, &kernel_sem_cv);
+	__kernel_waiter waiter = { .thread = CURTHREAD, .granted = 0 };
+	rlnode_init(& waiter.node, &waiter);
+
+	/* The waiters lock is a ticket lock, so we must not be preempted */
+	int preempt = preempt_off;
+	mutex_lock_as(& kernel_waiters_lock, MUTEX_LOCKED, "kernel_waiters", NULL);
+
+	/* Mark the lock contended, unless it was released meanwhile */
+	int state = __atomic_load_n(&kernel_lock_state, __ATOMIC_RELAXED);
+	while(state != KL_CONTENDED) {
+		if(state == KL_FREE) {
+			if(__atomic_compare_exchange_n(&kernel_lock_state, &state, KL_LOCKED, 
+					0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+				Mutex_Unlock(& kernel_waiters_lock);
+				if(preempt) preempt_on;
+				return;
+			}
+		} 
+		else if(__atomic_compare_exchange_n(&kernel_lock_state, &state, KL_CONTENDED, 
+					0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			break;
 	}
-	kernel_sem--;
-	Mutex_Unlock(& kernel_mutex);
+
+	rlist_push_back(& kernel_waiters, & waiter.node);
+	w->contended = 1;
+
+	/* Only kernel_unlock can wake us up, but be careful anyway */
+	while(1) {
+		w->sleeps++;
+		sleep_releasing_wchan(STOPPED, & kernel_waiters_lock, SCHED_MUTEX, "kernel_lock", NO_TIMEOUT);
+		if(__atomic_load_n(& waiter.granted, __ATOMIC_ACQUIRE)) break;
+		mutex_lock_as(& kernel_waiters_lock, MUTEX_LOCKED, "kernel_waiters", NULL);
+		if(waiter.granted) { Mutex_Unlock(& kernel_waiters_lock); break; }
+	}
+	if(preempt) preempt_on;
+}
+
+static void kernel_unlock_slow()
+{
+	int preempt = preempt_off;
+	mutex_lock_as(& kernel_waiters_lock, MUTEX_LOCKED, "kernel_waiters", NULL);
+	if(is_rlist_empty(& kernel_waiters)) {
+		__atomic_store_n(&kernel_lock_state, KL_FREE, __ATOMIC_RELEASE);
+	} else {
+		/* Hand the lock over to the first waiter */
+		__kernel_waiter* waiter = rlist_pop_front(& kernel_waiters)->obj;
+		if(is_rlist_empty(& kernel_waiters))
+			__atomic_store_n(&kernel_lock_state, KL_LOCKED, __ATOMIC_RELAXED);
+		__atomic_store_n(& waiter->granted, 1, __ATOMIC_RELEASE);
+		wakeup(waiter->thread);
+	}
+	Mutex_Unlock(& kernel_waiters_lock);
+	if(preempt) preempt_on;
+}
+
+void kernel_lock()
+{
+	__lock_wait w = { 0, 0, 0, 0 };
+	uint64_t start = lock_profiling ? bios_clock_ns() : 0;
+
+	int state = KL_FREE;
+	if(! __atomic_compare_exchange_n(&kernel_lock_state, &state, KL_LOCKED, 
+			0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		kernel_lock_slow(&w);
+
+	if(lock_profiling) lockprof_acquired(&kernel_lock_state, "kernel_lock", NULL, &w, start);
 }
 
 void kernel_unlock()
 {
-	Mutex_Lock(& kernel_mutex);
-	kernel_sem++;
-	Cond_Signal(&kernel_sem_cv);
-	Mutex_Unlock(& kernel_mutex);
+	if(lock_profiling) lockprof_released(&kernel_lock_state);
+
+	int state = KL_LOCKED;
+	if(! __atomic_compare_exchange_n(&kernel_lock_state, &state, KL_FREE, 
+			0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		kernel_unlock_slow();
 }
 
 int kernel_wait_wchan(CondVar* cv, enum SCHED_CAUSE cause, 
 	const char* wchan_name, TimerDuration timeout)
 {
-	/* Atomically release kernel semaphore */
-	Mutex_Lock(& kernel_mutex);
-	kernel_sem++;
-	Cond_Signal(&kernel_sem_cv);	
-
-	int ret = cv_wait(&kernel_mutex, cv, cause, timeout);
+	__cv_waiter waiter;
+	cv_enqueue(cv, &waiter);
 
-	/* Reacquire kernel semaphore */
-	while(kernel_sem<=0)
-		Cond_Wait(& kernel_mutex, &kernel_sem_cv);
-	kernel_sem--;
-	Mutex_Unlock(& kernel_mutex);		
+	/* The waitset lock is held, so we cannot miss a signal */
+	kernel_unlock();
+	uint64_t start = lock_profiling ? bios_clock_ns() : 0;
+	int ret = cv_sleep(cv, &waiter, cause, wchan_name, timeout);
+	if(lock_profiling) wchanprof_blocked(wchan_name, bios_clock_ns() - start);
 
+	kernel_lock();
 	return ret;
 }
 
@@ -300,10 +1026,8 @@ void kernel_broadcast(CondVar* cv)
 
 void kernel_sleep(Thread_state newstate, enum SCHED_CAUSE cause)
 {
-	Mutex_Lock(& kernel_mutex);
-	kernel_sem++;
-	Cond_Signal(&kernel_sem_cv);
-	sleep_releasing(newstate, &kernel_mutex, cause, NO_TIMEOUT);
+	kernel_unlock();
+	sleep_releasing(newstate, NULL, cause, NO_TIMEOUT);
 }
 
 
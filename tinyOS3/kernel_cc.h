@@ -39,6 +39,10 @@
 
 /**
 	@brief Lock the kernel.
+
+	The kernel lock is a sleeping mutex: contended threads sleep in FIFO 
+	order, and the lock is handed directly to the first of them when it 
+	is released. An uncontended lock/unlock costs a single atomic operation.
  */
 void kernel_lock();
 
@@ -59,6 +63,34 @@ int kernel_wait_wchan(CondVar* cv, enum SCHED_CAUSE cause,
 #define kernel_timedwait(cv, cause, timeout) \
 	kernel_wait_wchan((cv),(cause),__FUNCTION__, (timeout))
 
+/**
+	@brief Wait on a condition variable, using a kernel mutex.
+
+	This is the kernel version of @c Cond_TimedWait, for code that 
+	is protected by its own mutex instead of the kernel lock (e.g., 
+	a pipe or a socket). The cause is passed to the scheduler, and the 
+	timeout is in microseconds (or @c NO_TIMEOUT). The sleep is
+	accounted to the wait channel @c wchan; the @c cv_wait macro passes 
+	the name of the calling function.
+
+	@returns 1 if signalled, 0 if not
+ */
+int cv_wait_wchan(Mutex* mx, CondVar* cv, enum SCHED_CAUSE cause, 
+	const char* wchan, TimerDuration timeout);
+
+#define cv_wait(mx, cv, cause, timeout) \
+	cv_wait_wchan((mx),(cv),(cause),__FUNCTION__,(timeout))
+
+/**
+	@brief Signal a condition to all waiters, handing off to the first.
+
+	This is @c Cond_Broadcast, except that the first waiter is woken up by
+	@c wakeup_handoff(). If the caller blocks soon after (e.g., to wait for
+	a reply), the waiter runs next on the core of the caller, without 
+	waiting in the run queue.
+ */
+void cv_broadcast_handoff(CondVar* cv);
+
 /**
 	@brief Signal a kernel condition to one waiter.
 
@@ -76,12 +108,58 @@ void kernel_broadcast(CondVar* cv);
 	@brief Put thread to sleep, unlocking the kernel.
 
 	System calls should call this function instead of @c sleep_releasing,
-	as the kernel lock is not a mutex.
+	as the kernel lock is not a @c Mutex. The kernel is unlocked before 
+	the thread sleeps, so this is only safe when no other thread will 
+	wake it up (e.g., for @c EXITED).
   */
 void kernel_sleep(Thread_state state, enum SCHED_CAUSE cause);
 
 
 
+/**
+	@brief If non-zero, lock contention is profiled.
+
+	Every acquisition of a @c Mutex and of the kernel lock records the
+	spins, @c SCHED_MUTEX yields and sleeps it took, and how long the lock
+	was waited for and held. Sleeps in @c kernel_wait_wchan are recorded
+	per wait channel, with a histogram of the blocked time. The report is
+	printed at shutdown.
+
+	Locks are told apart by address only, so a lock whose memory is reused
+	by another lock shares its statistics. Unnamed locks are reported by 
+	the caller of their first acquisition.
+
+	This may be changed before the VM is booted.
+  */
+extern int lock_profiling;
+
+/**
+	@brief Name a lock in the profiling report.
+
+	Locks with the same name are summed up in the report. This does
+	nothing unless @c lock_profiling is set.
+  */
+void lock_profile_name(const void* lock, const char* name);
+
+/**
+	@brief Get the profile of a lock.
+
+	The number of acquisitions of @c lock, and how many of them were
+	contended, are stored in @c acquired and @c contended.
+
+	@returns 1 if the lock has an entry in the profile, 0 otherwise
+  */
+int lock_profile_get(const void* lock, unsigned long* acquired, unsigned long* contended);
+
+/**
+	@brief Print the lock profile to @c stderr.
+
+	This is called after the VM has shut down.
+  */
+void lock_profile_report();
+
+
+
 /** @brief Set the preemption status for the current thread.
 
  	Depending on the value of the argument, this function will set preemption on 
@@ -90,7 +90,9 @@ void serial_rx_handler()
    */
   for(int i=0;i<bios_serial_ports();i++) {
     serial_dcb_t* dcb = &serial_dcb[i];
+    Mutex_Lock(&dcb->spinlock);
     Cond_Broadcast(&dcb->rx_ready);
+    Mutex_Unlock(&dcb->spinlock);
   }
   if(pre) preempt_on;
 }
@@ -103,6 +105,7 @@ int serial_read(void* dev, char *buf, unsigned int size)
   serial_dcb_t* dcb = (serial_dcb_t*)dev;
 
   preempt_off;            /* Stop preemption */
+  Mutex_Lock(&dcb->spinlock);
 
   uint count =  0;
 
@@ -113,12 +116,13 @@ int serial_read(void* dev, char *buf, unsigned int size)
       count++;
     }
     else if(count==0) {
-      kernel_wait(&dcb->rx_ready, SCHED_IO);
+      cv_wait(&dcb->spinlock, &dcb->rx_ready, SCHED_IO, NO_TIMEOUT);
     }
     else
       break;
   }
 
+  Mutex_Unlock(&dcb->spinlock);
   preempt_on;           /* Restart preemption */
 
   return count;
@@ -6,6 +6,7 @@
 #include "bios.h"
 #include "tinyos.h"
 #include "kernel_sched.h"
+#include "kernel_cc.h"
 #include "kernel_proc.h"
 #include "kernel_dev.h"
 #include "kernel_streams.h"
@@ -28,6 +29,9 @@ static struct {
   void* args;
 } boot_rec;
 
+/* The scheduling policy, for the next boot */
+static sched_policy boot_policy = SCHED_POLICY_MLFQ;
+
 
 /* Per-core boot function for tinyos */
 void boot_tinyos_kernel()
@@ -39,7 +43,7 @@ void boot_tinyos_kernel()
     initialize_devices();
     initialize_files();
     initialize_port_map();
-    initialize_scheduler();
+    initialize_scheduler(boot_policy);
 
     /* The boot task is executed normally! */
     if(Exec(boot_rec.init_task, boot_rec.argl, boot_rec.args)!=1)
@@ -59,11 +63,38 @@ void boot_tinyos_kernel()
 }
 
 
+int boot_set_sched_policy(sched_policy policy)
+{
+  if(policy >= SCHED_POLICY_MAX)
+    return -1;
+  boot_policy = policy;
+  return 0;
+}
+
+
+void boot_set_lock_profiling(int flag)
+{
+  lock_profiling = flag;
+}
+
+
+int boot_lock_profile(const Mutex* mx, unsigned long* acquired, unsigned long* contended)
+{
+  return lock_profile_get(mx, acquired, contended) ? 0 : -1;
+}
+
+
 void boot(uint ncores, uint nterm, Task boot_task, int argl, void* args)
 {
   boot_rec.init_task = boot_task;
   boot_rec.argl = argl;
   boot_rec.args = args;
 
+  vm_set_print_stats(sched_print_stats);
   vm_boot(boot_tinyos_kernel, ncores, nterm);
+
+  if(sched_print_stats)
+    sched_report_stats();
+  if(lock_profiling)
+    lock_profile_report();
 }
@@ -70,6 +70,8 @@ PipeCB* spawn_Pipe(){
 
   pipeCB->Producer = COND_INIT;
   pipeCB->Consumer = COND_INIT;
+  pipeCB->lock = MUTEX_BLOCKING_INIT;
+  lock_profile_name(& pipeCB->lock, "pipe");
 
 	pipeCB->ref_counter = 0;
 
@@ -78,38 +80,47 @@ PipeCB* spawn_Pipe(){
 
 void refcounter_incr(PipeCB* pipe){
 
-	pipe->ref_counter += 1;
+	__atomic_add_fetch(&pipe->ref_counter, 1, __ATOMIC_RELAXED);
 }
 
 void refcounter_decr(PipeCB* pipe){
 
-	pipe->ref_counter -= 1;
+	/* The last reference frees the pipe */
+	if(__atomic_sub_fetch(&pipe->ref_counter, 1, __ATOMIC_ACQ_REL) == 0)
+		free(pipe);
 }
 
 int WritePipe(void* streamobject, const char* buf, unsigned int size){
 
    PipeCB* pipe = (PipeCB*)streamobject;
 
-   if(pipe == NULL || pipe->ReadFCB == NULL ){
+   if(pipe == NULL){
      return -1;
    }
 
+	 Mutex_Lock(&pipe->lock);
 	 while(pipe->NElements == BUFFER_SIZE && pipe->ReadFCB!=NULL){
- 		kernel_wait(&pipe->Producer,SCHED_PIPE);
+ 		cv_wait(&pipe->lock, &pipe->Producer, SCHED_PIPE, NO_TIMEOUT);
  	 }
 
+	 if(pipe->ReadFCB == NULL){
+		 Mutex_Unlock(&pipe->lock);
+		 return -1;		/* Nobody will ever read this */
+	 }
+
 	 int count = 0;
    while(count < size){
 		if(pipe->NElements == BUFFER_SIZE){
-			 kernel_broadcast(&pipe->Consumer);
-			 return count;
+			 break;
 		}else{
 	  	pipe->buffer[(pipe->Head + pipe->NElements)%BUFFER_SIZE] = buf[count];
 		  pipe->NElements++;
 	 	}
 		count++;
   }
-	kernel_broadcast(&pipe->Consumer);
+	/* The writer of a request usually blocks next, waiting for the reply */
+	cv_broadcast_handoff(&pipe->Consumer);
+	Mutex_Unlock(&pipe->lock);
   return count;
 }
 
@@ -122,20 +133,15 @@ int ReadPipe(void* streamobject, char* buf, unsigned int size){
     return -1;
   }
  int count = 0;
-	if(pipe->WriteFCB == NULL && pipe->NElements == 0){
-		return count;
-	}
+	Mutex_Lock(&pipe->lock);
 
 	while(pipe->NElements == 0 && pipe->WriteFCB!=NULL){
-		kernel_wait(&pipe->Consumer, SCHED_PIPE);
+		cv_wait(&pipe->lock, &pipe->Consumer, SCHED_PIPE, NO_TIMEOUT);
 	}
 
   while(count < size ){
 		if(pipe->NElements == 0 ){
-			if(pipe->WriteFCB != NULL){
-				kernel_broadcast(&pipe->Producer);
-			}
-			return count;
+			break;
 		}else{
 			buf[count] = pipe->buffer[pipe->Head];
 			pipe->Head = (pipe->Head + 1) % BUFFER_SIZE;
@@ -144,8 +150,11 @@ int ReadPipe(void* streamobject, char* buf, unsigned int size){
 
 		count++;
 	}
-	kernel_broadcast(&pipe->Producer);
-  return size;
+	if(count > 0 && pipe->WriteFCB != NULL){
+		cv_broadcast_handoff(&pipe->Producer);
+	}
+	Mutex_Unlock(&pipe->lock);
+  return count;
 }
 
 int CloseReaderPipe(void* streamobject){
@@ -155,14 +164,14 @@ int CloseReaderPipe(void* streamobject){
   if(pipe == NULL){
     return -1;
   }
+	Mutex_Lock(&pipe->lock);
 	if(pipe->WriteFCB != NULL){
-		kernel_broadcast(&pipe->Producer);
+		Cond_Broadcast(&pipe->Producer);
 	}
 	pipe->ReadFCB = NULL;
+	Mutex_Unlock(&pipe->lock);
 
-	if(pipe->WriteFCB == NULL && pipe->ReadFCB == NULL){
-		free(pipe);
-	}
+	refcounter_decr(pipe);		/* Drop the reference of the read end */
 
   return 0;
 }
@@ -174,14 +183,14 @@ int CloseWriterPipe(void* streamobject){
     return -1;
   }
 
+	Mutex_Lock(&pipe->lock);
 	if(pipe->ReadFCB != NULL){
-		kernel_broadcast(&pipe->Consumer);
+		Cond_Broadcast(&pipe->Consumer);
 	}
 	pipe->WriteFCB = NULL;
+	Mutex_Unlock(&pipe->lock);
 
-	if(pipe->WriteFCB == NULL && pipe->ReadFCB == NULL){
-		free(pipe);
-	}
+	refcounter_decr(pipe);		/* Drop the reference of the write end */
 
   return 0;
 }
@@ -16,7 +16,9 @@ typedef struct pipe_control_block
 	CondVar Producer;
 	CondVar Consumer;
 
-  unsigned int ref_counter;
+  Mutex lock;                /**< Protects the buffer and the two ends */
+
+  unsigned int ref_counter;  /**< Open ends, plus socket reads/writes in flight; the pipe is freed at 0 */
 
 } PipeCB;
 
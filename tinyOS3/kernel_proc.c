@@ -47,6 +47,7 @@ static inline void initialize_PCB(PCB* pcb)
   rlnode_init(& pcb->children_node, pcb);
   rlnode_init(& pcb->exited_node, pcb);
   pcb->child_exit = COND_INIT;
+  pcb->lock = MUTEX_INIT;
 }
 
 
@@ -88,6 +89,8 @@ PCB* acquire_PCB()
     pcb->pstate = ALIVE;
     pcb_freelist = pcb_freelist->parent;
     process_count++;
+    pcb->times = (thread_times){ 0 };
+    lock_profile_name(& pcb->lock, "pcb");
   }
 
   return pcb;
@@ -132,9 +135,21 @@ void start_main_thread()
 	System call to create a new process.
  */
 Pid_t sys_Exec(Task call, int argl, void* args)
+{
+  return sys_ExecEx(call, argl, args, NULL);
+}
+
+
+/*
+	System call to create a new process, with attributes for its main thread.
+ */
+Pid_t sys_ExecEx(Task call, int argl, void* args, const thread_attr* attr)
 {
   PCB *curproc, *newproc;
 
+  if(sched_check_attr(attr) != 0)
+    return NOPROC;
+
   /* The new process PCB */
   newproc = acquire_PCB();
 
@@ -155,11 +170,13 @@ Pid_t sys_Exec(Task call, int argl, void* args)
     rlist_push_front(& curproc->children_list, & newproc->children_node);
 
     /* Inherit file streams from parent */
+    Mutex_Lock(& curproc->lock);
     for(int i=0; i<MAX_FILEID; i++) {
        newproc->FIDT[i] = curproc->FIDT[i];
        if(newproc->FIDT[i])
           FCB_incref(newproc->FIDT[i]);
     }
+    Mutex_Unlock(& curproc->lock);
   }
 
 
@@ -182,7 +199,9 @@ Pid_t sys_Exec(Task call, int argl, void* args)
    */
   if(call != NULL) {
 
-    newproc->main_thread = spawn_thread(newproc, start_main_thread); /* Spawn the main thread and initialize the variable of the current process  */
+    newproc->main_thread = spawn_thread(newproc, start_main_thread, attr); /* Spawn the main thread and initialize the variable of the current process  */
+    if(newproc->parent != NULL && (attr == NULL || attr->affinity == 0))
+      newproc->main_thread->affinity = CURTHREAD->affinity; /* Inherit the affinity of the creator */
     newproc->num_of_threads += 1;
     PTCB* new_ptcb = spawn_process_thread(newproc); /* Spawn the ptcb of the main thread */
     newproc->main_thread->owner_ptcb = new_ptcb;
@@ -326,12 +345,17 @@ void sys_Exit(int exitval)
     curproc->args = NULL;
   }
 
-  /* Clean up FIDT */
+  /* Clean up FIDT. The streams are closed outside the PCB lock. */
+  FCB* fidt[MAX_FILEID];
+  Mutex_Lock(& curproc->lock);
   for(int i=0;i<MAX_FILEID;i++) {
-    if(curproc->FIDT[i] != NULL) {
-      FCB_decref(curproc->FIDT[i]);
-      curproc->FIDT[i] = NULL;
-    }
+    fidt[i] = curproc->FIDT[i];
+    curproc->FIDT[i] = NULL;
+  }
+  Mutex_Unlock(& curproc->lock);
+  for(int i=0;i<MAX_FILEID;i++) {
+    if(fidt[i] != NULL)
+      FCB_decref(fidt[i]);
   }
 
   /* Reparent any children of the exiting process to the
@@ -356,23 +380,25 @@ void sys_Exit(int exitval)
     kernel_broadcast(& curproc->parent->child_exit);
   }
 
+  Mutex_Lock(& curproc->lock);
   PTCB* curPTCB = curproc->main_thread->owner_ptcb;
+  process_add_times(curproc, curproc->main_thread);
 
 	assert(curPTCB != NULL);	/* We assert the there is the ptcb */
 
-  curPTCB->thread->state = EXITED;	/* We mark the state of the current thread as exited */
   curPTCB->thread = NULL;
   curPTCB->exited = 1;		/* We change the exited variable of the ptcb to 1 to keep the information that the current thread just exited */
-  curproc->num_of_threads -= 1;
+  __atomic_sub_fetch(& curproc->num_of_threads, 1, __ATOMIC_RELAXED);
 
 	if(curPTCB->ref_counter > 0){
-		kernel_broadcast(&curPTCB->joined);		/* We check if the there are reference counters(joiners) and we broadcast all joined threads */
+		Cond_Broadcast(&curPTCB->joined);		/* We check if the there are reference counters(joiners) and we broadcast all joined threads */
 	}
 	rlist_remove(&curPTCB->PTCB_node);		/* We remove the current ptcb from the list */
 	free(curPTCB);		/* And then free the memory we alLocated during its creation and set the curPTCB pointer to NULL*/
 
   /* Disconnect my main_thread */
   curproc->main_thread = NULL;
+  Mutex_Unlock(& curproc->lock);
 
   /* Now, mark the process as exited. */
   curproc->pstate = ZOMBIE;
@@ -447,6 +473,9 @@ int ReadInfo(void* streamobject, char* buf, unsigned int size){
     return -1;
   }
 
+  /* Reads are not under the kernel lock, but the process table is */
+  kernel_lock();
+  int ret = 0;
   while(process_counter < MAX_PROC && process_counter < process_count){
     if(PT[process_counter].pstate != FREE){
       procinfoCB->pid = get_pid(&PT[process_counter]);
@@ -464,12 +493,15 @@ int ReadInfo(void* streamobject, char* buf, unsigned int size){
 
       memcpy(buf, (char*)procinfoCB, size);
       process_counter += 1;
-      return size;
+      ret = size;
+      break;
     }
     process_counter += 1;
   }
+  if(ret == 0)
     process_counter = 0;
-  return 0;
+  kernel_unlock();
+  return ret;
 }
 
 int NullWriteInfo(void* streamobject, const char* buf, unsigned int size){
@@ -488,3 +520,121 @@ int CloseInfo(void* streamobject){
   process_counter = 0;
   return 0;
 }
+
+
+/*
+  Thread information streams.
+ */
+
+void process_add_times(PCB* pcb, TCB* tcb)
+{
+  thread_times times;
+  thread_times_get(tcb, &times);
+  thread_times_add(& pcb->times, &times);
+}
+
+/* The position of a thread information stream */
+typedef struct thread_info_cursor {
+  Pid_t pid;      /* The next process */
+  int thread;     /* 0 for the process total, else the next thread + 1 */
+} thread_info_cursor;
+
+static void fill_threadinfo(threadinfo* info, Pid_t pid, Tid_t tid, thread_times* t)
+{
+  memset(info, 0, sizeof(threadinfo));
+  info->pid = pid;
+  info->tid = tid;
+  info->cpu_time = t->cpu;
+  info->ready_time = t->ready;
+  info->blocked_time = t->blocked;
+  info->max_latency = t->max_latency;
+  info->sleeps = t->sleeps;
+  for(int i=0; i < THREADINFO_WCHANS; i++) {
+    if(t->wchan[i].wchan)
+      strncpy(info->wchan[i].name, t->wchan[i].wchan, THREADINFO_WCHAN_SIZE-1);
+    info->wchan[i].time = t->wchan[i].time;
+    info->wchan[i].sleeps = t->wchan[i].sleeps;
+  }
+}
+
+static int ReadThreadInfo(void* streamobject, char* buf, unsigned int size)
+{
+  thread_info_cursor* cur = streamobject;
+  if(size < sizeof(threadinfo))
+    return -1;
+
+  /* The process table is protected by the kernel lock */
+  kernel_lock();
+  int ret = 0;
+  for(; cur->pid < MAX_PROC; cur->pid++, cur->thread = 0) {
+    PCB* pcb = & PT[cur->pid];
+    if(pcb->pstate == FREE) continue;
+
+    thread_times times;
+    Tid_t tid = NOTHREAD;
+    int found = 0;
+
+    Mutex_Lock(& pcb->lock);
+    if(cur->thread == 0) {
+      /* The process total */
+      times = pcb->times;
+      for(rlnode* p = pcb->PTCB_list.next; p != & pcb->PTCB_list; p = p->next) {
+        if(p->ptcb->thread == NULL) continue;
+        thread_times t;
+        thread_times_get(p->ptcb->thread, &t);
+        thread_times_add(&times, &t);
+      }
+      found = 1;
+    } else {
+      /* The next live thread */
+      int n = cur->thread;
+      for(rlnode* p = pcb->PTCB_list.next; p != & pcb->PTCB_list; p = p->next) {
+        if(p->ptcb->thread == NULL || --n > 0) continue;
+        thread_times_get(p->ptcb->thread, &times);
+        tid = (Tid_t) p->ptcb;
+        found = 1;
+        break;
+      }
+    }
+    Mutex_Unlock(& pcb->lock);
+
+    if(found) {
+      fill_threadinfo((threadinfo*) buf, cur->pid, tid, &times);
+      cur->thread++;
+      ret = sizeof(threadinfo);
+      break;
+    }
+  }
+  kernel_unlock();
+  return ret;
+}
+
+static int CloseThreadInfo(void* streamobject)
+{
+  free(streamobject);
+  return 0;
+}
+
+Fid_t sys_OpenThreadInfo()
+{
+  Fid_t fid;
+  FCB* fcb;
+
+  if(! FCB_reserve(1, &fid, &fcb))
+    return NOFILE;
+
+  thread_info_cursor* cur = xmalloc(sizeof(thread_info_cursor));
+  cur->pid = 0;
+  cur->thread = 0;
+
+  static file_ops threadinfo_ops = {
+    .Open = NullOpenInfo,
+    .Read = ReadThreadInfo,
+    .Write = NullWriteInfo,
+    .Close = CloseThreadInfo
+  };
+
+  fcb->streamobj = cur;
+  fcb->streamfunc = &threadinfo_ops;
+  return fid;
+}
@@ -34,6 +34,11 @@ typedef enum pid_state_e {
   @brief Process Control Block.
 
   This structure holds all information pertaining to a process.
+
+  The process table, and the relations between processes (@c parent,
+  the children lists, @c pstate), are protected by the kernel lock. 
+  The threads and the open files of a process are protected by the
+  @c lock of its PCB.
  */
 typedef struct process_control_block {
   pid_state  pstate;      /**< The pid state for this PCB */
@@ -59,6 +64,10 @@ typedef struct process_control_block {
 
   FCB* FIDT[MAX_FILEID];  /**< The fileid table of the process */
 
+  Mutex lock;             /**< Protects @c FIDT and the threads of the process (@c PTCB_list) */
+
+  thread_times times;     /**< The times of the threads that have exited, protected by @c lock */
+
 } PCB;
 
 typedef struct process_thread_control_block {
@@ -112,6 +121,14 @@ PCB* get_pcb(Pid_t pid);
 */
 Pid_t get_pid(PCB* pcb);
 
+/**
+  @brief Add the times of an exiting thread to its process.
+
+  This must be called with the lock of the PCB held, before the thread
+  is removed from the threads of the process.
+*/
+void process_add_times(PCB* pcb, TCB* tcb);
+
 /** @} */
 
 PTCB* spawn_process_thread(PCB* pcb);       /* Creates the  process thread and returns it */
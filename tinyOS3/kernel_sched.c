@@ -1,5 +1,8 @@
 
 #include <assert.h>
+#include <stdio.h>
+#include <signal.h>
+#include <unistd.h>
 #include <sys/mman.h>
 
 #include "tinyos.h"
@@ -16,24 +19,27 @@
    The thread layout.
   --------------------
 
-  On the x86 (Pentium) architecture, the stack grows upward. Therefore, we
-  can allocate the TCB at the top of the memory block used as the stack.
+  On the x86 architecture, the stack grows downward. We allocate the TCB
+  at the bottom of the memory block of each thread, and the stack above it.
+  Between the two, there is a guard page that cannot be accessed (when
+  threads are allocated with mmap).
 
+  +-------------+  <- high addresses
+  | first frame |
   +-------------+
-  |   TCB       |
-  +-------------+
+  |      |      |
+  |      v      |
   |             |
   |    stack    |
   |             |
-  |      ^      |
-  |      |      |
   +-------------+
-  | first frame |
+  | guard page  |
   +-------------+
+  |   TCB       |
+  +-------------+  <- low addresses
 
-  Advantages: (a) unified memory area for stack and TCB (b) stack overrun will
-  crash own thread, before it affects other threads (which may make debugging
-  easier).
+  Advantages: (a) unified memory area for stack and TCB (b) a stack overrun
+  hits the guard page and faults, before it corrupts the TCB.
 
   Disadvantages: The stack cannot grow unless we move the whole TCB. Of course,
   we do not support stack growth anyway!
@@ -53,22 +59,48 @@ Mutex active_threads_spinlock = MUTEX_INIT;
 /* The memory allocated for the TCB must be a multiple of SYSTEM_PAGE_SIZE */
 #define THREAD_TCB_SIZE   (((sizeof(TCB)+SYSTEM_PAGE_SIZE-1)/SYSTEM_PAGE_SIZE)*SYSTEM_PAGE_SIZE)
 
-#define THREAD_SIZE  (THREAD_TCB_SIZE+THREAD_STACK_SIZE)
+/* Define MALLOC_THREAD_MEM to allocate threads with malloc instead of mmap */
+#if !defined(MALLOC_THREAD_MEM) && !defined(MMAPPED_THREAD_MEM)
+#define MMAPPED_THREAD_MEM
+#endif
+
+/* The size of the guard page between the TCB and the stack */
+#ifdef MMAPPED_THREAD_MEM
+#define THREAD_GUARD_SIZE  SYSTEM_PAGE_SIZE
+#else
+#define THREAD_GUARD_SIZE  0
+#endif
+
+/* The memory block of a thread with the given stack size */
+#define THREAD_BLOCK_SIZE(stack_size)  (THREAD_TCB_SIZE+THREAD_GUARD_SIZE+(stack_size))
+
+#define THREAD_SIZE  THREAD_BLOCK_SIZE(THREAD_STACK_SIZE)
+
+/* The stack segment of a thread */
+#define THREAD_STACK(tcb)  (((void*)(tcb)) + THREAD_TCB_SIZE + THREAD_GUARD_SIZE)
 
-int TOTAL_YIELD = 100;
+/* If set, print scheduler statistics when the VM shuts down */
+int sched_print_stats = 0;
 
-#define MAX_SCHED_Q 5
+/* If set, the quantum timer runs only when it is needed */
+int sched_tickless = 1;
 
-#define MAX_PRIORITY 0
+/* The time the scheduler was initialized, for the statistics */
+static TimerDuration sched_start_time;
 
-#define MIN_PRIORITY 4
-//#define MMAPPED_THREAD_MEM
 #ifdef MMAPPED_THREAD_MEM
 
 /*
-  Use mmap to allocate a thread. A more detailed implementation can allocate a
-  "sentinel page", and change access to PROT_NONE, so that a stack overflow
-  is detected as seg.fault.
+  Use mmap to allocate a thread.
+
+  The memory is reserved with MAP_NORESERVE, so that only the pages of
+  the stack actually touched by the thread are committed. The page below
+  the stack is made inaccessible, so that a stack overflow is caught
+  as a segmentation fault (see thread_guard_handler) instead of silently
+  corrupting the TCB.
+
+  The stack must be executable, because gcc places the trampolines of
+  nested functions (used by the tests) on the stack.
  */
 void free_thread(void* ptr, size_t size)
 {
@@ -79,13 +111,93 @@ void* allocate_thread(size_t size)
 {
   void* ptr = mmap(NULL, size,
       PROT_READ|PROT_WRITE|PROT_EXEC,
-      MAP_ANONYMOUS  | MAP_PRIVATE
+      MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE
       , -1,0);
 
   CHECK((ptr==MAP_FAILED)?-1:0);
 
+  /* Set up the guard page */
+  CHECK(mprotect(ptr + THREAD_TCB_SIZE, THREAD_GUARD_SIZE, PROT_NONE));
+
   return ptr;
 }
+
+/*
+  Return the stack pages of a pooled thread to the host, except for the
+  top page, which will be touched first by the next thread.
+ */
+static void scrub_thread(TCB* tcb)
+{
+  CHECK(madvise(THREAD_STACK(tcb), THREAD_STACK_SIZE - SYSTEM_PAGE_SIZE, MADV_DONTNEED));
+}
+
+/*
+  Handler for SIGSEGV. If the fault is on the guard page of the current
+  thread, report a stack overflow. In any case, the fault is fatal.
+
+  This runs on the alternate signal stack of the core, since the stack
+  of the thread is exhausted.
+ */
+static _Thread_local int core_guard_ready = 0;
+
+static void thread_guard_handler(int sig, siginfo_t* si, void* ctx)
+{
+  TCB* tcb = core_guard_ready ? CURTHREAD : NULL;
+
+  if(tcb != NULL && tcb->type != IDLE_THREAD) {
+    void* guard = ((void*)tcb) + THREAD_TCB_SIZE;
+    if(si->si_addr >= guard && si->si_addr < guard + THREAD_GUARD_SIZE) {
+      /* Only async-signal-safe calls here */
+      static const char msg[] = "tinyos: stack overflow in a thread\n";
+      if(write(2, msg, sizeof(msg)-1) < 0) { /* nothing we can do */ }
+      abort();
+    }
+  }
+
+  /* Not our fault: re-executing the faulting instruction gets the default action */
+  struct sigaction dfl = { 0 };
+  dfl.sa_handler = SIG_DFL;
+  sigaction(SIGSEGV, &dfl, NULL);
+}
+
+/* Install the stack overflow handler (once) */
+static void install_guard_handler()
+{
+  struct sigaction sa;
+  sa.sa_sigaction = thread_guard_handler;
+  sa.sa_flags = SA_SIGINFO | SA_ONSTACK;
+  sigemptyset(& sa.sa_mask);
+  CHECK(sigaction(SIGSEGV, &sa, NULL));
+}
+
+/*
+  Set up the alternate signal stack of the current core, and unblock SIGSEGV,
+  so that the guard handler runs. Return the memory of the stack.
+ */
+static void* core_guard_setup()
+{
+  stack_t ss;
+  ss.ss_sp = xmalloc(SIGSTKSZ);
+  ss.ss_size = SIGSTKSZ;
+  ss.ss_flags = 0;
+  CHECK(sigaltstack(&ss, NULL));
+
+  sigset_t segv;
+  sigemptyset(&segv);
+  sigaddset(&segv, SIGSEGV);
+  CHECKRC(pthread_sigmask(SIG_UNBLOCK, &segv, NULL));
+  core_guard_ready = 1;
+  return ss.ss_sp;
+}
+
+static void core_guard_cleanup(void* altstack)
+{
+  core_guard_ready = 0;
+  stack_t ss = { .ss_flags = SS_DISABLE };
+  CHECK(sigaltstack(&ss, NULL));
+  free(altstack);
+}
+
 #else
 /*
   Use malloc to allocate a thread. This is probably faster than  mmap, but cannot
@@ -102,10 +214,129 @@ void* allocate_thread(size_t size)
   CHECK((ptr==NULL)?-1:0);
   return ptr;
 }
+
+static inline void scrub_thread(TCB* tcb) { }
+static inline void install_guard_handler() { }
+static inline void* core_guard_setup() { return NULL; }
+static inline void core_guard_cleanup(void* altstack) { }
+
 #endif
 
 
 
+/*
+  The thread pool.
+
+  Each core keeps a free list of thread blocks (TCB and stack), released
+  by threads with the default stack size that exited on the core. Spawning a thread takes a block
+  from the pool of the current core, if any, so that in steady state,
+  creating and exiting threads does not allocate memory.
+
+  Blocks are released with the sched_spinlock held, so they are never
+  freed there. A block that does not fit in the pool (because the pool
+  holds sched_pool_high blocks, or the stack size is not the default) is
+  put in a release list, which is freed at the next spawn on the core,
+  or when the core becomes idle. When a core becomes idle,
+  its pool is trimmed down to sched_pool_low blocks, and the stack pages
+  of the blocks kept are returned to the host. The most recently released
+  blocks are at the front of the pool; the first core->pool_dirty of them
+  have not had their stack pages returned yet.
+
+  The pool of a core is only accessed by the core itself, with
+  preemption off.
+*/
+unsigned int sched_pool_high = TCB_POOL_HIGH;
+unsigned int sched_pool_low = TCB_POOL_LOW;
+
+/*
+  Free the blocks of the release list of the current core.
+ */
+static void tcb_pool_release()
+{
+  rlnode release;
+  rlnode_new(& release);
+
+  int preempt = preempt_off;
+  rlist_append(& release, & CURCORE.tcb_release);
+  if(preempt) preempt_on;
+
+  while(! is_rlist_empty(& release)) {
+    TCB* tcb = rlist_pop_front(& release)->tcb;
+    free_thread(tcb, THREAD_BLOCK_SIZE(tcb->stack_size));
+  }
+}
+
+static TCB* tcb_pool_get()
+{
+  tcb_pool_release();
+
+  int preempt = preempt_off;
+  CCB* core = & CURCORE;
+  TCB* tcb = NULL;
+
+  if(core->npool > 0) {
+    tcb = rlist_pop_front(& core->tcb_pool)->tcb;
+    core->npool--;
+    if(core->pool_dirty > 0) core->pool_dirty--;
+    core->pool_hits++;
+  }
+  else
+    core->pool_misses++;
+
+  if(preempt) preempt_on;
+
+  return (tcb != NULL) ? tcb : (TCB*) allocate_thread(THREAD_SIZE);
+}
+
+/*
+  This is called with CURCORE.sched_spinlock held, so it does not
+  free memory.
+ */
+static void tcb_pool_put(TCB* tcb)
+{
+  CCB* core = & CURCORE;
+  rlnode_init(& tcb->sched_node, tcb);
+  if(tcb->stack_size == THREAD_STACK_SIZE && core->npool < sched_pool_high) {
+    rlist_push_front(& core->tcb_pool, & tcb->sched_node);
+    core->npool++;
+    core->pool_dirty++;
+  }
+  else
+    rlist_push_back(& core->tcb_release, & tcb->sched_node);
+}
+
+/*
+  Free the blocks of the current core's pool beyond the first 'keep',
+  and return the stack pages of the rest to the host.
+ */
+static void tcb_pool_trim(unsigned int keep)
+{
+  tcb_pool_release();
+
+  while(1) {
+    int preempt = preempt_off;
+    CCB* core = & CURCORE;
+    TCB* tcb = NULL;
+    if(core->npool > keep) {
+      tcb = rlist_pop_back(& core->tcb_pool)->tcb;
+      core->npool--;
+      if(core->pool_dirty > core->npool) core->pool_dirty = core->npool;
+    }
+    if(preempt) preempt_on;
+
+    if(tcb == NULL) break;
+    free_thread(tcb, THREAD_SIZE);
+  }
+
+  int preempt = preempt_off;
+  CCB* core = & CURCORE;
+  rlnode* n = core->tcb_pool.next;
+  for(; core->pool_dirty > 0; core->pool_dirty--, n = n->next)
+    scrub_thread(n->tcb);
+  if(preempt) preempt_on;
+}
+
+
 /*
   This is the function that is used to start normal threads.
 */
@@ -126,10 +357,40 @@ static void thread_start()
   Initialize and return a new TCB
 */
 
-TCB* spawn_thread(PCB* pcb, void (*func)())
+/* Round up to whole pages */
+static inline size_t page_round(size_t size)
+{
+  return (size + SYSTEM_PAGE_SIZE - 1) & ~(size_t)(SYSTEM_PAGE_SIZE - 1);
+}
+
+cpu_mask_t sched_core_mask(cpu_mask_t mask)
+{
+  uint ncores = cpu_cores();
+  if(ncores < 8*sizeof(cpu_mask_t))
+    mask &= CPU_MASK(ncores)-1;
+  return mask;
+}
+
+int sched_check_attr(const thread_attr* attr)
 {
+  if(attr == NULL)
+    return 0;
+  if(attr->stack_size != 0 &&
+      (attr->stack_size < THREAD_STACK_MIN || attr->stack_size > THREAD_STACK_MAX))
+    return -1;
+  if(attr->affinity != 0 && sched_core_mask(attr->affinity) == 0)
+    return -1;
+  return 0;
+}
+
+TCB* spawn_thread(PCB* pcb, void (*func)(), const thread_attr* attr)
+{
+  size_t stack_size = (attr && attr->stack_size) ? page_round(attr->stack_size) : THREAD_STACK_SIZE;
+
   /* The allocated thread size must be a multiple of page size */
-  TCB* tcb = (TCB*) allocate_thread(THREAD_SIZE);
+  TCB* tcb = (stack_size == THREAD_STACK_SIZE) ?
+    tcb_pool_get() : (TCB*) allocate_thread(THREAD_BLOCK_SIZE(stack_size));
+  tcb->stack_size = stack_size;
 
   /* Set the owner pcb and ptcb*/
   tcb->owner_pcb = pcb;
@@ -139,21 +400,32 @@ TCB* spawn_thread(PCB* pcb, void (*func)())
   tcb->type = NORMAL_THREAD;
   tcb->state = INIT;
   tcb->phase = CTX_CLEAN;
+  tcb->queued = SCHED_UNQUEUED;
   tcb->thread_func = func;
   tcb->wakeup_time = NO_TIMEOUT;
   tcb->priority = 0;
   rlnode_init(& tcb->sched_node, tcb);  /* Intrusive list node */
+  phnode_init(& tcb->run_node, tcb);
+  tcb->vruntime = 0;
+  tcb->times = (thread_times){ 0 };
+  tcb->state_since = bios_clock();
+  tcb->wchan = NULL;
+  tcb->weight = (attr && attr->weight) ? attr->weight : FAIR_DEFAULT_WEIGHT;
+
+  /* The new thread starts on the queues of the creating core */
+  tcb->core = & CURCORE;
+  tcb->affinity = (attr && attr->affinity) ? sched_core_mask(attr->affinity) : CPU_MASK_ALL;
 
 
   /* Compute the stack segment address and size */
-  void* sp = ((void*)tcb) + THREAD_TCB_SIZE;
+  void* sp = THREAD_STACK(tcb);
 
   /* Init the context */
-  cpu_initialize_context(& tcb->context, sp, THREAD_STACK_SIZE, thread_start);
+  cpu_initialize_context(& tcb->context, sp, stack_size, thread_start);
 
 #ifndef NVALGRIND
   tcb->valgrind_stack_id =
-    VALGRIND_STACK_REGISTER(sp, sp+THREAD_STACK_SIZE);
+    VALGRIND_STACK_REGISTER(sp, sp+stack_size);
 #endif
 
   /* increase the count of active threads */
@@ -166,7 +438,7 @@ TCB* spawn_thread(PCB* pcb, void (*func)())
 
 
 /*
-  This is called with tcb->state_spinlock locked !
+  This is called with tcb->core->sched_spinlock locked !
  */
 void release_TCB(TCB* tcb)
 {
@@ -174,7 +446,7 @@ void release_TCB(TCB* tcb)
   VALGRIND_STACK_DEREGISTER(tcb->valgrind_stack_id);
 #endif
 
-  free_thread(tcb, THREAD_SIZE);
+  tcb_pool_put(tcb);
 
   Mutex_Lock(&active_threads_spinlock);
   active_threads--;
@@ -198,98 +470,439 @@ void release_TCB(TCB* tcb)
 CCB cctx[MAX_CORES];
 
 
-/*
-  The scheduler queue is implemented as a doubly linked list. The
-  head and tail of this list are stored in  SCHED.
+/* The scheduler classes, indexed by sched_policy */
+static const sched_class* sched_classes[SCHED_POLICY_MAX] = {
+  [SCHED_POLICY_MLFQ] = & mlfq_sched_class,
+  [SCHED_POLICY_FAIR] = & fair_sched_class
+};
 
-  Also, the scheduler contains a linked list of all the sleeping
-  threads with a timeout.
+/* The scheduler class in use */
+const sched_class* SCHED = & mlfq_sched_class;
 
-  Both of these structures are protected by @c sched_spinlock.
+
+/*
+  Each core keeps its own run queue (managed by the scheduler class),
+  and its own timeout wheel of the sleeping threads with a timeout. Both
+  of these structures are protected by the core's @c sched_spinlock, so
+  that cores do not contend with each other in the common case.
+
+  A thread belongs to the core pointed to by tcb->core. It is only moved
+  to a different core while it is READY and sitting in a scheduler queue,
+  when an idle core steals it (see sched_steal()) or pulls it from a
+  migration list (see sched_pull_migrations()), or while it is woken up
+  (see sched_wakeup()). The thread is taken out of the queue of the old
+  core and put in a queue of the new core under different locks; in
+  between, tcb->queued is SCHED_UNQUEUED and nobody else may queue it.
 */
 
 
-rlnode SCHED[MAX_SCHED_Q];    /* The scheduler array of queues */
-rlnode TIMEOUT_LIST;				  /* The list of threads with a timeout */
-Mutex sched_spinlock = MUTEX_INIT;    /* spinlock for scheduler queue */
+/*
+  Lock the core that a thread belongs to, and return it.
 
+  The thread may be stolen by another core while we wait for the lock,
+  so we must check again after locking.
+*/
+static CCB* lock_tcb_core(TCB* tcb)
+{
+  while(1) {
+    CCB* core = __atomic_load_n(& tcb->core, __ATOMIC_ACQUIRE);
+    Mutex_Lock(& core->sched_spinlock);
+    if(core == __atomic_load_n(& tcb->core, __ATOMIC_RELAXED))
+      return core;
+    Mutex_Unlock(& core->sched_spinlock);
+  }
+}
 
 
 /* Interrupt handler for ALARM */
 void yield_handler()
 {
+  /* The timer has expired, so it is not running any more */
+  int preempt = preempt_off;
+  CCB* core = & CURCORE;
+  Mutex_Lock(& core->sched_spinlock);
+  core->timer_armed = 0;
+  Mutex_Unlock(& core->sched_spinlock);
+  if(preempt) preempt_on;
+
   yield(SCHED_QUANTUM);
 }
 
-/* Interrupt handle for inter-core interrupts */
-void ici_handler()
+
+/*
+  In tickless mode, the quantum timer of a core needs to run only if
+  some thread is waiting for the current thread to be preempted.
+  Timeouts have their own timer (see sched_register_timeout()).
+
+  This function decides if the timer must be started or stopped, and
+  updates core->timer_armed accordingly. It returns the duration to set
+  the timer to (0 to cancel it), or -1 if the timer must be left alone.
+  The actual (expensive) timer call is made by sched_timer_apply(),
+  after the spinlock is released.
+
+  *** MUST BE CALLED WITH core->sched_spinlock HELD ***
+*/
+static TimerDuration sched_timer_update(CCB* core)
+{
+  int need = core->nready > 0 && core->current_thread != & core->idle_thread;
+
+  if(need == core->timer_armed)
+    return -1;
+  core->timer_armed = need;
+  return need ? QUANTUM : 0;
+}
+
+
+/* Perform the action returned by sched_timer_update() on the current core */
+static void sched_timer_apply(TimerDuration t)
 {
-  /* noop for now... */
+  if(t != (TimerDuration)-1) {
+    bios_set_timer(t);
+    CURCORE.timer_calls++;
+  }
+}
+
+
+
+/*
+  Make sure that the timeout timer of the current core expires no
+  later than @c latest. If it has to be moved, it is armed at @c expiry.
+  When a thread leaves the wheel early, the timer is not moved later;
+  it just finds nothing to do when it expires.
+
+  *** MUST BE CALLED WITH core->sched_spinlock HELD, core == &CURCORE ***
+*/
+static void sched_timeout_arm(CCB* core, TimerDuration expiry, TimerDuration latest)
+{
+  if(core->timeout_next > latest) {
+    core->timeout_next = expiry;
+    bios_hrtimer_start(& core->timeout_timer, expiry * 1000ull);
+  }
+}
+
+
+/*
+  Return the time that the timeout timer of a core should next expire.
+
+  This is the earliest wakeup time in the wheel, moved later to the last
+  wakeup time within TIMEOUT_SLACK of it, so that all of these threads
+  are woken up together. Only the first non-empty tick is searched; 
+  threads more than one revolution away are skipped.
+
+  *** MUST BE CALLED WITH core->sched_spinlock HELD ***
+*/
+static TimerDuration sched_timeout_next(CCB* core)
+{
+  for(TimerDuration tick = core->wheel_tick; 
+      tick < core->wheel_tick + TIMEOUT_WHEEL_SLOTS; tick++) {
+    rlnode* slot = & core->timeout_wheel[tick % TIMEOUT_WHEEL_SLOTS];
+    TimerDuration end = (tick+1) * TIMEOUT_TICK;
+
+    TimerDuration first = NO_TIMEOUT;
+    for(rlnode* n = slot->next; n != slot; n = n->next)
+      if(n->tcb->wakeup_time < end && n->tcb->wakeup_time < first)
+        first = n->tcb->wakeup_time;
+    if(first == NO_TIMEOUT)
+      continue;
+
+    TimerDuration expiry = first;
+    for(rlnode* n = slot->next; n != slot; n = n->next)
+      if(n->tcb->wakeup_time > expiry && n->tcb->wakeup_time <= first + TIMEOUT_SLACK)
+        expiry = n->tcb->wakeup_time;
+    return expiry;
+  }
+
+  /* All the deadlines are far away; look again after a revolution */
+  return (core->wheel_tick + TIMEOUT_WHEEL_SLOTS) * TIMEOUT_TICK;
 }
 
 
 /*
-  Possibly add TCB to the scheduler timeout list.
+  Possibly add TCB to the timeout wheel of its core.
+
+  The thread is placed in the wheel slot of the tick of its wakeup time.
+  Threads whose deadline is more than one revolution away share the slot
+  with nearer ones; they are simply skipped when the slot expires early.
+
+  The thread must be the current thread, so that its core is the 
+  current core, which owns the timeout timer. If the timer is already
+  armed within TIMEOUT_SLACK of the wakeup time, it is not moved.
 
-  *** MUST BE CALLED WITH sched_spinlock HELD ***
+  *** MUST BE CALLED WITH tcb->core->sched_spinlock HELD ***
 */
 static void sched_register_timeout(TCB* tcb, TimerDuration timeout)
 {
   if(timeout!=NO_TIMEOUT){
+    CCB* core = tcb->core;
+
+    TimerDuration curtime = bios_clock();
+    tcb->wakeup_time = curtime + timeout;
+
+    /* An empty wheel has not been kept up to date */
+    if(core->ntimeouts == 0)
+      core->wheel_tick = curtime / TIMEOUT_TICK;
+
+    TimerDuration tick = tcb->wakeup_time / TIMEOUT_TICK;
+    rlist_push_back(& core->timeout_wheel[tick % TIMEOUT_WHEEL_SLOTS], & tcb->sched_node);
+    core->ntimeouts++;
+
+    sched_timeout_arm(core, tcb->wakeup_time, tcb->wakeup_time + TIMEOUT_SLACK);
+  }
+}
+
+
+/*
+  Return true if a core is (probably) idle. This is a racy peek,
+  used only as a hint when choosing a core to wake up.
+ */
+static inline int core_is_idle(CCB* core)
+{
+  return __atomic_load_n(& core->nready, __ATOMIC_RELAXED) == 0
+    && __atomic_load_n(& core->current_thread, __ATOMIC_RELAXED) == & core->idle_thread;
+}
+
+
+/*
+  Choose a core (other than @c self) that a thread may run on,
+  preferring an idle one. Return NULL if there is none.
+ */
+static CCB* sched_choose_core(TCB* tcb, CCB* self)
+{
+  uint ncores = cpu_cores();
+  CCB* busy = NULL;
+
+  for(uint i=1; i<=ncores; i++) {
+    CCB* core = & cctx[(self->id + i) % ncores];
+    if(core == self || !tcb_allowed_on(tcb, core))
+      continue;
+    if(core_is_idle(core))
+      return core;
+    if(busy == NULL)
+      busy = core;
+  }
+  return busy;
+}
+
 
-  	/* set the wakeup time */
-  	TimerDuration curtime = bios_clock();
-  	tcb->wakeup_time = (timeout==NO_TIMEOUT) ? NO_TIMEOUT : curtime+timeout;
+/*
+  Add TCB to the run queue of its core, and return 1.
+
+  If the thread is not allowed to run on its core, it is put in the
+  core's migration list instead, and an allowed core is sent an
+  inter-core interrupt, so that it pulls the thread. Then, 0 is returned.
 
-  	/* add to the TIMEOUT_LIST in sorted order */
-  	rlnode* n = TIMEOUT_LIST.next;
-  	for( ; n!=&TIMEOUT_LIST; n=n->next)
-  		/* skip earlier entries */
-  		if(tcb->wakeup_time < n->tcb->wakeup_time) break;
-  	/* insert before n */
-	rl_splice(n->prev, & tcb->sched_node);
+  *** MUST BE CALLED WITH tcb->core->sched_spinlock HELD ***
+*/
+static int sched_queue_insert(TCB* tcb)
+{
+  CCB* core = tcb->core;
+  assert(tcb->queued == SCHED_UNQUEUED);
+
+  if(! tcb_allowed_on(tcb, core)) {
+    rlist_push_back(& core->migrate_list, & tcb->sched_node);
+    core->nmigrate++;
+    tcb->queued = SCHED_MIGRATING;
+    CCB* target = sched_choose_core(tcb, core);
+    assert(target != NULL);
+    cpu_ici(target->id);
+    return 0;
   }
+
+  SCHED->enqueue(core, tcb);
+  core->nready++;
+  tcb->queued = SCHED_RUNQUEUE;
+  return 1;
+}
+
+
+/*
+  Remove TCB from the queue of its core that holds it, if any.
+
+  *** MUST BE CALLED WITH tcb->core->sched_spinlock HELD ***
+*/
+static void sched_queue_remove(TCB* tcb)
+{
+  CCB* core = tcb->core;
+
+  switch(tcb->queued) {
+    case SCHED_RUNQUEUE:
+      SCHED->dequeue(core, tcb);
+      core->nready--;
+      if(core->handoff == tcb) core->handoff = NULL;
+      break;
+    case SCHED_MIGRATING:
+      rlist_remove(& tcb->sched_node);
+      core->nmigrate--;
+      break;
+    case SCHED_UNQUEUED:
+      break;
+  }
+  tcb->queued = SCHED_UNQUEUED;
+}
+
+
+/*
+  Tell the policy that a READY thread leaves its core, or arrives at
+  its new core, when it is moved between cores.
+
+  *** MUST BE CALLED WITH tcb->core->sched_spinlock HELD ***
+*/
+static inline void sched_migrate_out(TCB* tcb)
+{
+  if(SCHED->migrate_out) SCHED->migrate_out(tcb->core, tcb);
+}
+
+static inline void sched_migrate_in(TCB* tcb)
+{
+  if(SCHED->migrate_in) SCHED->migrate_in(tcb->core, tcb);
 }
 
 
 /*
-  Add TCB to the end of the scheduler list.
+  Add TCB to the run queue of its core, as in sched_queue_insert(), 
+  and make sure that some core will run it.
 
-  *** MUST BE CALLED WITH sched_spinlock HELD ***
+  *** MUST BE CALLED WITH tcb->core->sched_spinlock HELD ***
 */
 static void sched_queue_add(TCB* tcb)
 {
+  CCB* core = tcb->core;
+
+  if(! sched_queue_insert(tcb))
+    return;
+
+  /*
+    Restart the thread's core if it is halted. If it is running a thread
+    without a quantum timer, interrupt it so that it starts the timer.
+    If the thread was added to our own queue, restart some idle core
+    that may steal it.
+   */
+  if(core != &CURCORE) {
+    if(sched_tickless && ! core->timer_armed && core->current_thread != & core->idle_thread)
+      cpu_ici(core->id);
+    cpu_core_restart(core->id);
+  }
+  else {
+    CCB* target = sched_choose_core(tcb, core);
+    if(target != NULL && core_is_idle(target))
+      cpu_core_restart(target->id);
+  }
+}
 
-  unsigned int cur = tcb->priority;
-  assert(cur>=MAX_PRIORITY && cur<=MIN_PRIORITY);
 
-  /*Push the thread in the queue, whose number indicated by the priority of the thread*/
-  rlist_push_back(&SCHED[cur], &tcb->sched_node);
+/*
+  Thread time accounting.
 
-  /* Restart possibly halted cores */
-  cpu_core_restart_one();
+  A thread charges the time since @c state_since to its current state,
+  every time it changes state. The wait-to-run latency is the time from
+  becoming READY to RUNNING.
+ */
+static void times_add_wchan(thread_times* t, const char* wchan, 
+  TimerDuration time, unsigned long sleeps)
+{
+  int i = THREAD_WCHANS-1;    /* The last entry collects the rest */
+  if(wchan != NULL)
+    for(int j=0; j < THREAD_WCHANS-1; j++)
+      if(t->wchan[j].wchan == wchan || t->wchan[j].wchan == NULL) {
+        t->wchan[j].wchan = wchan;
+        i = j;
+        break;
+      }
+  t->wchan[i].time += time;
+  t->wchan[i].sleeps += sleeps;
 }
 
+static void times_charge(thread_times* t, Thread_state state, const char* wchan, TimerDuration d)
+{
+  switch(state) {
+    case RUNNING:
+      t->cpu += d;
+      break;
+    case READY:
+      t->ready += d;
+      if(d > t->max_latency) t->max_latency = d;
+      break;
+    case STOPPED:
+      t->blocked += d;
+      t->sleeps++;
+      times_add_wchan(t, wchan, d, 1);
+      break;
+    default:
+      break;
+  }
+}
 
 /*
-	Adjust the state of a thread to make it READY.
+  Charge the time of a thread in its current state, as it leaves it.
 
-    *** MUST BE CALLED WITH sched_spinlock HELD ***
+  *** MUST BE CALLED WITH tcb->core->sched_spinlock HELD ***
  */
-static void sched_make_ready(TCB* tcb)
+static inline void sched_account(TCB* tcb, TimerDuration now)
+{
+  if(now > tcb->state_since)
+    times_charge(& tcb->times, tcb->state, tcb->wchan, now - tcb->state_since);
+  tcb->state_since = now;
+}
+
+void thread_times_get(TCB* tcb, thread_times* times)
+{
+  int preempt = preempt_off;
+  CCB* core = lock_tcb_core(tcb);
+
+  *times = tcb->times;
+  TimerDuration now = bios_clock();
+  /* Add the time in the current state */
+  if(now > tcb->state_since)
+    times_charge(times, tcb->state, tcb->wchan, now - tcb->state_since);
+
+  Mutex_Unlock(& core->sched_spinlock);
+  if(preempt) preempt_on;
+}
+
+void thread_times_add(thread_times* to, const thread_times* from)
+{
+  to->cpu += from->cpu;
+  to->ready += from->ready;
+  to->blocked += from->blocked;
+  if(from->max_latency > to->max_latency) to->max_latency = from->max_latency;
+  to->sleeps += from->sleeps;
+  for(int i=0; i < THREAD_WCHANS; i++)
+    if(from->wchan[i].sleeps != 0)
+      times_add_wchan(to, from->wchan[i].wchan, from->wchan[i].time, from->wchan[i].sleeps);
+}
+
+
+/*
+	Adjust the state of a thread to make it READY, without queueing it.
+
+    *** MUST BE CALLED WITH tcb->core->sched_spinlock HELD ***
+ */
+static void sched_unblock(TCB* tcb)
 {
 	assert(tcb->state == STOPPED || tcb->state == INIT);
 
-	/* Possibly remove from TIMEOUT_LIST */
+	/* Possibly remove from the timeout wheel */
 	if(tcb->wakeup_time != NO_TIMEOUT) {
-		/* tcb is in TIMEOUT_LIST, fix it */
 		assert(tcb->sched_node.next != &(tcb->sched_node) && tcb->state == STOPPED);
 		rlist_remove(& tcb->sched_node);
 		tcb->wakeup_time = NO_TIMEOUT;
+		tcb->core->ntimeouts--;
 	}
 
 	/* Mark as ready */
+	sched_account(tcb, bios_clock());
 	tcb->state = READY;
+}
+
+
+/*
+	Adjust the state of a thread to make it READY.
+
+    *** MUST BE CALLED WITH tcb->core->sched_spinlock HELD ***
+ */
+static void sched_make_ready(TCB* tcb)
+{
+	sched_unblock(tcb);
 
 	/* Possibly add to the scheduler queue */
 	if(tcb->phase == CTX_CLEAN)
@@ -298,65 +911,299 @@ static void sched_make_ready(TCB* tcb)
 
 
 /*
-  Remove the head of the scheduler list, if any, and
-  return it. Return NULL if the list is empty.
+  Wake up the threads of the timeout wheel of a core, whose wakeup
+  time has passed.
 
-  *** MUST BE CALLED WITH sched_spinlock HELD ***
+  *** MUST BE CALLED WITH core->sched_spinlock HELD ***
 */
-static TCB* sched_queue_select()
+static void sched_expire_timeouts(CCB* core)
 {
+  if(core->ntimeouts == 0)
+    return;
 
-  /* Empty the timeout list up to the current time and wake up each thread */
   TimerDuration curtime = bios_clock();
-  while(! is_rlist_empty(&TIMEOUT_LIST)) {
-  		TCB* tcb = TIMEOUT_LIST.next->tcb;
-  		if(tcb->wakeup_time > curtime)
-  			break;
-  		sched_make_ready(tcb);
-  }
-
-  sched_aging();
-
-  /* While the queue i is empty go to the next queue */
-  rlnode* sel;
-  int i=0;
-  while(is_rlist_empty(&SCHED[i])){
-    if(i > MAX_SCHED_Q-1 || i<0){
-      break;      /* If i goes over the value 4 break, because we dont have other queues to search */
-    }else{
-      i++;        /* Else increase i, so in the nextrepeatition we to go to the next queue */
+  TimerDuration curtick = curtime / TIMEOUT_TICK;
+  TimerDuration tick = core->wheel_tick;
+
+  /* No slot needs to be visited twice, even if we are far behind */
+  if(tick + TIMEOUT_WHEEL_SLOTS <= curtick)
+    tick = curtick - TIMEOUT_WHEEL_SLOTS + 1;
+
+  for(; tick <= curtick && core->ntimeouts > 0; tick++) {
+    rlnode* slot = & core->timeout_wheel[tick % TIMEOUT_WHEEL_SLOTS];
+    rlnode* n = slot->next;
+    while(n != slot) {
+      TCB* tcb = n->tcb;
+      n = n->next;
+      if(tcb->wakeup_time <= curtime)
+        sched_make_ready(tcb);
     }
   }
 
-  if(i<=(MAX_SCHED_Q-1) && !is_rlist_empty(&SCHED[i])){
-    sel=rlist_pop_front(&SCHED[i]);       /* If we manage to exit while, we check the number of i and if the queue has nodes */
-    return sel->tcb;        /* We return the tcb of the node sel */
-  }else{
-    return NULL;        /* If the contitions is false, which means we didn't find a node, we return NULL */
+  /* The current tick may still hold later wakeup times */
+  core->wheel_tick = curtick;
+}
+
+
+/*
+  Interrupt handler for HRTIMER.
+
+  The timeout timer of the core has expired (or some other hrtimer of
+  the core, in which case there may be nothing to do).
+ */
+void timeout_handler()
+{
+  int preempt = preempt_off;
+  CCB* core = & CURCORE;
+  Mutex_Lock(& core->sched_spinlock);
+
+  sched_expire_timeouts(core);
+
+  /* The timer is not armed any more, unless it was moved earlier */
+  if(core->timeout_next <= bios_clock())
+    core->timeout_next = NO_TIMEOUT;
+  if(core->ntimeouts > 0) {
+    TimerDuration expiry = sched_timeout_next(core);
+    sched_timeout_arm(core, expiry, expiry);
   }
+
+  /* We may need to preempt ourselves for the woken threads */
+  TimerDuration t = sched_tickless ? sched_timer_update(core) : -1;
+
+  Mutex_Unlock(& core->sched_spinlock);
+  sched_timer_apply(t);
+
+  if(preempt) preempt_on;
+}
+
+
+/*
+  Remove the next thread to run from the run queue of a core, if any,
+  and return it. Return NULL if the run queue is empty.
+
+  *** MUST BE CALLED WITH core->sched_spinlock HELD ***
+*/
+static TCB* sched_queue_select(CCB* core)
+{
+
+  SCHED->tick(core);
+
+  if(core->nready == 0)
+    return NULL;
+
+  TCB* next = SCHED->pick_next(core);
+  assert(next != NULL);  /* nready is out of sync */
+  core->nready--;
+  next->queued = SCHED_UNQUEUED;
+  return next;
 }
 
 
 /*
-  Make the process ready.
+  Try to steal a ready thread from another core, and move it to the
+  queues of the current core. This is called by idle cores, before
+  they halt. Returns 1 if a thread was stolen, 0 otherwise.
+
+  *** MUST BE CALLED WITHOUT ANY sched_spinlock HELD ***
+*/
+static int sched_steal()
+{
+  CCB* self = & CURCORE;
+  uint ncores = cpu_cores();
+  TCB* tcb = NULL;
+
+  int preempt = preempt_off;
+
+  for(uint i=1; i<ncores && tcb==NULL; i++) {
+    CCB* victim = & cctx[(self->id + i) % ncores];
+
+    /* A racy peek, to avoid locking idle cores */
+    if(__atomic_load_n(& victim->nready, __ATOMIC_RELAXED) == 0)
+      continue;
+
+    Mutex_Lock(& victim->sched_spinlock);
+    if(victim->nready > 0) {
+      tcb = SCHED->pick_migrate(victim, self);
+      if(tcb != NULL) {
+        sched_queue_remove(tcb);
+        sched_migrate_out(tcb);
+        __atomic_store_n(& tcb->core, self, __ATOMIC_RELEASE);
+      }
+    }
+    Mutex_Unlock(& victim->sched_spinlock);
+  }
+
+  if(tcb != NULL) {
+    /* The thread is READY and unqueued, so nobody else will queue it.
+       Its affinity may have changed meanwhile. */
+    Mutex_Lock(& self->sched_spinlock);
+    sched_migrate_in(tcb);
+    sched_queue_insert(tcb);
+    Mutex_Unlock(& self->sched_spinlock);
+  }
+
+  if(preempt) preempt_on;
+
+  return tcb != NULL;
+}
+
+
+/*
+  Move the threads that are waiting in the migration lists of other
+  cores, and are allowed to run on the current core, to the run queue
+  of the current core. Returns the number of threads moved.
+
+  *** MUST BE CALLED WITHOUT ANY sched_spinlock HELD ***
+*/
+static int sched_pull_migrations()
+{
+  CCB* self = & CURCORE;
+  uint ncores = cpu_cores();
+  int pulled = 0;
+
+  int preempt = preempt_off;
+
+  for(uint c=0; c<ncores; c++) {
+    CCB* from = & cctx[c];
+    if(__atomic_load_n(& from->nmigrate, __ATOMIC_RELAXED) == 0)
+      continue;
+
+    rlnode moved;
+    rlnode_new(& moved);
+
+    Mutex_Lock(& from->sched_spinlock);
+    rlnode* n = from->migrate_list.next;
+    while(n != & from->migrate_list) {
+      TCB* tcb = n->tcb;
+      n = n->next;
+      if(tcb_allowed_on(tcb, self)) {
+        sched_queue_remove(tcb);
+        sched_migrate_out(tcb);
+        rlist_push_back(& moved, & tcb->sched_node);
+        __atomic_store_n(& tcb->core, self, __ATOMIC_RELEASE);
+      }
+    }
+    Mutex_Unlock(& from->sched_spinlock);
+
+    if(! is_rlist_empty(& moved)) {
+      /* As in sched_steal(), the threads are READY and not queued */
+      Mutex_Lock(& self->sched_spinlock);
+      while(! is_rlist_empty(& moved)) {
+        TCB* tcb = rlist_pop_front(& moved)->tcb;
+        sched_migrate_in(tcb);
+        sched_queue_insert(tcb);
+        pulled++;
+      }
+      Mutex_Unlock(& self->sched_spinlock);
+    }
+  }
+
+  if(preempt) preempt_on;
+
+  return pulled;
+}
+
+
+/*
+  Interrupt handler for inter-core interrupts.
+
+  These are sent to a core when a thread is waiting to migrate to it,
+  or when the current thread has lost its right to run on it.
  */
-int wakeup(TCB* tcb)
+void ici_handler()
+{
+  sched_pull_migrations();
+
+  if(! tcb_allowed_on(CURTHREAD, & CURCORE))
+    yield(SCHED_QUANTUM);
+  else if(sched_tickless) {
+    /* Threads may have been added to our queue; start the timer */
+    int preempt = preempt_off;
+    CCB* core = & CURCORE;
+    Mutex_Lock(& core->sched_spinlock);
+    TimerDuration t = sched_timer_update(core);
+    Mutex_Unlock(& core->sched_spinlock);
+    sched_timer_apply(t);
+    if(preempt) preempt_on;
+  }
+}
+
+
+int sched_set_affinity(TCB* tcb, cpu_mask_t mask)
+{
+  int preempt = preempt_off;
+  CCB* core = lock_tcb_core(tcb);
+
+  tcb->affinity = mask;
+
+  int kick = 0;
+  if(tcb->queued == SCHED_MIGRATING 
+      || (tcb->queued == SCHED_RUNQUEUE && ! tcb_allowed_on(tcb, core))) {
+    /* Queue it again, by the new affinity */
+    sched_queue_remove(tcb);
+    sched_queue_add(tcb);
+  }
+  else if(tcb->state == RUNNING && ! tcb_allowed_on(tcb, core))
+    kick = 1;
+  /* Else, it will be placed by the new affinity when it is queued. */
+
+  Mutex_Unlock(& core->sched_spinlock);
+
+  /* A running thread on this core is the caller, which yields by itself */
+  if(kick && core != & CURCORE)
+    cpu_ici(core->id);
+
+  if(preempt) preempt_on;
+
+  return kick && core == & CURCORE;
+}
+
+
+/*
+  Make the process ready, possibly as the handoff thread of the current core.
+ */
+static int sched_wakeup(TCB* tcb, int handoff)
 {
 	int ret = 0;
 
 	/* Preemption off */
 	int oldpre = preempt_off;
 
-	/* To touch tcb->state, we must get the spinlock. */
-	Mutex_Lock(& sched_spinlock);
+	/* To touch tcb->state, we must get the spinlock of its core. */
+	CCB* core = lock_tcb_core(tcb);
+	CCB* self = & CURCORE;
 
+	TimerDuration t = -1;
 	if(tcb->state==STOPPED || tcb->state==INIT) {
-		sched_make_ready(tcb);
 		ret = 1;
+		if(handoff && core != self && tcb->phase == CTX_CLEAN 
+				&& tcb_allowed_on(tcb, self) && ! core_is_idle(core)) {
+			/* Move it here, as in sched_steal(); it is READY and not queued */
+			sched_unblock(tcb);
+			sched_migrate_out(tcb);
+			__atomic_store_n(& tcb->core, self, __ATOMIC_RELEASE);
+			Mutex_Unlock(& core->sched_spinlock);
+			core = self;
+			Mutex_Lock(& core->sched_spinlock);
+			sched_migrate_in(tcb);
+			sched_queue_add(tcb);
+		}
+		else
+			sched_make_ready(tcb);
+
+		/* It is in our run queue, unless it is still switching out */
+		if(handoff && core == self && tcb->queued == SCHED_RUNQUEUE)
+			self->handoff = tcb;
+
+		/* We may need to preempt ourselves for the new thread */
+		if(sched_tickless && core == & CURCORE)
+			t = sched_timer_update(core);
 	}
 
 
-	Mutex_Unlock(& sched_spinlock);
+	Mutex_Unlock(& core->sched_spinlock);
+
+	sched_timer_apply(t);
 
 	/* Restore preemption state */
 	if(oldpre) preempt_on;
@@ -364,26 +1211,41 @@ int wakeup(TCB* tcb)
 	return ret;
 }
 
+int wakeup(TCB* tcb)
+{
+	return sched_wakeup(tcb, 0);
+}
+
+int wakeup_handoff(TCB* tcb)
+{
+	return sched_wakeup(tcb, 1);
+}
+
 
 /*
   Atomically put the current process to sleep, after unlocking mx.
  */
-void sleep_releasing(Thread_state state, Mutex* mx, enum SCHED_CAUSE cause, TimerDuration timeout)
+void sleep_releasing_wchan(Thread_state state, Mutex* mx, enum SCHED_CAUSE cause, 
+  const char* wchan, TimerDuration timeout)
 {
   assert(state==STOPPED || state==EXITED);
 
-  TCB* tcb = CURTHREAD;
-
   /*
-    The tcb->state_spinlock guarantees atomic sleep-and-release.
+    The core's sched_spinlock guarantees atomic sleep-and-release.
     But, to access it safely, we need to go into the non-preemptive
-    domain.
+    domain. Also, since threads may migrate between cores, we must
+    not read CURTHREAD before preemption is off.
    */
   int preempt = preempt_off;
-  Mutex_Lock(& sched_spinlock);
+  CCB* core = & CURCORE;
+  TCB* tcb = core->current_thread;
+  assert(tcb->core == core);
+  Mutex_Lock(& core->sched_spinlock);
 
   /* mark the thread as stopped or exited */
+  sched_account(tcb, bios_clock());
   tcb->state = state;
+  tcb->wchan = wchan;
 
   /* register the timeout (if any) for the sleeping thread */
   if(state!=EXITED)
@@ -393,7 +1255,7 @@ void sleep_releasing(Thread_state state, Mutex* mx, enum SCHED_CAUSE cause, Time
   if(mx!=NULL) Mutex_Unlock(mx);
 
   /* Release the schduler spinlock before calling yield() !!! */
-  Mutex_Unlock(& sched_spinlock);
+  Mutex_Unlock(& core->sched_spinlock);
 
   /* call this to schedule someone else */
   yield(cause);
@@ -402,79 +1264,66 @@ void sleep_releasing(Thread_state state, Mutex* mx, enum SCHED_CAUSE cause, Time
   if(preempt) preempt_on;
 }
 
-void sched_aging(){
-
-  rlnode* seltcb;
-
-  if(TOTAL_YIELD == 0){
+void sched_report_stats()
+{
+  fprintf(stderr, "Scheduler: policy %s%s\n", SCHED->name, sched_tickless ? ", tickless" : "");
 
-    for(int i=MAX_PRIORITY;i > MAX_PRIORITY + 1; i++){
-      if(!is_rlist_empty(&SCHED[i])){
-        seltcb = rlist_pop_front(&SCHED[i]);
-        rlist_push_front(&SCHED[i-1], seltcb);
-      }
-    }
-    TOTAL_YIELD = 100;
+  /* Without tickless mode, every time slice costs two timer calls */
+  unsigned long nswitches = 0, timer_calls = 0;
+  for(uint c=0; c<MAX_CORES; c++) {
+    nswitches += cctx[c].nswitches;
+    timer_calls += cctx[c].timer_calls;
   }
-}
-
-
-void sched_priority(TCB* tcb, enum SCHED_CAUSE cause){
-
-  unsigned int curPriority = tcb->priority;
-
-  assert(curPriority >= MAX_PRIORITY && curPriority <= MIN_PRIORITY);
-
-  /* At cause QUANTUM, PIPE & USER we increase priority by 1(default case) */
-  switch(cause){
-
-    case SCHED_QUANTUM:  /**< The quantum has expired */
-
-    case SCHED_IO:       /**< The thread is waiting for I/O */
-      tcb->priority = MAX_PRIORITY;
-      break;
-    case SCHED_MUTEX:    /**< Mutex_Lock yielded on contention */
-      tcb->priority = curPriority < MIN_PRIORITY ? curPriority + 1 : MIN_PRIORITY;
-      break;
-    case SCHED_PIPE:     /**< Sleep at a pipe or socket */
-
-    case SCHED_POLL:     /**< The thread is polling a device */
-      tcb->priority = MAX_PRIORITY + 1;
-      break;
-    case SCHED_IDLE:     /**< The idle thread called yield */
-      tcb->priority = MIN_PRIORITY;
-      break;
-    case SCHED_USER:
-
-    default:
-      tcb->priority = curPriority > MAX_PRIORITY ? curPriority - 1 : MAX_PRIORITY;
+  unsigned long saved = (2*nswitches > timer_calls) ? 2*nswitches - timer_calls : 0;
+  TimerDuration elapsed = bios_clock() - sched_start_time;
+  fprintf(stderr, "Scheduler: %lu time slices, %lu timer calls, %lu saved (%.1f/sec)\n",
+    nswitches, timer_calls, saved, elapsed ? saved * 1E6 / elapsed : 0.0);
+
+  unsigned long pool_hits = 0, pool_misses = 0;
+  for(uint c=0; c<MAX_CORES; c++) {
+    pool_hits += cctx[c].pool_hits;
+    pool_misses += cctx[c].pool_misses;
   }
-}
+  fprintf(stderr, "Scheduler: thread pool hits: %lu misses: %lu\n", pool_hits, pool_misses);
 
+  unsigned long handoffs = 0;
+  for(uint c=0; c<MAX_CORES; c++)
+    handoffs += cctx[c].handoffs;
+  fprintf(stderr, "Scheduler: %lu time slices handed off\n", handoffs);
 
+  if(SCHED->report)
+    SCHED->report();
+}
 
 
 /* This function is the entry point to the scheduler's context switching */
 void yield(enum SCHED_CAUSE cause)
 {
-  TOTAL_YIELD -= 1;
-  /* Reset the timer, so that we are not interrupted by ALARM */
-  bios_cancel_timer();
-
   /* We must stop preemption but save it! */
   int preempt = preempt_off;
 
+  /* Reset the timer, so that we are not interrupted by ALARM */
+  if(! sched_tickless) {
+    bios_cancel_timer();
+    CURCORE.timer_calls++;
+  }
+
+  CCB* core = & CURCORE;
   TCB* current = CURTHREAD;  /* Make a local copy of current process, for speed */
 
   int current_ready = 0;
 
-  Mutex_Lock(& sched_spinlock);
+  Mutex_Lock(& core->sched_spinlock);
+
+  /* Let the policy account for the time slice that just ended */
+  if(current->type != IDLE_THREAD)
+    SCHED->adjust(current, cause);
 
   switch(current->state)
   {
     case RUNNING:
+      sched_account(current, bios_clock());
       current->state = READY;
-      sched_priority(current,cause);        /* We change the priority of the current thread*/
     case READY:         /* We were awakened before we managed to sleep! */
       current_ready = 1;
       break;
@@ -488,23 +1337,31 @@ void yield(enum SCHED_CAUSE cause)
       assert(0);  /* It should not be READY or EXITED ! */
   }
 
-  /* Get next */
-  TCB* next= sched_queue_select();
+  /* Get next: the handoff thread, unless our time slice is over */
+  TCB* next = NULL;
+  if(core->handoff != NULL && cause != SCHED_QUANTUM) {
+    next = core->handoff;
+    sched_queue_remove(next);
+    core->handoffs++;
+  }
+  core->handoff = NULL;
+  if(next == NULL)
+    next = sched_queue_select(core);
 
 
   /* Maybe there was nothing ready in the scheduler queue ? */
   if(next==NULL) {
-    if(current_ready)
+    if(current_ready && tcb_allowed_on(current, core))
       next = current;
     else
-      next = & CURCORE.idle_thread;
+      next = & core->idle_thread;
   }
 
   /* ok, link the current and next TCB, for the gain phase */
   current->next = next;
   next->prev = current;
 
-  Mutex_Unlock(& sched_spinlock);
+  Mutex_Unlock(& core->sched_spinlock);
 
   /* Switch contexts */
   if(current!=next) {
@@ -533,17 +1390,23 @@ void yield(enum SCHED_CAUSE cause)
 
 void gain(int preempt)
 {
-  Mutex_Lock(& sched_spinlock);
+  CCB* core = & CURCORE;
+  Mutex_Lock(& core->sched_spinlock);
 
   /* Mark current state */
   TCB* current = CURTHREAD;
   TCB* prev = current->prev;
 
+  TimerDuration now = bios_clock();
+  sched_account(current, now);
   current->state = RUNNING;
   current->phase = CTX_DIRTY;
+  current->run_start = now;
 
   if(current != prev) {
-  	/* Take care of the previous thread */
+  	/* Take care of the previous thread. It was running on this core,
+  	   so it belongs to this core. */
+    assert(prev->core == core);
     prev->phase = CTX_CLEAN;
     switch(prev->state)
     {
@@ -560,13 +1423,17 @@ void gain(int preempt)
     }
   }
 
-  Mutex_Unlock(& sched_spinlock);
+  /* Decide about the quantum timer, while the queue is stable */
+  core->nswitches++;
+  TimerDuration t = sched_tickless ? sched_timer_update(core) : QUANTUM;
+
+  Mutex_Unlock(& core->sched_spinlock);
+
+  /* Start or stop the quantum timer, if needed */
+  sched_timer_apply(t);
 
   /* Reset preemption as needed */
   if(preempt) preempt_on;
-
-  /* Set a 1-quantum alarm */
-  bios_set_timer(QUANTUM);
 }
 
 
@@ -577,25 +1444,59 @@ static void idle_thread()
 
   /* We come here whenever we cannot find a ready thread for our core */
   while(active_threads>0) {
-    cpu_core_halt();
+    /* Look for work on busy cores, before halting */
+    if(! sched_pull_migrations() && ! sched_steal()) {
+      tcb_pool_trim(sched_pool_low);
+      cpu_core_halt();
+    }
     yield(SCHED_IDLE);
   }
 
   /* If the idle thread exits here, we are leaving the scheduler! */
+  tcb_pool_trim(0);
   bios_cancel_timer();
   cpu_core_restart_all();
 }
 
 
 /*
-  Initialize the scheduler queue
+  Initialize the scheduler queues of every core
  */
-void initialize_scheduler()
+void initialize_scheduler(sched_policy policy)
 {
-  for(int i=0;i<MAX_SCHED_Q;i++){
-      rlnode_init(&SCHED[i], NULL);
+  assert(policy < SCHED_POLICY_MAX);
+  SCHED = sched_classes[policy];
+
+  for(uint c=0; c<MAX_CORES; c++) {
+    CCB* core = & cctx[c];
+    core->id = c;
+    core->sched_spinlock = MUTEX_TICKET_INIT;
+    lock_profile_name(& core->sched_spinlock, "sched_spinlock");
+    SCHED->init_core(core);
+    for(int i=0;i<TIMEOUT_WHEEL_SLOTS;i++){
+        rlnode_init(&core->timeout_wheel[i], NULL);
+    }
+    core->wheel_tick = 0;
+    core->ntimeouts = 0;
+    bios_hrtimer_init(& core->timeout_timer, NULL);
+    core->timeout_next = NO_TIMEOUT;
+    core->nready = 0;
+    core->handoff = NULL;
+    core->handoffs = 0;
+    rlnode_init(&core->migrate_list, NULL);
+    core->nmigrate = 0;
+    core->timer_armed = 0;
+    core->nswitches = 0;
+    core->timer_calls = 0;
+    rlnode_init(&core->tcb_pool, NULL);
+    core->npool = 0;
+    core->pool_dirty = 0;
+    rlnode_init(&core->tcb_release, NULL);
+    core->pool_hits = 0;
+    core->pool_misses = 0;
   }
-  rlnode_init(&TIMEOUT_LIST, NULL);
+  sched_start_time = bios_clock();
+  install_guard_handler();
 }
 
 void run_scheduler()
@@ -613,19 +1514,29 @@ void run_scheduler()
   curcore->idle_thread.phase = CTX_DIRTY;
   curcore->idle_thread.wakeup_time = NO_TIMEOUT;
   curcore->idle_thread.priority=0;
+  curcore->idle_thread.core = curcore;
+  curcore->idle_thread.affinity = CPU_MASK(curcore->id);
   rlnode_init(& curcore->idle_thread.sched_node, & curcore->idle_thread);
 
   /* Initialize interrupt handler */
   cpu_interrupt_handler(ALARM, yield_handler);
   cpu_interrupt_handler(ICI, ici_handler);
+  cpu_interrupt_handler(HRTIMER, timeout_handler);
+
+  /* Catch stack overflows of threads on this core */
+  void* altstack = core_guard_setup();
 
   /* Run idle thread */
   preempt_on;
   idle_thread();
 
+  core_guard_cleanup(altstack);
+
   /* Finished scheduling */
   assert(CURTHREAD == &CURCORE.idle_thread);
   cpu_interrupt_handler(ALARM, NULL);
   cpu_interrupt_handler(ICI, NULL);
+  cpu_interrupt_handler(HRTIMER, NULL);
+  bios_hrtimer_cancel(& CURCORE.timeout_timer);
   //printf("Ok before initialize of scheduler!\n");
 }
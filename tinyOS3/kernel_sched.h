@@ -55,6 +55,17 @@ typedef enum {
     CTX_DIRTY    /**< Means that, the context stored in the TCN is garbage. */
   } Thread_phase;
 
+/** @brief Where a @c READY thread is queued on its core.
+
+  A @c READY thread is in no queue while it is switching out, and while
+  it is moved between cores. Only the thread that moves it may queue it.
+*/
+typedef enum {
+    SCHED_UNQUEUED,   /**< In no queue of its core */
+    SCHED_RUNQUEUE,   /**< In the run queue of its core */
+    SCHED_MIGRATING   /**< In the migration list of its core */
+  } Thread_queue;
+
 /** @brief Thread type. */
 typedef enum {
   IDLE_THREAD,    /**< Marks an idle thread. */
@@ -78,6 +89,36 @@ enum SCHED_CAUSE {
 };
 
 
+/** @brief The number of wait channels accounted separately for a thread */
+#define THREAD_WCHANS THREADINFO_WCHANS
+
+/**
+  @brief Where a thread spends its time.
+
+  The time of a thread is split into the time it was @c RUNNING, the time
+  it was @c READY (waiting for a core) and the time it was @c STOPPED. The
+  stopped time is further split by wait channel, the name of the kernel
+  function that put the thread to sleep (see @c sleep_releasing). A thread
+  accounts for its first @c THREAD_WCHANS-1 wait channels separately; the
+  last entry, with a @c NULL name, collects the rest.
+
+  All times are in microseconds.
+ */
+typedef struct thread_times {
+  TimerDuration cpu;          /**< Time running on a core */
+  TimerDuration ready;        /**< Time ready, waiting for a core */
+  TimerDuration blocked;      /**< Time sleeping */
+  TimerDuration max_latency;  /**< The longest wait for a core */
+  unsigned long sleeps;       /**< The number of sleeps */
+
+  struct {
+    const char* wchan;        /**< The wait channel, or @c NULL */
+    TimerDuration time;       /**< Time sleeping on @c wchan */
+    unsigned long sleeps;     /**< Sleeps on @c wchan */
+  } wchan[THREAD_WCHANS];
+} thread_times;
+
+
 
 /**
   @brief The thread control block
@@ -91,6 +132,7 @@ typedef struct thread_control_block
   PTCB* owner_ptcb;
 
   cpu_context_t context;     /**< The thread context */
+  size_t stack_size;         /**< The size of the thread's stack */
 
 #ifndef NVALGRIND
   unsigned valgrind_stack_id; /**< This is useful in order to register the thread stack to valgrind */
@@ -99,12 +141,26 @@ typedef struct thread_control_block
   Thread_type type;       /**< The type of thread */
   Thread_state state;    /**< The state of the thread */
   Thread_phase phase;    /**< The phase of the thread */
+  Thread_queue queued;   /**< The queue of its core that holds the thread */
   unsigned int priority;
 
   void (*thread_func)();   /**< The function executed by this thread */
 
   TimerDuration wakeup_time; /**< The time this thread will be woken up by the scheduler */
   rlnode sched_node;      /**< node to use when queueing in the scheduler lists */
+  TimerDuration enqueue_time; /**< The time this thread was added to a scheduler queue */
+
+  struct core_control_block* core; /**< The core whose scheduler lists hold this thread */
+  cpu_mask_t affinity;    /**< The cores this thread may run on */
+  TimerDuration run_start; /**< The time this thread last started running */
+
+  thread_times times;     /**< Where the thread spent its time, protected by the @c sched_spinlock */
+  TimerDuration state_since; /**< The time the thread entered its current state */
+  const char* wchan;      /**< The wait channel of a @c STOPPED thread */
+
+  phnode run_node;        /**< node to use in the run queue of the fair policy */
+  uint64_t vruntime;      /**< The weighted virtual runtime, used by the fair policy */
+  unsigned int weight;    /**< The share of the thread in the fair policy */
 
   struct thread_control_block * prev;  /**< previous context */
   struct thread_control_block * next;  /**< next context */
@@ -113,7 +169,10 @@ typedef struct thread_control_block
 
 
 
-/** Thread stack size */
+/** @brief The default thread weight of the fair policy */
+#define FAIR_DEFAULT_WEIGHT THREAD_WEIGHT_DEFAULT
+
+/** The default thread stack size */
 #define THREAD_STACK_SIZE  (128*1024)
 
 
@@ -124,9 +183,49 @@ typedef struct thread_control_block
  ************************/
 
 
+/** @brief The number of priority queues of the scheduler */
+#define MAX_SCHED_Q 5
+
+/** @brief The highest thread priority (the queue searched first) */
+#define MAX_PRIORITY 0
+
+/** @brief The lowest thread priority (the queue searched last) */
+#define MIN_PRIORITY 4
+
+
+/** @brief The number of slots in the timeout wheel of each core */
+#define TIMEOUT_WHEEL_SLOTS 256
+
+/** @brief The granularity of the timeout wheel (in microseconds).
+
+  A thread whose wakeup time falls in tick @c t (that is, in 
+  @c [t*TIMEOUT_TICK,(t+1)*TIMEOUT_TICK) ) is kept in slot 
+  @c t%TIMEOUT_WHEEL_SLOTS of the wheel. Wakeup times are not rounded.
+  */
+#define TIMEOUT_TICK (1000L)
+
+/** @brief How late a timeout may expire (in microseconds).
+
+  Threads whose wakeup times are this close to each other are woken up
+  by the same timer expiry.
+  */
+#define TIMEOUT_SLACK (50L)
+
+
 /** @brief Core control block.
 
-  Per-core info in memory (basically scheduler-related)
+  Per-core info in memory (basically scheduler-related).
+
+  Each core owns the run queue of the scheduler policy (for example,
+  the multilevel queues of MLFQ), together with a hashed
+  timing wheel holding the threads sleeping with a timeout on this
+  core. An hrtimer of the core is armed at the earliest wakeup time of
+  the wheel; when it expires, the HRTIMER interrupt handler wakes up 
+  the threads whose timeout has passed. These are protected by the 
+  core's @c sched_spinlock. A thread in the @c READY or
+  @c STOPPED state belongs to exactly one core (pointed to by
+  @c TCB::core), and its state may only change while holding the
+  @c sched_spinlock of that core.
  */
 typedef struct core_control_block {
   uint id;                    /**< The core id */
@@ -135,6 +234,34 @@ typedef struct core_control_block {
   TCB idle_thread;            /**< Used by the scheduler to handle the core's idle thread */
   sig_atomic_t preemption;    /**< Marks preemption, used by the locking code */
 
+  Mutex sched_spinlock;           /**< Protects the scheduler lists of this core (a ticket lock) */
+  rlnode sched_queue[MAX_SCHED_Q];  /**< The ready queues, one per priority */
+  rlnode timeout_wheel[TIMEOUT_WHEEL_SLOTS]; /**< Threads sleeping with a timeout, by wakeup tick */
+  TimerDuration wheel_tick;       /**< The first tick of the wheel not yet expired */
+  unsigned int ntimeouts;         /**< The number of threads in @c timeout_wheel */
+  bios_hrtimer timeout_timer;     /**< Expires at the earliest wakeup time of @c timeout_wheel */
+  TimerDuration timeout_next;     /**< The time @c timeout_timer is armed for, or @c NO_TIMEOUT */
+  unsigned int nready;            /**< The number of threads in the run queue */
+  rlnode migrate_list;            /**< READY threads not allowed on this core, to be pulled by others */
+  unsigned int nmigrate;          /**< The number of threads in @c migrate_list */
+  unsigned long promotions[MAX_SCHED_Q]; /**< Promotions by aging, out of each queue */
+  TCB* handoff;                   /**< A thread of the run queue to run next, or @c NULL (see @c wakeup_handoff()) */
+  unsigned long handoffs;         /**< The number of time slices handed off */
+
+  phnode* fair_queue;             /**< The run queue of the fair policy, by vruntime */
+  uint64_t min_vruntime;          /**< The (monotonic) minimum vruntime in @c fair_queue */
+
+  int timer_armed;                /**< Non-zero if the quantum timer of the core is running */
+  unsigned long nswitches;        /**< The number of time slices started on this core */
+  unsigned long timer_calls;      /**< The number of times the core's timer was set or cancelled */
+
+  rlnode tcb_pool;                /**< Free thread blocks (TCB and stack), for reuse */
+  unsigned int npool;             /**< The number of blocks in @c tcb_pool */
+  unsigned int pool_dirty;        /**< Blocks at the front of @c tcb_pool with stack pages still committed */
+  rlnode tcb_release;             /**< Thread blocks not kept in @c tcb_pool, to be freed */
+  unsigned long pool_hits;        /**< Threads spawned from a pooled block */
+  unsigned long pool_misses;      /**< Threads spawned from newly allocated memory */
+
 } CCB;
 
 
@@ -142,6 +269,77 @@ typedef struct core_control_block {
 extern CCB cctx[MAX_CORES];
 
 
+/** @brief A scheduling policy.
+
+  The scheduler core (kernel_sched.c) handles thread states, timeouts,
+  context switching and the migration of threads between cores. The
+  policy, that is, the order in which the @c READY threads of a core
+  are executed, is delegated to a scheduler class.
+
+  A scheduler class keeps the @c READY threads of each core in a run
+  queue of its own design, using the fields of the CCB and TCB reserved
+  for it. All hooks are called with the @c sched_spinlock of the core
+  held, and in the non-preemptive domain.
+  */
+typedef struct sched_class
+{
+  const char* name;   /**< The name of the policy */
+
+  /** @brief Initialize the run queue of a core. */
+  void (*init_core)(CCB* core);
+
+  /** @brief Add a @c READY thread to the run queue of a core. */
+  void (*enqueue)(CCB* core, TCB* tcb);
+
+  /** @brief Remove a specific thread from the run queue of a core. */
+  void (*dequeue)(CCB* core, TCB* tcb);
+
+  /** @brief Remove and return the thread to run next, or @c NULL if the run queue is empty. */
+  TCB* (*pick_next)(CCB* core);
+
+  /** @brief Return a queued thread of core @c from, that should be moved to core @c to,
+    or @c NULL. The thread is not removed from the run queue. */
+  TCB* (*pick_migrate)(CCB* from, CCB* to);
+
+  /** @brief Called when a @c READY thread leaves core @c from for another core,
+    after it is removed from the queues of @c from (may be @c NULL). */
+  void (*migrate_out)(CCB* from, TCB* tcb);
+
+  /** @brief Called when a @c READY thread arrives at core @c to from another core,
+    before it is queued on @c to (may be @c NULL). */
+  void (*migrate_in)(CCB* to, TCB* tcb);
+
+  /** @brief Called at every scheduling decision of a core, before @c pick_next. */
+  void (*tick)(CCB* core);
+
+  /** @brief Adjust the scheduling parameters of the current thread, when it
+    gives up the CPU for the given cause. This is called with the @c sched_spinlock
+    of its core held, before the thread's state is changed by @c yield(). */
+  void (*adjust)(TCB* tcb, enum SCHED_CAUSE cause);
+
+  /** @brief Print policy statistics to @c stderr (may be @c NULL). */
+  void (*report)();
+
+} sched_class;
+
+
+/** @brief The multilevel feedback queue policy */
+extern const sched_class mlfq_sched_class;
+
+/** @brief The fair (virtual runtime) policy */
+extern const sched_class fair_sched_class;
+
+/** @brief The scheduler class in use */
+extern const sched_class* SCHED;
+
+
+/** @brief Check whether a thread may run on a core */
+static inline int tcb_allowed_on(TCB* tcb, CCB* core)
+{
+  return (tcb->affinity & CPU_MASK(core->id)) != 0;
+}
+
+
 /** @brief The current core's CCB */
 #define CURCORE  (cctx[cpu_core_id])
 
@@ -172,10 +370,26 @@ extern CCB cctx[MAX_CORES];
 
 	This call creates a new thread, initializing and returning its TCB.
 	The thread will belong to process @c pcb and execute @c func.
+  Its stack size, weight and affinity are taken from @c attr, which
+  must have passed @c sched_check_attr(). If @c attr is NULL, or its
+  affinity is 0, the thread may run on all cores.
   Note that, the new thread is returned in the @c INIT state.
   The caller must use @c wakeup() to start it.
 */
-TCB* spawn_thread(PCB* pcb, void (*func)());
+TCB* spawn_thread(PCB* pcb, void (*func)(), const thread_attr* attr);
+
+/**
+  @brief Check thread attributes.
+
+  Return 0 if @c attr (which may be NULL) is acceptable to @c spawn_thread,
+  and -1 otherwise.
+  */
+int sched_check_attr(const thread_attr* attr);
+
+/**
+  @brief Restrict a CPU mask to the cores that exist.
+  */
+cpu_mask_t sched_core_mask(cpu_mask_t mask);
 
 /**
   @brief Wakeup a blocked thread.
@@ -189,6 +403,22 @@ TCB* spawn_thread(PCB* pcb, void (*func)());
 */
 int wakeup(TCB* tcb);
 
+/**
+  @brief Wakeup a blocked thread, and hand it the rest of the time slice.
+
+  This is like @c wakeup(), for a waker that is about to block (e.g., a
+  thread that sends a request and waits for the reply). The woken thread
+  is queued on the current core, if it may run on it and its own core is
+  busy, and it becomes the handoff thread of the core. If the current 
+  thread gives up the core before its quantum expires, the handoff thread
+  runs next, ahead of the run queue, and inherits the running quantum.
+
+  @param tcb the thread to be made @c READY.
+  @returns 1 if the thread state was @c STOPPED or @c INIT, 0 otherwise
+  @see wakeup
+*/
+int wakeup_handoff(TCB* tcb);
+
 
 /**
   @brief Block the current thread.
@@ -215,12 +445,48 @@ int wakeup(TCB* tcb);
     be made ready by the scheduler after the timeout duration has passed, even without a call to
     @c wakeup() by another thread.
 
+    The time the thread sleeps is accounted to the wait channel @c wchan (see 
+    @c thread_times). The @c sleep_releasing macro passes the name of the calling 
+    function.
+
     @param newstate the new state for the thread
     @param mx the mutex to unlock.
     @param cause the cause of the sleep
+    @param wchan the wait channel
     @param timeout a timeout for the sleep, or
    */
-void sleep_releasing(Thread_state newstate, Mutex* mx, enum SCHED_CAUSE cause, TimerDuration timeout);
+void sleep_releasing_wchan(Thread_state newstate, Mutex* mx, enum SCHED_CAUSE cause, 
+  const char* wchan, TimerDuration timeout);
+
+#define sleep_releasing(newstate, mx, cause, timeout) \
+  sleep_releasing_wchan((newstate), (mx), (cause), __FUNCTION__, (timeout))
+
+/**
+  @brief Get the times of a thread, up to now.
+
+  The times include the time spent in the current state of the thread.
+  The thread must not be able to exit during this call.
+  */
+void thread_times_get(TCB* tcb, thread_times* times);
+
+/**
+  @brief Add the times in @c from to @c to.
+  */
+void thread_times_add(thread_times* to, const thread_times* from);
+
+/**
+  @brief Change the cores that a thread may run on.
+
+  If the thread is queued or running on a core outside @c mask,
+  it is moved to an allowed core. If the thread is the current thread,
+  it is not moved here: the caller must call @c yield() to move, after
+  releasing any locks it holds.
+
+  @param tcb the thread
+  @param mask the new affinity, which must contain at least one core
+  @returns 1 if the current thread must call @c yield(), else 0
+  */
+int sched_set_affinity(TCB* tcb, cpu_mask_t mask);
 
 /**
   @brief Give up the CPU.
@@ -244,12 +510,96 @@ void run_scheduler(void);
   @brief Initialize the scheduler.
 
    This function is called during kernel initialization.
+
+   @param policy the scheduling policy to use until shutdown
  */
-void initialize_scheduler(void);
+void initialize_scheduler(sched_policy policy);
 
+/**
+  @brief Adjust the MLFQ priority of a thread, according to the cause it gave up the CPU.
+  */
 void sched_priority(TCB* tcb, enum SCHED_CAUSE cause);
 
-void sched_aging();
+/**
+  @brief Promote threads that waited too long in the scheduler queues of a core.
+
+  A thread that has waited for @c sched_aging_period microseconds in a
+  queue is moved to the next higher priority. This bounds the time
+  that low-priority threads may starve under load.
+  */
+void sched_aging(CCB* core);
+
+/**
+  @brief The default aging period (in microseconds)
+  */
+#define AGING_PERIOD (100000L)
+
+/**
+  @brief The aging period of the scheduler (in microseconds).
+
+  This may be changed before the VM is booted.
+  */
+extern TimerDuration sched_aging_period;
+
+/**
+  @brief If non-zero, scheduler statistics are printed at shutdown.
+  */
+extern int sched_print_stats;
+
+/**
+  @brief The default high watermark of the per-core thread pools
+  */
+#define TCB_POOL_HIGH 32
+
+/**
+  @brief The default low watermark of the per-core thread pools
+  */
+#define TCB_POOL_LOW 4
+
+/**
+  @brief The high watermark of the per-core thread pools.
+
+  Each core keeps the blocks (TCB and stack) of threads that exited on
+  it, to reuse them for new threads. A core keeps at most this many
+  blocks; more are freed at the next thread spawn, or when the core
+  becomes idle.
+
+  This may be changed before the VM is booted.
+  */
+extern unsigned int sched_pool_high;
+
+/**
+  @brief The low watermark of the per-core thread pools.
+
+  When a core becomes idle, its pool is trimmed down to this many blocks.
+
+  This may be changed before the VM is booted.
+  */
+extern unsigned int sched_pool_low;
+
+/**
+  @brief If non-zero (the default), the scheduler runs tickless.
+
+  In tickless mode, the quantum timer of a core runs only when other
+  threads are waiting for the core. Timeouts are expired by the hrtimer
+  of the core, so sleeping threads do not keep it running. The quantum
+  timer is not reset at every context switch, so a thread that is 
+  switched in inherits the rest of the running quantum.
+
+  If zero, the timer is cancelled at every @c yield() and set to a full
+  quantum at every @c gain().
+
+  This may be changed before the VM is booted.
+  */
+extern int sched_tickless;
+
+/**
+  @brief Print scheduler statistics to @c stderr.
+
+  This is called after the VM has shut down.
+  */
+void sched_report_stats();
+
 /**
   @brief Quantum (in microseconds)
 
@@ -0,0 +1,149 @@
+
+#include <assert.h>
+#include <stdio.h>
+
+#include "kernel_sched.h"
+
+
+/**
+	@file kernel_sched_fair.c
+
+	@brief The fair (virtual runtime) scheduling policy.
+
+	Each thread accumulates virtual runtime, which is the time it has spent
+	on the CPU, scaled inversely to its weight. A thread of weight
+	@c 2*FAIR_DEFAULT_WEIGHT accumulates virtual runtime at half the rate of a
+	thread of the default weight, and therefore receives twice the CPU share.
+
+	Each core keeps its @c READY threads in a pairing heap ordered by virtual
+	runtime, and always runs the thread that has received the least service.
+	The cause that a thread gave up the CPU does not change its position,
+	so CPU-bound and I/O-bound threads receive the same share of the CPU.
+  */
+
+
+/*
+  A thread that wakes up after a long sleep is placed at most this far
+  behind the threads of the core (in vruntime). Without this bound, it
+  would monopolize the core until it caught up.
+ */
+#define FAIR_SLEEPER_CREDIT (QUANTUM/2)
+
+
+static void fair_init_core(CCB* core)
+{
+  core->fair_queue = NULL;
+  core->min_vruntime = 0;
+}
+
+
+static void fair_enqueue(CCB* core, TCB* tcb)
+{
+  /* New and long-sleeping threads start close to the rest */
+  if(tcb->vruntime + FAIR_SLEEPER_CREDIT < core->min_vruntime)
+    tcb->vruntime = core->min_vruntime - FAIR_SLEEPER_CREDIT;
+
+  tcb->run_node.key = tcb->vruntime;
+  pheap_insert(& core->fair_queue, & tcb->run_node);
+}
+
+
+static void fair_dequeue(CCB* core, TCB* tcb)
+{
+  pheap_remove(& core->fair_queue, & tcb->run_node);
+}
+
+
+/*
+  The vruntime of a thread only makes sense relative to the min_vruntime
+  of its core. When a thread moves to another core, it keeps its
+  distance from min_vruntime; in between, vruntime holds this distance
+  (which may be negative, in two's complement).
+ */
+static void fair_migrate_out(CCB* from, TCB* tcb)
+{
+  tcb->vruntime -= from->min_vruntime;
+}
+
+
+static void fair_migrate_in(CCB* to, TCB* tcb)
+{
+  int64_t lag = (int64_t) tcb->vruntime;
+  if(lag < 0 && (uint64_t)(-lag) > to->min_vruntime)
+    tcb->vruntime = 0;
+  else
+    tcb->vruntime = to->min_vruntime + lag;
+}
+
+
+static TCB* fair_pick_next(CCB* core)
+{
+  phnode* next = pheap_pop(& core->fair_queue);
+  if(next == NULL)
+    return NULL;
+
+  if(next->key > core->min_vruntime)
+    core->min_vruntime = next->key;
+  return next->tcb;
+}
+
+
+/*
+  Migrate the thread that this core would run next; it is the one that
+  has received the least service. If it is not allowed to run on the
+  destination core, search the heap for one that is.
+ */
+static TCB* fair_pick_migrate(CCB* from, CCB* to)
+{
+  phnode* n = from->fair_queue;
+  while(n != NULL) {
+    if(tcb_allowed_on(n->tcb, to))
+      return n->tcb;
+
+    /* Preorder traversal, using the back pointers to climb up */
+    if(n->child)
+      n = n->child;
+    else {
+      while(n != NULL && n->sibling == NULL) {
+        /* climb to the parent: the leftmost sibling's prev */
+        while(n->prev != NULL && n->prev->child != n)
+          n = n->prev;
+        n = n->prev;
+      }
+      if(n != NULL)
+        n = n->sibling;
+    }
+  }
+  return NULL;
+}
+
+
+static void fair_tick(CCB* core)
+{
+  /* nothing to do here */
+}
+
+
+/* Charge the time slice that just ended to the thread */
+static void fair_adjust(TCB* tcb, enum SCHED_CAUSE cause)
+{
+  TimerDuration curtime = bios_clock();
+  if(curtime > tcb->run_start)
+    tcb->vruntime += (curtime - tcb->run_start) * FAIR_DEFAULT_WEIGHT / tcb->weight;
+  tcb->run_start = curtime;
+}
+
+
+const sched_class fair_sched_class = {
+  .name = "fair",
+  .init_core = fair_init_core,
+  .enqueue = fair_enqueue,
+  .dequeue = fair_dequeue,
+  .pick_next = fair_pick_next,
+  .pick_migrate = fair_pick_migrate,
+  .migrate_out = fair_migrate_out,
+  .migrate_in = fair_migrate_in,
+  .tick = fair_tick,
+  .adjust = fair_adjust,
+  .report = NULL
+};
@@ -0,0 +1,184 @@
+
+#include <assert.h>
+#include <stdio.h>
+
+#include "kernel_sched.h"
+
+
+/**
+	@file kernel_sched_mlfq.c
+
+	@brief The multilevel feedback queue scheduling policy.
+
+	Each core keeps an array of doubly linked lists, one per priority.
+	A thread's priority is adjusted by @c sched_priority() according to
+	the cause it gave up the CPU, and threads that wait for too long
+	in a low-priority queue are promoted by @c sched_aging().
+  */
+
+
+/*
+  The time a thread may wait in a scheduler queue, before it is
+  promoted to the next higher priority.
+ */
+TimerDuration sched_aging_period = AGING_PERIOD;
+
+
+static void mlfq_init_core(CCB* core)
+{
+  for(int i=0;i<MAX_SCHED_Q;i++){
+      rlnode_init(&core->sched_queue[i], NULL);
+      core->promotions[i] = 0;
+  }
+}
+
+
+static void mlfq_enqueue(CCB* core, TCB* tcb)
+{
+  unsigned int cur = tcb->priority;
+  assert(cur>=MAX_PRIORITY && cur<=MIN_PRIORITY);
+
+  /*Push the thread in the queue, whose number indicated by the priority of the thread*/
+  rlist_push_back(&core->sched_queue[cur], &tcb->sched_node);
+  tcb->enqueue_time = bios_clock();
+}
+
+
+static void mlfq_dequeue(CCB* core, TCB* tcb)
+{
+  rlist_remove(& tcb->sched_node);
+}
+
+
+static TCB* mlfq_pick_next(CCB* core)
+{
+  /* Return the head of the first non-empty queue */
+  for(int i=MAX_PRIORITY; i<=MIN_PRIORITY; i++) {
+    if(! is_rlist_empty(&core->sched_queue[i]))
+      return rlist_pop_front(&core->sched_queue[i])->tcb;
+  }
+  return NULL;
+}
+
+
+/*
+  Take the last thread of the highest-priority queue, that is allowed
+  to run on the destination core. This is the thread that the core would
+  run last at this priority, and it is the least likely to have a warm cache.
+ */
+static TCB* mlfq_pick_migrate(CCB* from, CCB* to)
+{
+  for(int i=MAX_PRIORITY; i<=MIN_PRIORITY; i++) {
+    rlnode* queue = & from->sched_queue[i];
+    for(rlnode* n = queue->prev; n != queue; n = n->prev)
+      if(tcb_allowed_on(n->tcb, to))
+        return n->tcb;
+  }
+  return NULL;
+}
+
+
+/* The priority only changes when the thread stays runnable */
+static void mlfq_adjust(TCB* tcb, enum SCHED_CAUSE cause)
+{
+  if(tcb->state == RUNNING)
+    sched_priority(tcb, cause);
+}
+
+
+/*
+  Promote the threads that have waited for more than sched_aging_period
+  in their queue, to the next higher priority.
+
+  Each queue is kept in the order that threads were added, so only the
+  heads of the queues need to be checked. A promoted thread is added to
+  the end of the higher queue, where it has to wait for another period
+  before it is promoted again.
+
+  *** MUST BE CALLED WITH core->sched_spinlock HELD ***
+ */
+void sched_aging(CCB* core)
+{
+  if(core->nready == 0)
+    return;
+
+  TimerDuration curtime = bios_clock();
+
+  for(int i=MAX_PRIORITY+1; i<=MIN_PRIORITY; i++) {
+    rlnode* queue = & core->sched_queue[i];
+    while(! is_rlist_empty(queue)) {
+      TCB* tcb = queue->next->tcb;
+      if(curtime < tcb->enqueue_time + sched_aging_period)
+        break;
+
+      rlist_pop_front(queue);
+      tcb->priority = i-1;
+      tcb->enqueue_time = curtime;
+      rlist_push_back(& core->sched_queue[i-1], & tcb->sched_node);
+      core->promotions[i]++;
+    }
+  }
+}
+
+
+static void mlfq_report()
+{
+  unsigned long promotions[MAX_SCHED_Q] = { 0 };
+
+  for(uint c=0; c<MAX_CORES; c++)
+    for(int i=0; i<MAX_SCHED_Q; i++)
+      promotions[i] += cctx[c].promotions[i];
+
+  fprintf(stderr, "Scheduler: promotions by level:");
+  for(int i=MAX_PRIORITY+1; i<=MIN_PRIORITY; i++)
+    fprintf(stderr, " %d->%d: %lu", i, i-1, promotions[i]);
+  fprintf(stderr, "\n");
+}
+
+
+void sched_priority(TCB* tcb, enum SCHED_CAUSE cause){
+
+  unsigned int curPriority = tcb->priority;
+
+  assert(curPriority >= MAX_PRIORITY && curPriority <= MIN_PRIORITY);
+
+  /* At cause QUANTUM, PIPE & USER we increase priority by 1(default case) */
+  switch(cause){
+
+    case SCHED_QUANTUM:  /**< The quantum has expired */
+
+    case SCHED_IO:       /**< The thread is waiting for I/O */
+      tcb->priority = MAX_PRIORITY;
+      break;
+    case SCHED_MUTEX:    /**< Mutex_Lock yielded on contention */
+      tcb->priority = curPriority < MIN_PRIORITY ? curPriority + 1 : MIN_PRIORITY;
+      break;
+    case SCHED_PIPE:     /**< Sleep at a pipe or socket */
+
+    case SCHED_POLL:     /**< The thread is polling a device */
+      tcb->priority = MAX_PRIORITY + 1;
+      break;
+    case SCHED_IDLE:     /**< The idle thread called yield */
+      tcb->priority = MIN_PRIORITY;
+      break;
+    case SCHED_USER:
+
+    default:
+      tcb->priority = curPriority > MAX_PRIORITY ? curPriority - 1 : MAX_PRIORITY;
+  }
+}
+
+
+const sched_class mlfq_sched_class = {
+  .name = "mlfq",
+  .init_core = mlfq_init_core,
+  .enqueue = mlfq_enqueue,
+  .dequeue = mlfq_dequeue,
+  .pick_next = mlfq_pick_next,
+  .pick_migrate = mlfq_pick_migrate,
+  .migrate_out = NULL,
+  .migrate_in = NULL,
+  .tick = sched_aging,
+  .adjust = mlfq_adjust,
+  .report = mlfq_report
+};
@@ -6,14 +6,53 @@
 #include "kernel_cc.h"
 
 SocketCB* PORT_MAP[MAX_PORT+1];
+static RwLock port_map_lock;	/* Protects PORT_MAP; Connect only reads it */
+
+static file_ops socketfile_ops = {
+	.Open = NullOpenSocket,
+	.Read = NullReadSocket,
+	.Write = NullWriteSocket,
+	.Close = CloseSocket
+};
+
+static file_ops peerfile_ops = {
+	.Open = NullOpenSocket,
+	.Read = ReadSocket,
+	.Write = WriteSocket,
+	.Close = CloseSocket
+};
 
 void initialize_port_map(){
 
+  port_map_lock = RWLOCK_INIT;
+  lock_profile_name(& port_map_lock.writer_lock, "port_map");
+  lock_profile_name(& port_map_lock.wait_lock, "port_map wait_lock");
   for(int i=0;i<=MAX_PORT;i++){
     PORT_MAP[i] = NULL;
   }
 }
 
+/*
+  Return the socket of the given fid with a reference taken, or NULL if
+  the fid is not a socket. The caller must drop the reference with
+  ref_counter_decr. The socket stays valid, even if the fid is closed
+  meanwhile.
+ */
+static SocketCB* get_socket(Fid_t fid)
+{
+  SocketCB* socket = NULL;
+
+  Mutex_Lock(& CURPROC->lock);
+  FCB* fcb = get_fcb(fid);
+  if(fcb != NULL && fcb->streamfunc != NULL && fcb->streamfunc->Close == CloseSocket){
+    socket = (SocketCB*)fcb->streamobj;
+    ref_counter_incr(socket);
+  }
+  Mutex_Unlock(& CURPROC->lock);
+
+  return socket;
+}
+
 Fid_t sys_Socket(port_t port)
 {
 
@@ -38,18 +77,10 @@ Fid_t sys_Socket(port_t port)
 	}
 
 	socketCB->Port = port;
-	socketCB->SocketFCB = get_fcb(fids[0]);
+	socketCB->SocketFCB = socketFCB[0];
   ref_counter_incr(socketCB);
 
 	socketFCB[0]->streamobj = socketCB;
-
-	static file_ops socketfile_ops = {
-		.Open = NullOpenSocket,
-		.Read = NullReadSocket,
-		.Write = NullWriteSocket,
-		.Close = CloseSocket
-	};
-
 	socketFCB[0]->streamfunc = &socketfile_ops;
 
 	return fids[0];
@@ -62,31 +93,34 @@ int sys_Listen(Fid_t sock)
     return -1;
   }
 
-	FCB* fcb = get_fcb(sock);
+	SocketCB* socketCB = get_socket(sock);
 
-	if(fcb == NULL ){
+	if(socketCB == NULL){
 		return -1;
 	}
 
-	SocketCB* socketCB = (SocketCB*)fcb->streamobj;
-
-	if(socketCB == NULL || socketCB->Port <= 0 || socketCB->Port > MAX_PORT || socketCB->Type != UNBOUND){
-
-		return -1;
+	int ret = -1;
+	if(socketCB->Port <= 0 || socketCB->Port > MAX_PORT){
+		goto finish;
 	}
 
-	socketCB->Type = LISTENER;
-  if( PORT_MAP[socketCB->Port] != NULL){
-    return -1;
-  }else{
+	RwLock_WriteLock(&port_map_lock);
+	Mutex_Lock(&socketCB->lock);
+  if(socketCB->Type == UNBOUND && PORT_MAP[socketCB->Port] == NULL){
+    socketCB->Type = LISTENER;
+    rlnode_init( &socketCB->LS.connect_Requests, NULL);
+    socketCB->LS.is_empty = COND_INIT;
+
     PORT_MAP[socketCB->Port] = socketCB;
     ref_counter_incr(socketCB);
+    ret = 0;
   }
+	Mutex_Unlock(&socketCB->lock);
+	RwLock_WriteUnlock(&port_map_lock);
 
-  rlnode_init( &socketCB->LS.connect_Requests, NULL);
-	socketCB->LS.is_empty = COND_INIT;
-
-	return 0;
+finish:
+	ref_counter_decr(socketCB);
+	return ret;
 }
 
 
@@ -96,53 +130,67 @@ Fid_t sys_Accept(Fid_t lsock)
     return -1;
   }
 
-	FCB* fcb = get_fcb(lsock);
-	if(fcb == NULL ){
+	SocketCB* lsocketCB = get_socket(lsock);
+	if(lsocketCB == NULL){
 		return -1;
 	}
 
-	SocketCB* lsocketCB = (SocketCB*)fcb->streamobj;
-	if( lsocketCB == NULL || lsocketCB->Port == 0 || lsocketCB->Type != LISTENER){
-		return -1;
+  Fid_t socketFid = NOFILE;
+	if(lsocketCB->Port == 0 || lsocketCB->Type != LISTENER){
+		goto finish;
 	}
-  while(is_rlist_empty(&lsocketCB->LS.connect_Requests)){
-    kernel_wait(&lsocketCB->LS.is_empty, SCHED_PIPE);
-    if(lsocketCB->Type == UNBOUND){
-      return NOFILE;
-    }
+
+  /*
+    Get the fid of the server socket before waiting, so that we do
+    not fail a request after taking it from the queue.
+   */
+  socketFid = sys_Socket(NOPORT);
+  if (socketFid == NOFILE) {
+    goto finish;
+  }
+  SocketCB* server = get_socket(socketFid);
+  if(server == NULL){
+    socketFid = NOFILE;   /* Closed by another thread already */
+    goto finish;
+  }
+
+  Mutex_Lock(&lsocketCB->lock);
+  while(lsocketCB->Type == LISTENER && is_rlist_empty(&lsocketCB->LS.connect_Requests)){
+    cv_wait(&lsocketCB->lock, &lsocketCB->LS.is_empty, SCHED_PIPE, NO_TIMEOUT);
   }
+  if(lsocketCB->Type != LISTENER){
+    Mutex_Unlock(&lsocketCB->lock);
+    ref_counter_decr(server);
+    sys_Close(socketFid);
+    socketFid = NOFILE;
+    goto finish;
+  }
+
   rlnode* sel;
   sel=rlist_pop_front(&lsocketCB->LS.connect_Requests);
   Request* request = sel->req;
   SocketCB* client = request->Socket;
-  client->Type = PEER;
 
-  Fid_t socketFid = sys_Socket(NOPORT);
-  if (socketFid == NOFILE) {
-    return NOFILE;
-  }
-  SocketCB* server = get_fcb(socketFid)->streamobj;
+  Mutex_Lock(&client->lock);
+  Mutex_Lock(&server->lock);
+  spawnPipes(client,server);
+  client->Type = PEER;
   server->Type = PEER;
-
-  int check = spawnPipes(client,server);
-
-  if(check == 0){
-    static file_ops peerfile_ops = {
-      .Open = NullOpenSocket,
-      .Read = ReadSocket,
-      .Write = WriteSocket,
-      .Close = CloseSocket
-    };
-    server->SocketFCB->streamfunc = &peerfile_ops;
-    client->SocketFCB->streamfunc = &peerfile_ops;
-
-    kernel_broadcast(&request->is_connected);
-  }else{
-    return -1;
-  }
-
+  server->SocketFCB->streamfunc = &peerfile_ops;
+  client->SocketFCB->streamfunc = &peerfile_ops;
+  Mutex_Unlock(&server->lock);
+  Mutex_Unlock(&client->lock);
+
+  request->admit_flag = 1;
+  Cond_Broadcast(&request->is_connected);
+  Mutex_Unlock(&lsocketCB->lock);
+  ref_counter_decr(server);
+
+finish:
+  ref_counter_decr(lsocketCB);
 	return socketFid;
 }
+
 int spawnPipes(SocketCB* client, SocketCB* server)
 {
   if(client == NULL && server == NULL){
@@ -158,6 +206,12 @@ int spawnPipes(SocketCB* client, SocketCB* server)
   Pipe2->ReadFCB = client->SocketFCB;
   Pipe2->WriteFCB = server->SocketFCB;
 
+  /* One reference for each end */
+  for(int i=0;i<2;i++){
+    refcounter_incr(Pipe1);
+    refcounter_incr(Pipe2);
+  }
+
   client->PS.send = Pipe1;
   client->PS.receive = Pipe2;
   server->PS.send = Pipe2;
@@ -171,76 +225,110 @@ int spawnPipes(SocketCB* client, SocketCB* server)
 
 int sys_Connect(Fid_t sock, port_t port, timeout_t timeout)
 {
-  if(port <= 0 || port > MAX_PORT || PORT_MAP[port]==NULL || timeout==0 ){
+  if(port <= 0 || port > MAX_PORT || timeout==0 ){
     return -1;
   }
 
-  FCB* fcb = get_fcb(sock);
+  /* Hold the file, so that the socket is not closed while we connect */
+  FCB* fcb = FCB_get(sock);
   if(fcb == NULL ){
     return -1;
   }
 
   SocketCB* socketCB = (SocketCB*)fcb->streamobj;
-  if(socketCB == NULL || socketCB == PORT_MAP[port] || PORT_MAP[port]->Type != LISTENER){
-    return -1;
+  SocketCB* listener = NULL;
+  int ret = -1;
+  if(fcb->streamfunc != &socketfile_ops || socketCB->Type != UNBOUND){
+    goto finish;
+  }
+
+  RwLock_ReadLock(&port_map_lock);
+  listener = PORT_MAP[port];
+  if(listener != NULL)
+    ref_counter_incr(listener);
+  RwLock_ReadUnlock(&port_map_lock);
+
+  if(listener == NULL){
+    goto finish;
   }
 
   Request* request = spawn_Request();
   request->Socket = socketCB;
 
-  rlist_push_back(&(PORT_MAP[port]->LS.connect_Requests), &request->req_node);
-  kernel_broadcast(&(PORT_MAP[port]->LS.is_empty));
-
-  if(timeout > 0){
-    int k = kernel_timedwait(&request->is_connected,SCHED_PIPE,timeout);
-    if(k==1){
-      request->admit_flag = 1;
+  Mutex_Lock(&listener->lock);
+  if(listener->Type != LISTENER){
+    Mutex_Unlock(&listener->lock);
+    free(request);
+    goto finish;
+  }
+  rlist_push_back(&listener->LS.connect_Requests, &request->req_node);
+  Cond_Broadcast(&listener->LS.is_empty);
+
+  while(request->admit_flag == 0 && listener->Type == LISTENER){
+    if(timeout > 0){
+      if(! cv_wait(&listener->lock, &request->is_connected, SCHED_PIPE, timeout))
+        break;  /* timed out */
+    }else{
+      cv_wait(&listener->lock, &request->is_connected, SCHED_PIPE, NO_TIMEOUT);
     }
-  }else{
-    kernel_wait(&request->is_connected, SCHED_PIPE);
   }
 
-  return request->admit_flag - 1;
+  /* If the request was not accepted, it may still be queued */
+  rlist_remove(&request->req_node);
+  Mutex_Unlock(&listener->lock);
+
+  ret = request->admit_flag - 1;
+  free(request);
+
+finish:
+  if(listener != NULL)
+    ref_counter_decr(listener);
+  FCB_decref(fcb);
+  return ret;
 }
 
 
 int sys_ShutDown(Fid_t sock, shutdown_mode how)
 {
-  FCB* fcb = get_fcb(sock);
-  if(fcb == NULL ){
+  SocketCB* socket = get_socket(sock);
+  if(socket == NULL ){
     return -1;
   }
 
-  SocketCB* socket = (SocketCB*)fcb->streamobj;
-  if(socket == NULL || socket->Type != PEER){
-    return -1;
-  }
+  PipeCB* receive = NULL;
+  PipeCB* send = NULL;
+  int ret = -1;
 
-  switch(how){
-    case SHUTDOWN_READ:
-      CloseReaderPipe(socket->PS.receive);
-      socket->PS.receive = NULL;
-      break;
-    case SHUTDOWN_WRITE:
-      CloseWriterPipe(socket->PS.send);
-      socket->PS.send = NULL;
-      break;
-    case SHUTDOWN_BOTH:
-      CloseReaderPipe(socket->PS.receive);
-      CloseWriterPipe(socket->PS.send);
+  Mutex_Lock(&socket->lock);
+  if(socket->Type == PEER){
+    if(how == SHUTDOWN_READ || how == SHUTDOWN_BOTH){
+      receive = socket->PS.receive;
       socket->PS.receive = NULL;
+    }
+    if(how == SHUTDOWN_WRITE || how == SHUTDOWN_BOTH){
+      send = socket->PS.send;
       socket->PS.send = NULL;
-      break;
+    }
+    ret = 0;
   }
-	return 0;
+  Mutex_Unlock(&socket->lock);
+
+  /* Closing a NULL pipe (already shut down) does nothing */
+  CloseReaderPipe(receive);
+  CloseWriterPipe(send);
+
+  ref_counter_decr(socket);
+	return ret;
 }
 
 void ref_counter_incr(SocketCB* socket){
-    socket->ref_counter++;
+  __atomic_add_fetch(&socket->ref_counter, 1, __ATOMIC_RELAXED);
 }
 
 void ref_counter_decr(SocketCB* socket){
-  socket->ref_counter--;
+  /* The last reference frees the socket */
+  if(__atomic_sub_fetch(&socket->ref_counter, 1, __ATOMIC_ACQ_REL) == 0)
+    free(socket);
 }
 
 SocketCB* spawn_Socket(){
@@ -250,6 +338,8 @@ SocketCB* spawn_Socket(){
     return NULL;
   }
 	socket->ref_counter = 0;
+	socket->lock = MUTEX_BLOCKING_INIT;
+	lock_profile_name(& socket->lock, "socket");
 	socket->Type = UNBOUND;
 	return socket;
 }
@@ -272,65 +362,86 @@ int CloseSocket(void* streamobject){
   if(socket == NULL){
     return -1;
   }
-  if(socket->Type == UNBOUND){
-    free(socket);
-  }else if(socket->Type == LISTENER){
-    kernel_broadcast(&socket->LS.is_empty);
-    if(PORT_MAP[socket->Port]!=NULL){
+  if(socket->Type == LISTENER){
+    RwLock_WriteLock(&port_map_lock);
+    if(PORT_MAP[socket->Port]==socket){
       PORT_MAP[socket->Port]=NULL;
     }
-    free(socket);
-  }else{
-    CloseReaderPipe(socket->PS.receive);
-    CloseWriterPipe(socket->PS.send);
+    RwLock_WriteUnlock(&port_map_lock);
+
+    /* Wake up Accept, and fail the pending requests */
+    Mutex_Lock(&socket->lock);
+    socket->Type = UNBOUND;
+    while(! is_rlist_empty(&socket->LS.connect_Requests)){
+      Request* request = rlist_pop_front(&socket->LS.connect_Requests)->req;
+      Cond_Broadcast(&request->is_connected);
+    }
+    Cond_Broadcast(&socket->LS.is_empty);
+    Mutex_Unlock(&socket->lock);
+
+    ref_counter_decr(socket);   /* The reference of PORT_MAP */
+  }else if(socket->Type == PEER){
+    Mutex_Lock(&socket->lock);
+    PipeCB* receive = socket->PS.receive;
+    PipeCB* send = socket->PS.send;
     socket->PS.send = NULL;
     socket->PS.receive = NULL;
     socket->PS.peerSocket = NULL;
-    free(socket);
+    Mutex_Unlock(&socket->lock);
+
+    CloseReaderPipe(receive);
+    CloseWriterPipe(send);
   }
 
+  ref_counter_decr(socket);   /* The reference of the FCB */
   return 0;
 }
 
 int WriteSocket(void* streamobject, const char* buf, unsigned int size){
 
   SocketCB* from = (SocketCB*)streamobject;
-  if(from == NULL || from->Type != PEER){
+  if(from == NULL){
     return -1;
   }
-  SocketCB* to = from->PS.peerSocket;
-  if(from->PS.send == NULL || to->PS.receive == NULL){
-    return -1;
-  }
-  PipeCB* pipefrom = from->PS.send;
-  PipeCB* pipeto = to->PS.receive;
-  if(to == NULL || pipefrom == NULL || pipeto == NULL){
+
+  /* Hold the pipe, in case the socket is shut down meanwhile */
+  Mutex_Lock(&from->lock);
+  PipeCB* pipefrom = (from->Type == PEER) ? from->PS.send : NULL;
+  if(pipefrom != NULL)
+    refcounter_incr(pipefrom);
+  Mutex_Unlock(&from->lock);
+
+  if(pipefrom == NULL){
     return -1;
   }
 
   int bytesize;
   bytesize = WritePipe(pipefrom, buf, size);
 
+  refcounter_decr(pipefrom);
   return bytesize;
 }
 
 int ReadSocket(void* streamobject, char* buf, unsigned int size){
   SocketCB* from = (SocketCB*)streamobject;
-  if(from == NULL || from->Type != PEER){
+  if(from == NULL){
     return -1;
   }
-  SocketCB* to = from->PS.peerSocket;
-  if(from->PS.receive == NULL){
-    return -1;
-  }
-  PipeCB* pipefrom = from->PS.receive;
-  if(to == NULL || pipefrom == NULL ){
+
+  Mutex_Lock(&from->lock);
+  PipeCB* pipefrom = (from->Type == PEER) ? from->PS.receive : NULL;
+  if(pipefrom != NULL)
+    refcounter_incr(pipefrom);
+  Mutex_Unlock(&from->lock);
+
+  if(pipefrom == NULL){
     return -1;
   }
 
   int bytesize;
   bytesize = ReadPipe(pipefrom, buf, size);
 
+  refcounter_decr(pipefrom);
   return bytesize;
 }
 
@@ -33,10 +33,18 @@ typedef struct peers_socket
 
 } PeerSocket;
 
+/*
+  A socket is protected by its own @c lock. The lock of a listener may be
+  held while taking the lock of a socket that connects to it, never the
+  other way round. The @c ref_counter counts the open FCB, the entry in
+  the port map and any system call that is using the socket; the socket
+  is freed when it drops to 0.
+ */
 typedef struct socket_control_block
 {
 
   unsigned int ref_counter;
+  Mutex lock;
   port_t Port;
   SocketType Type;
   FCB* SocketFCB;
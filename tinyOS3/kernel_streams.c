@@ -11,6 +11,9 @@
 FCB FT[MAX_FILES];
 rlnode FCB_freelist;
 
+/* Protects FCB_freelist */
+static Mutex FCB_lock = MUTEX_INIT;
+
 
 void initialize_files()
 {
@@ -26,33 +29,39 @@ void initialize_files()
 
 FCB* acquire_FCB()
 {
-  if(! is_rlist_empty(& FCB_freelist)) {
-    FCB* fcb = rlist_pop_front(& FCB_freelist)->fcb;
+  FCB* fcb = NULL;
+  Mutex_Lock(& FCB_lock);
+  if(! is_rlist_empty(& FCB_freelist))
+    fcb = rlist_pop_front(& FCB_freelist)->fcb;
+  Mutex_Unlock(& FCB_lock);
+
+  if(fcb) {
     fcb->refcount = 0;
-    return fcb;
+    fcb->streamobj = NULL;
+    fcb->streamfunc = NULL;
   }
-  else
-    return NULL;
+  return fcb;
 }
 
 void release_FCB(FCB* fcb)
 {
+  Mutex_Lock(& FCB_lock);
   rlist_push_back(& FCB_freelist, & fcb->freelist_node);
+  Mutex_Unlock(& FCB_lock);
 }
 
 
 void FCB_incref(FCB* fcb)
 {
   assert(fcb);
-  fcb->refcount++;
+  __atomic_add_fetch(& fcb->refcount, 1, __ATOMIC_RELAXED);
 }
 
 int FCB_decref(FCB* fcb)
 {
   assert(fcb);
-  fcb->refcount --;
-  if(fcb->refcount==0) {
-    int retval = fcb->streamfunc->Close(fcb->streamobj);
+  if(__atomic_sub_fetch(& fcb->refcount, 1, __ATOMIC_ACQ_REL)==0) {
+    int retval = fcb->streamfunc ? fcb->streamfunc->Close(fcb->streamobj) : 0;
     release_FCB(fcb);
     return retval;
   }
@@ -68,6 +77,8 @@ int FCB_reserve(size_t num, Fid_t *fid, FCB** fcb)
     size_t f=0;
     uint i;
 
+    Mutex_Lock(& cur->lock);
+
     /* Find distinct fids */
     for(i=0; i<num; i++) {
 	     while(f<MAX_FILEID && cur->FIDT[f]!=NULL)
@@ -75,7 +86,7 @@ int FCB_reserve(size_t num, Fid_t *fid, FCB** fcb)
 	     if(f==MAX_FILEID) break;
 	     fid[i] = f; f++;
     }
-    if(i<num) return 0;
+    if(i<num) goto fail;
     /* Allocate FCBs */
     for(i=0;i<num;i++)
 	     if((fcb[i] = acquire_FCB()) == NULL)
@@ -86,14 +97,19 @@ int FCB_reserve(size_t num, Fid_t *fid, FCB** fcb)
         release_FCB(fcb[i-1]);
 	      i--;
 	    }
-	    return 0;
+	    goto fail;
     }
     /* Found all */
     for(i=0;i<num;i++) {
 	     cur->FIDT[fid[i]]=fcb[i];
 	      FCB_incref(fcb[i]);
     }
+    Mutex_Unlock(& cur->lock);
     return 1;
+
+fail:
+    Mutex_Unlock(& cur->lock);
+    return 0;
 }
 
 
@@ -101,11 +117,13 @@ int FCB_reserve(size_t num, Fid_t *fid, FCB** fcb)
 void FCB_unreserve(size_t num, Fid_t *fid, FCB** fcb)
 {
     PCB* cur = CURPROC;
+    Mutex_Lock(& cur->lock);
     for(size_t i=0; i<num ; i++) {
 	assert(cur->FIDT[fid[i]]==fcb[i]);
 	cur->FIDT[fid[i]] = NULL;
 	release_FCB(fcb[i]);
     }
+    Mutex_Unlock(& cur->lock);
 }
 
 /*
@@ -123,34 +141,36 @@ FCB* get_fcb(Fid_t fid)
 }
 
 
-int sys_Read(Fid_t fd, char *buf, unsigned int size)
+FCB* FCB_get(Fid_t fid)
 {
-  int retcode = -1;
-  int (*devread)(void*,char*,uint);
-  void* sobj;
+  if(fid < 0 || fid >= MAX_FILEID) return NULL;
 
+  PCB* cur = CURPROC;
+  Mutex_Lock(& cur->lock);
+  FCB* fcb = cur->FIDT[fid];
+  if(fcb) FCB_incref(fcb);
+  Mutex_Unlock(& cur->lock);
+  return fcb;
+}
 
-  /* Get the fields from the stream */
-  FCB* fcb = get_fcb(fd);
 
-  if(fcb) {
-    sobj = fcb->streamobj;
-    devread = fcb->streamfunc->Read;
+int sys_Read(Fid_t fd, char *buf, unsigned int size)
+{
+  int retcode = -1;
 
-    /* make sure that the stream will not be closed (by another thread)
-       while we are using it! */
-    FCB_incref(fcb);
+  /* The reference makes sure that the stream will not be closed 
+     (by another thread) while we are using it! */
+  FCB* fcb = FCB_get(fd);
 
-    if(devread)
-      retcode = devread(sobj, buf, size);
+  if(fcb) {
+    file_ops* ops = fcb->streamfunc;
+    if(ops && ops->Read)
+      retcode = ops->Read(fcb->streamobj, buf, size);
 
     /* Need to decrease the reference to FCB */
     FCB_decref(fcb);
   }
 
-  /* We must not go into non-preemptive domain with kernel_mutex locked */
-
-
   return retcode;
 }
 
@@ -158,32 +178,20 @@ int sys_Read(Fid_t fd, char *buf, unsigned int size)
 int sys_Write(Fid_t fd, const char *buf, unsigned int size)
 {
   int retcode = -1;
-  int (*devwrite)(void*, const char*, uint) = NULL;
-  void* sobj = NULL;
-
 
-  /* Get the fields from the stream */
-  FCB* fcb = get_fcb(fd);
+  /* The reference makes sure that the stream will not be closed 
+     (by another thread) while we are using it! */
+  FCB* fcb = FCB_get(fd);
 
   if(fcb) {
-
-    sobj = fcb->streamobj;
-    devwrite = fcb->streamfunc->Write;
-
-    /* make sure that the stream will not be closed (by another thread)
-       while we are using it! */
-    FCB_incref(fcb);
-
-
-    if(devwrite)
-      retcode = devwrite(sobj, buf, size);
+    file_ops* ops = fcb->streamfunc;
+    if(ops && ops->Write)
+      retcode = ops->Write(fcb->streamobj, buf, size);
 
     /* Need to decrease the reference to FCB */
     FCB_decref(fcb);
-
   }
 
-
   return retcode;
 }
 
@@ -191,13 +199,16 @@ int sys_Write(Fid_t fd, const char *buf, unsigned int size)
 int sys_Close(int fd)
 {
   int retcode = (fd>=0 && fd<MAX_FILEID) ? 0 : -1;  /* Closing a closed fd is legal! */
+  if(retcode < 0) return retcode;
 
-  FCB* fcb = get_fcb(fd);
+  PCB* cur = CURPROC;
+  Mutex_Lock(& cur->lock);
+  FCB* fcb = cur->FIDT[fd];
+  cur->FIDT[fd] = NULL;
+  Mutex_Unlock(& cur->lock);
 
-  if(fcb) {
-    CURPROC->FIDT[fd] = NULL;
+  if(fcb)
     retcode = FCB_decref(fcb);
-  }
 
   return retcode;
 }
@@ -216,18 +227,26 @@ int sys_Dup2(int oldfd, int newfd)
   if(oldfd<0 || newfd<0 || oldfd>=MAX_FILEID || newfd>=MAX_FILEID)
     return -1;
 
-  FCB* old = get_fcb(oldfd);
-  FCB* new = get_fcb(newfd);
+  PCB* cur = CURPROC;
+  Mutex_Lock(& cur->lock);
+  FCB* old = cur->FIDT[oldfd];
+  FCB* new = cur->FIDT[newfd];
 
   if(old==NULL) {
     retcode = -1;
+    new = NULL;
   }
   else if(old!=new) {
-    if(new)
-      FCB_decref(new);
     FCB_incref(old);
-    CURPROC->FIDT[newfd] = old;
+    cur->FIDT[newfd] = old;
   }
+  else
+    new = NULL;
+  Mutex_Unlock(& cur->lock);
+
+  /* Close the replaced stream outside the lock */
+  if(new)
+    FCB_decref(new);
 
   return retcode;
 }
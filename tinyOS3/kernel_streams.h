@@ -122,11 +122,29 @@ void FCB_unreserve(size_t num, Fid_t *fid, FCB** fcb);
 
 	This routine will return NULL if the fid is not legal.
 
+	The FIDT may be changed meanwhile by other threads of the process,
+	so the result can only be used safely while holding the lock of 
+	the PCB, or for an FCB that cannot be closed (e.g., one just 
+	reserved by this thread). Otherwise, use @ref FCB_get.
+
 	@param fid the file ID to translate to a pointer to FCB
 	@returns a pointer to the corresponding FCB, or NULL.
  */
 FCB* get_fcb(Fid_t fid);
 
+
+/** @brief Translate an fid to an FCB, and take a reference to it.
+
+	This routine will return NULL if the fid is not legal. Else,
+	the reference count of the FCB is increased, so that the stream
+	is not closed by other threads while it is in use. The caller 
+	must release it with @ref FCB_decref.
+
+	@param fid the file ID to translate to a pointer to FCB
+	@returns a pointer to the corresponding FCB, or NULL.
+ */
+FCB* FCB_get(Fid_t fid);
+
 procinfo* spawn_ProcInfo();
 
 void* NullOpenInfo(uint minor);
@@ -22,7 +22,7 @@ kernel_unlock();\
 
 
 /* with return */
-#define SYSCALL(NAME, RET, SIG, ARGS)\
+#define SYSCALL_LOCKED(NAME, RET, SIG, ARGS)\
 RET NAME SIG \
 {\
 	RET __ret;\
@@ -33,7 +33,7 @@ RET NAME SIG \
 }\
 
 /* without return */
-#define SYSCALLV(NAME, SIG, ARGS)\
+#define SYSCALLV_LOCKED(NAME, SIG, ARGS)\
 void NAME SIG \
 {\
 	PRE_CALL\
@@ -41,6 +41,19 @@ void NAME SIG \
 	POST_CALL\
 }\
 
+/* These do their own locking */
+#define SYSCALL(NAME, RET, SIG, ARGS)\
+RET NAME SIG \
+{\
+	return sys_##NAME ARGS;\
+}\
+
+#define SYSCALLV(NAME, SIG, ARGS)\
+void NAME SIG \
+{\
+	sys_##NAME ARGS;\
+}\
+
 
 SYSCALLS
 
@@ -4,17 +4,33 @@
 #include "bios.h"
 #include "tinyos.h"
 
+/*
+	The system calls.
+
+	Calls declared with SYSCALL_LOCKED / SYSCALLV_LOCKED run under the 
+	kernel lock, which protects the process table and the parent/child 
+	relations of processes. The rest do their own, fine-grained, locking:
+	- the lock of the PCB protects its threads (PTCBs) and its FIDT,
+	- FCB reference counts are atomic, 
+	- each pipe and each socket has its own lock, and
+	- the port map of sockets has its own lock.
+	The lock order is: kernel lock, port map, socket, PCB, pipe.
+ */
 #define SYSCALLS \
-SYSCALL(Exec, int, (Task task, int argl, void* args), (task, argl, args))\
-SYSCALLV(Exit, (int exitval), (exitval))\
+SYSCALL_LOCKED(Exec, int, (Task task, int argl, void* args), (task, argl, args))\
+SYSCALL_LOCKED(ExecEx, int, (Task task, int argl, void* args, const thread_attr* attr), (task, argl, args, attr))\
+SYSCALLV_LOCKED(Exit, (int exitval), (exitval))\
 SYSCALL(GetPid, int, (void), ())\
 SYSCALL(GetPPid, int, (void), ())\
-SYSCALL(WaitChild, Pid_t, (Pid_t proc, int* exitval), (proc, exitval))\
+SYSCALL_LOCKED(WaitChild, Pid_t, (Pid_t proc, int* exitval), (proc, exitval))\
 SYSCALL(CreateThread, Tid_t, (Task task, int argl, void* args), (task, argl, args))\
+SYSCALL(CreateThreadEx, Tid_t, (Task task, int argl, void* args, const thread_attr* attr), (task, argl, args, attr))\
 SYSCALL(ThreadSelf, Tid_t, (void), ())\
 SYSCALL(ThreadJoin, int, (Tid_t tid, int* exitval), (tid, exitval))\
 SYSCALL(ThreadDetach, int, (Tid_t tid), (tid))\
 SYSCALLV(ThreadExit, (int exitval), (exitval))\
+SYSCALL(SetThreadAffinity, int, (Tid_t tid, cpu_mask_t mask), (tid, mask))\
+SYSCALL(GetThreadAffinity, int, (Tid_t tid, cpu_mask_t* mask), (tid, mask))\
 SYSCALL(GetTerminalDevices, unsigned int, (), ())\
 SYSCALL(OpenTerminal, Fid_t, (unsigned int termno), (termno))\
 SYSCALL(OpenNull, Fid_t, (), ())\
@@ -29,19 +45,24 @@ SYSCALL(Accept, Fid_t, (Fid_t lsock), (lsock))\
 SYSCALL(Connect, int, (Fid_t sock, port_t port, timeout_t timeout), (sock, port, timeout))\
 SYSCALL(ShutDown, int, (Fid_t sock, shutdown_mode how), (sock, how))\
 SYSCALL(OpenInfo, Fid_t, (), ())\
+SYSCALL(OpenThreadInfo, Fid_t, (), ())\
 
 
 
 #define SYSCALL(NAME, RET, SIG, ARGS)\
 RET sys_ ## NAME SIG;
+#define SYSCALL_LOCKED SYSCALL
 
 /* without return */
 #define SYSCALLV(NAME, SIG, ARGS)\
 void sys_ ## NAME SIG;
+#define SYSCALLV_LOCKED SYSCALLV
 
 SYSCALLS
 
 #undef SYSCALL
 #undef SYSCALLV
+#undef SYSCALL_LOCKED
+#undef SYSCALLV_LOCKED
 
 #endif
\ No newline at end of file
@@ -8,6 +8,17 @@
   */
 Tid_t sys_CreateThread(Task task, int argl, void* args)
 {
+	return sys_CreateThreadEx(task, argl, args, NULL);
+}
+
+/**
+  @brief Create a new thread in the current process, with the given attributes.
+  */
+Tid_t sys_CreateThreadEx(Task task, int argl, void* args, const thread_attr* attr)
+{
+	if(sched_check_attr(attr) != 0)
+		return NOTHREAD;
+
 	/* Allocate memory for the initialization f the ptcb */
 	PTCB* newPTCB = (PTCB*)xmalloc(sizeof(PTCB));
 
@@ -15,8 +26,10 @@ Tid_t sys_CreateThread(Task task, int argl, void* args)
   newPTCB->main_task = task;
   newPTCB->argl = argl;
   newPTCB->args = args;
-	newPTCB->thread = spawn_thread(CURPROC, start_thread);
-	CURPROC->num_of_threads += 1;
+	newPTCB->thread = spawn_thread(CURPROC, start_thread, attr);
+	if(attr == NULL || attr->affinity == 0)
+		newPTCB->thread->affinity = CURTHREAD->affinity;	/* The new thread inherits the affinity of its creator */
+	__atomic_add_fetch(& CURPROC->num_of_threads, 1, __ATOMIC_RELAXED);
 	newPTCB->exited = 0;
 	newPTCB->detached = 0;
 	newPTCB->joined = COND_INIT;
@@ -25,7 +38,9 @@ Tid_t sys_CreateThread(Task task, int argl, void* args)
 
   rlnode_init(& newPTCB->PTCB_node, newPTCB);	/* Intrusive list node */
 
+	Mutex_Lock(& CURPROC->lock);
 	rlist_push_back(&CURPROC->PTCB_list, &newPTCB->PTCB_node); /* Push th ptcb to the list of ptcbs in stack of the current process*/
+	Mutex_Unlock(& CURPROC->lock);
 
 	wakeup(newPTCB->thread);	/* We wake up the thread so it can be "served" by the scheduler */
 
@@ -52,14 +67,16 @@ int sys_ThreadJoin(Tid_t tid, int* exitval)
 		return -1;	/*If there isn't joined thread we return -1*/
 	}
 
+	Mutex_Lock(& CURPROC->lock);
 	if(joined->detached == 1 ){
+		Mutex_Unlock(& CURPROC->lock);
 		return -1;		/* If there is already a joined thread we return -1 */
 	}
 
 	refcounter_increment(joined);	/* We increase the ref_counter cause there is joined thread */
 
 	while(joined->exited != 1 && joined->detached != 1){
-		kernel_wait( &joined->joined, SCHED_USER);	/* We sleep the thread which joins the ptcb until the joined exits	*/
+		cv_wait(& CURPROC->lock, &joined->joined, SCHED_USER, NO_TIMEOUT);	/* We sleep the thread which joins the ptcb until the joined exits	*/
 	}
 
 	if(exitval != NULL){
@@ -67,7 +84,8 @@ int sys_ThreadJoin(Tid_t tid, int* exitval)
 	}
 	refcounter_decrement(joined);	/* We decrease the ref_counter, cause joined thread ended*/
 
-	kernel_broadcast( &joined->joined);	/* We broadcast all the joined threads */
+	Cond_Broadcast( &joined->joined);	/* We broadcast all the joined threads */
+	Mutex_Unlock(& CURPROC->lock);
 
 	return 0;
 }
@@ -83,21 +101,25 @@ int sys_ThreadDetach(Tid_t tid)
 		return -1;	/*If there isn't joined thread, we return -1*/
 	}
 
+	int ret = -1;	/* Return -1 when the process fails	*/
+	Mutex_Lock(& CURPROC->lock);
 	if(ptcb->exited == 1 ){
-		return -1;	/* If thread is exited, we return -1 */
+		goto finish;	/* If thread is exited, we return -1 */
 	}
   TCB* tcb = ptcb->thread;
 	if(tcb ==NULL || tcb->state == EXITED){
-		return -1;
+		goto finish;
 	}
 	if(tcb->owner_pcb == CURPROC){
 		ptcb->detached = 1;					/* We change the detached to 1 because we want to detach all the joiners */
 		if(ptcb->ref_counter > 1){
-				kernel_broadcast(& ptcb->joined);		/* If there are joiners we broadcast them all */
+				Cond_Broadcast(& ptcb->joined);		/* If there are joiners we broadcast them all */
 		}
-		return 0; /* Return 0 when the process succeeds */
+		ret = 0; /* Return 0 when the process succeeds */
 	}
-	return -1;	/* Return -1 when the process fails	*/
+finish:
+	Mutex_Unlock(& CURPROC->lock);
+	return ret;
 }
 
 /**
@@ -110,18 +132,21 @@ void sys_ThreadExit(int exitval)
 
 	assert(curPTCB != NULL);	/* We assert the there is the ptcb */
 
-	curPTCB->thread->state = EXITED;	/* We mark the state of the current thread as exited */
+	PCB* curproc = CURPROC;
+	Mutex_Lock(& curproc->lock);
+	process_add_times(curproc, curTCB);
 	curPTCB->thread = NULL;
 	curPTCB->exited = 1;		/* We change the exited variable of the ptcb to 1 to keep the information that the current thread just exited */
-	CURPROC->num_of_threads -= 1;
+	__atomic_sub_fetch(& curproc->num_of_threads, 1, __ATOMIC_RELAXED);
 	if(curPTCB->ref_counter > 0){
-		kernel_broadcast(&curPTCB->joined);		/* We check if the there are reference counters(joiners) and we broadcast all joined threads */
+		Cond_Broadcast(&curPTCB->joined);		/* We check if the there are reference counters(joiners) and we broadcast all joined threads */
 	}
 	rlist_remove(&curPTCB->PTCB_node);		/* We remove the current ptcb from the list */
 	free(curPTCB);		/* And then free the memory we alLocated during its creation and set the curPTCB pointer to NULL*/
 	curPTCB = NULL;
 
-	kernel_sleep(EXITED, SCHED_USER);
+	/* Release the PCB lock as we go to sleep */
+	sleep_releasing(EXITED, & curproc->lock, SCHED_USER, NO_TIMEOUT);
 }
 
 void start_thread(){
@@ -148,3 +173,64 @@ void refcounter_decrement(PTCB* ptcb){
 
 	ptcb->ref_counter -= 1;
 }
+
+
+/*
+  Return the thread of the current process with the given tid,
+  or NULL if there is no such (live) thread.
+
+  Must be called with the lock of the current PCB held.
+ */
+static TCB* get_process_thread(Tid_t tid)
+{
+	if(tid == NOTHREAD)
+		return NULL;
+
+	rlnode* node = rlist_find(&CURPROC->PTCB_list, (void*)tid, NULL);
+	if(node == NULL || node->ptcb->exited)
+		return NULL;
+
+	return node->ptcb->thread;
+}
+
+/**
+  @brief Set the cores that a thread may run on.
+  */
+int sys_SetThreadAffinity(Tid_t tid, cpu_mask_t mask)
+{
+	/* Ignore cores that do not exist */
+	mask = sched_core_mask(mask);
+	if(mask == 0)
+		return -1;
+
+	/* The thread cannot exit while we hold the lock */
+	int move = 0;
+	Mutex_Lock(& CURPROC->lock);
+	TCB* tcb = get_process_thread(tid);
+	if(tcb != NULL)
+		move = sched_set_affinity(tcb, mask);
+	Mutex_Unlock(& CURPROC->lock);
+
+	/* We are not allowed on this core any more */
+	if(move)
+		yield(SCHED_QUANTUM);
+
+	return (tcb != NULL) ? 0 : -1;
+}
+
+/**
+  @brief Get the cores that a thread may run on.
+  */
+int sys_GetThreadAffinity(Tid_t tid, cpu_mask_t* mask)
+{
+	if(mask == NULL)
+		return -1;
+
+	Mutex_Lock(& CURPROC->lock);
+	TCB* tcb = get_process_thread(tid);
+	if(tcb != NULL)
+		*mask = tcb->affinity;
+	Mutex_Unlock(& CURPROC->lock);
+
+	return (tcb != NULL) ? 0 : -1;
+}
@@ -0,0 +1,133 @@
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+
+#include "tinyos.h"
+
+
+/*
+ 	A standalone program that measures pipe throughput.
+
+ 	A number of writer/reader process pairs are started, each pair
+ 	streaming data over its own pipe. The pairs share no kernel lock,
+ 	so the total throughput should grow with the number of cores.
+ */
+
+typedef struct bench_args {
+  int pairs;      /* Number of writer/reader pairs */
+  int kbytes;     /* Kbytes sent over each pipe */
+} bench_args;
+
+/* The arguments of each child: the pipe and the amount of data */
+typedef struct pair_args {
+  pipe_t pipe;
+  int kbytes;
+} pair_args;
+
+
+#define CHUNK 1024
+
+int bench_writer(int argl, void* args)
+{
+  pair_args* P = args;
+  char buf[CHUNK];
+  for(int i=0;i<CHUNK;i++) buf[i] = i;
+
+  Close(P->pipe.read);
+  for(int k=0; k<P->kbytes; k++) {
+    int count = 0;
+    while(count < CHUNK) {
+      int rc = Write(P->pipe.write, buf+count, CHUNK-count);
+      assert(rc>0);
+      count += rc;
+    }
+  }
+  Close(P->pipe.write);
+  return 0;
+}
+
+int bench_reader(int argl, void* args)
+{
+  pair_args* P = args;
+  char buf[CHUNK];
+  long total = 0;
+  int rc;
+
+  Close(P->pipe.write);
+  while((rc = Read(P->pipe.read, buf, CHUNK)) > 0)
+    total += rc;
+  Close(P->pipe.read);
+
+  return (total == (long)P->kbytes*CHUNK) ? 0 : 1;
+}
+
+
+int boot_bench(int argl, void* args)
+{
+  bench_args* B = args;
+
+  usec_t start = GetTime();
+
+  for(int p=0; p<B->pairs; p++) {
+    pair_args P;
+    P.kbytes = B->kbytes;
+    if(Pipe(&P.pipe)!=0) {
+      printf("Cannot create pipe %d\n", p);
+      break;
+    }
+
+    Exec(bench_writer, sizeof(P), &P);
+    Exec(bench_reader, sizeof(P), &P);
+
+    /* Do not pass this pipe to the next pairs */
+    Close(P.pipe.read);
+    Close(P.pipe.write);
+  }
+
+  int errors = 0, status;
+  while(WaitChild(NOPROC, &status)!=NOPROC)
+    errors += status;
+
+  usec_t elapsed = GetTime() - start;
+  double mbytes = (double)B->pairs * B->kbytes / 1024.0;
+  printf("%d pairs, %.1f Mbytes in %.3f sec: %.1f Mbytes/sec%s\n",
+    B->pairs, mbytes, elapsed*1E-6, mbytes/(elapsed*1E-6),
+    errors ? " (DATA LOST)" : "");
+
+  return 0;
+}
+
+/****************************************************/
+
+void usage(const char* pname)
+{
+  printf("usage:\n  %s <ncores> <pairs> <kbytes>\n\n  \
+    where:\n\
+    <ncores> is the number of cpu cores to use,\n\
+    <pairs> is the number of writer/reader pairs (1 to %d),\n\
+    <kbytes> is the number of Kbytes sent over each pipe.\n",
+	 pname, (MAX_PROC-1)/2);
+  exit(1);
+}
+
+
+int main(int argc, const char** argv)
+{
+  unsigned int ncores;
+  bench_args B;
+
+  if(argc!=4) usage(argv[0]);
+  ncores = atoi(argv[1]);
+  B.pairs = atoi(argv[2]);
+  B.kbytes = atoi(argv[3]);
+
+  /* check arguments */
+  if( ncores==0 ) usage(argv[0]);
+  if( (B.pairs <= 0) || (B.pairs > (MAX_PROC-1)/2) ) usage(argv[0]);
+  if( (B.kbytes <= 0) ) usage(argv[0]);
+
+  boot(ncores, 0, boot_bench, sizeof(B), &B);
+
+  return 0;
+}
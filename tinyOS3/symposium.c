@@ -134,7 +134,7 @@ void SymposiumTable_philosopher(SymposiumTable* S, int i)
 void SymposiumTable_init(SymposiumTable* table, symposium_t* symp)
 {
 	table->symp = symp;
-	table->mx = MUTEX_INIT;
+	table->mx = MUTEX_BLOCKING_INIT;
 	table->state = (PHIL*) xmalloc(symp->N * sizeof(PHIL));
 	table->hungry = (CondVar*) xmalloc(symp->N * sizeof(CondVar));
 	for(int i=0; i<symp->N; i++) {
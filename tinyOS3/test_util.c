@@ -128,9 +128,11 @@ BARE_TEST(test_list_queue,
 	while(! is_rlist_empty(&L)) {
 		rlnode* p = rlist_pop_back(&L);
 		ASSERT(I==p);
+		ASSERT(p->next==p && p->prev==p);
 		I++;
 	}
 
+	ASSERT(I==n+10);
 	ASSERT(is_rlist_empty(&L));
 
 	I = rlist_pop_back(&L);   /* The list is empty, but the pop_back method does not mind! */
@@ -266,6 +268,114 @@ TEST_SUITE(rlist_tests,
 
 
 
+/* Check the heap order and the back pointers of a heap, and return its size */
+size_t check_heap(phnode* root, phnode* prev)
+{
+	size_t n = 0;
+	for(phnode* c = root; c!=NULL; prev = c, c = c->sibling) {
+		ASSERT(c->prev == prev);
+		if(c->child) ASSERT(c->key <= c->child->key);
+		n += 1 + check_heap(c->child, c);
+	}
+	return n;
+}
+
+
+BARE_TEST(test_heap_init,
+	"Test heap initialization"
+	)
+{
+	phnode* heap = NULL;
+	ASSERT(is_pheap_empty(heap));
+	ASSERT(pheap_pop(&heap)==NULL);
+
+	phnode n;
+	ASSERT(phnode_init(&n, &n)==&n);
+	ASSERT(n.obj == &n);
+	n.key = 5;
+	pheap_insert(&heap, &n);
+	ASSERT(heap == &n);
+	ASSERT(! is_pheap_empty(heap));
+	ASSERT(pheap_pop(&heap)==&n);
+	ASSERT(is_pheap_empty(heap));
+}
+
+
+BARE_TEST(test_heap_sort,
+	"Test that nodes are popped from the heap in key order"
+	)
+{
+	const int N = 1000;
+	phnode n[N];
+	phnode* heap = NULL;
+
+	srand(1);
+	for(int i=0; i<N; i++) {
+		phnode_init(n+i, NULL)->key = rand() % 100;
+		pheap_insert(&heap, n+i);
+	}
+	ASSERT(check_heap(heap, NULL)==N);
+
+	uint64_t last = 0;
+	for(int i=0; i<N; i++) {
+		phnode* p = pheap_pop(&heap);
+		ASSERT(p != NULL);
+		ASSERT(p->key >= last);
+		last = p->key;
+		if(i % 100 == 0) ASSERT(check_heap(heap, NULL)==N-i-1);
+	}
+	ASSERT(is_pheap_empty(heap));
+}
+
+
+BARE_TEST(test_heap_remove,
+	"Test removing arbitrary nodes from the heap"
+	)
+{
+	const int N = 500;
+	phnode n[N];
+	phnode* heap = NULL;
+
+	srand(2);
+	for(int i=0; i<N; i++) {
+		phnode_init(n+i, n+i)->key = rand() % 1000;
+		pheap_insert(&heap, n+i);
+	}
+
+	/* Pop a few, to give the heap some structure */
+	phnode* popped[10];
+	for(int i=0; i<10; i++) popped[i] = pheap_pop(&heap);
+	for(int i=0; i<10; i++) pheap_insert(&heap, popped[i]);
+
+	/* Remove every odd node */
+	for(int i=1; i<N; i+=2) {
+		pheap_remove(&heap, n+i);
+		ASSERT(n[i].child==NULL && n[i].sibling==NULL && n[i].prev==NULL);
+		ASSERT(n[i].obj == n+i);
+	}
+	ASSERT(check_heap(heap, NULL)==N/2);
+
+	/* The rest come out in order, and they are all even */
+	uint64_t last = 0;
+	while(! is_pheap_empty(heap)) {
+		phnode* p = pheap_pop(&heap);
+		ASSERT(p->key >= last);
+		ASSERT((p-n) % 2 == 0);
+		last = p->key;
+	}
+}
+
+
+TEST_SUITE(pheap_tests,
+	"Tests for the pairing heap")
+{
+	&test_heap_init,
+	&test_heap_sort,
+	&test_heap_remove,
+	NULL
+};
+
+
 void test_argv(size_t argc, const char* argv[])
 {
 	int l = argvlen(argc, argv);
@@ -548,6 +658,7 @@ TEST_SUITE(all_tests,
 	"All tests")
 {
 	&rlist_tests,
+	&pheap_tests,
 	&test_pack_unpack,
 	&exception_tests,	
 	NULL
@@ -3,6 +3,7 @@
 #define __TINYOS_H__
 
 #include <stdint.h>
+#include <stddef.h>
 
 /**
   @file tinyos.h
@@ -35,6 +36,14 @@ typedef int Pid_t;		/* The PID type  */
 */
 typedef unsigned long timeout_t;
 
+/**
+  @brief An integer type for time instants and precise intervals.
+
+  The unit is microseconds.
+  @see GetTime
+*/
+typedef uint64_t usec_t;
+
 
 /** @brief The invalid PID */
 #define NOPROC (-1)
@@ -61,6 +70,45 @@ typedef uintptr_t Tid_t;
 /** @brief The invalid thread ID */
 #define NOTHREAD ((Tid_t)0)
 
+/**
+  @brief A set of cpu cores.
+
+  Bit @c c of the mask denotes core @c c.
+  */
+typedef uint64_t cpu_mask_t;
+
+/** @brief The mask containing only core @c c */
+#define CPU_MASK(c) (((cpu_mask_t)1) << (c))
+
+/** @brief The mask containing all cores */
+#define CPU_MASK_ALL ((cpu_mask_t)-1)
+
+/** @brief The smallest stack size of a thread, in bytes */
+#define THREAD_STACK_MIN (8*1024)
+
+/** @brief The largest stack size of a thread, in bytes */
+#define THREAD_STACK_MAX (64*1024*1024)
+
+/** @brief The default weight of a thread under the fair scheduling policy */
+#define THREAD_WEIGHT_DEFAULT 1024
+
+/**
+  @brief Attributes for new threads.
+
+  These are passed to @c CreateThreadEx and @c ExecEx. A field that is
+  zero takes its default value, so a zero-initialized object gives the
+  same thread as @c CreateThread and @c Exec.
+  */
+typedef struct thread_attr {
+  size_t stack_size;    /**< The stack size in bytes, rounded up to whole pages.
+                             It must be between @c THREAD_STACK_MIN and @c THREAD_STACK_MAX.
+                             The default is 128 kbytes. */
+  unsigned int weight;  /**< The weight under the fair policy (see @c THREAD_WEIGHT_DEFAULT).
+                             A thread of double weight receives double CPU share. */
+  cpu_mask_t affinity;  /**< The cores the thread may run on (see @c SetThreadAffinity).
+                             The default is the affinity of the creator. */
+} thread_attr;
+
 
 /*******************************************
  *      Concurrency control
@@ -72,11 +120,25 @@ typedef uintptr_t Tid_t;
     mutexes are suitable for use in user-space, as well as in the implementation
     of the kernel.
 
+    A mutex is either a test-and-set lock, a ticket lock, or a blocking lock.
+    A ticket lock serves its waiters in FIFO order, and its waiters do not all
+    write to the same cache line, so it behaves better under contention from
+    many cores. The waiters of a blocking lock sleep, instead of spinning, unless
+    the holder is running on another core.
+    The kind of a mutex is selected when it is initialized.
+
     @see Mutex_Lock
     @see Mutex_Unlock
     @see MUTEX_INIT
+    @see MUTEX_TICKET_INIT
+    @see MUTEX_BLOCKING_INIT
 */
-typedef char Mutex;
+typedef struct {
+  unsigned short next;     /**< The next ticket to give out, or the state of a test-and-set or blocking lock */
+  unsigned short owner;    /**< The ticket that holds the lock */
+  unsigned char kind;      /**< 0 for a test-and-set lock, 1 for a ticket lock, 2 for a blocking lock */
+  void* holder;            /**< The thread that holds a blocking lock */
+} Mutex;
 
 /**
   @brief This macro is used to initialize mutexes.
@@ -86,13 +148,40 @@ typedef char Mutex;
    Mutex my_mutex = MUTEX_INIT;
   @endcode
  */
-#define MUTEX_INIT 0
+#define MUTEX_INIT ((Mutex){ 0, 0, 0 })
+
+/**
+  @brief This macro is used to initialize a mutex as a ticket lock.
+
+  A waiter of a ticket lock that is preempted holds up all the waiters
+  behind it. Thus, ticket locks are meant for short critical sections 
+  that run with preemption off, such as the scheduler locks.
+
+  @see MUTEX_INIT
+ */
+#define MUTEX_TICKET_INIT ((Mutex){ 0, 0, 1 })
+
+/**
+  @brief This macro is used to initialize a mutex as a blocking lock.
+
+  A thread that finds a blocking lock taken spins only while the holder
+  is running on another core; otherwise, it sleeps until the holder
+  unlocks the mutex, which wakes up exactly one of the sleepers.
+  Blocking locks are meant for user-space and for the preemptive domain 
+  of the kernel, where a critical section may be long, or may block.
+  They must not be passed to @c sleep_releasing.
+
+  @see MUTEX_INIT
+ */
+#define MUTEX_BLOCKING_INIT ((Mutex){ 0, 0, 2 })
 
 
 /** @brief Lock a mutex.
 
-  Lock a mutex, by waiting if necessary, as long as it takes. In user-space and
-  in kernel-space (preemptive domain), the locking will yield after spinning for a few hundred times.
+  Lock a mutex, by waiting if necessary, as long as it takes. The waiting thread
+  spins with exponential backoff. In user-space and in kernel-space (preemptive domain), 
+  the locking will yield if the lock does not change hands for a while.
+  The waiters of a blocking lock sleep instead (see @c MUTEX_BLOCKING_INIT).
   In scheduler space (non-preemptive domain), the mutex lock operation is pure spinlock.
 
   @see Mutex
@@ -196,12 +285,133 @@ void Cond_Signal(CondVar*);
   Broadcast wakes up all threads sleeping on this condition variable.
   The calling thread is not preempted by the awoken threads.
 
+  If the threads wait with a blocking mutex (see @c MUTEX_BLOCKING_INIT),
+  and the mutex is held, only the first one is woken up. The rest are 
+  moved to the sleepers of the mutex, and each unlocking wakes up one of them.
+
   @see Cond_Wait
   @see Cond_Signal
 */
 void Cond_Broadcast(CondVar*);
 
 
+/** @brief The number of reader counters of a reader-writer lock.
+
+  This is the maximum number of cores. Each core counts its readers on its own
+  counter, so that readers on different cores do not write to the same cache line.
+  */
+#define RWLOCK_SLOTS 32
+
+/** @brief A reader-writer lock.
+
+  A reader-writer lock can be held by many readers at the same time, or by a 
+  single writer. It is meant for read-mostly data, whose readers should not
+  be serialized.
+
+  Writers have preference: once a writer is waiting, new readers wait until
+  it is done. Thus, writers cannot be starved by a steady stream of readers.
+  Readers and writers that have to wait sleep.
+
+  @see RwLock_ReadLock
+  @see RwLock_WriteLock
+  @see RWLOCK_INIT
+ */
+typedef struct {
+  struct {
+    int count;               /**< Readers that entered on this core, less those that left from it */
+  } __attribute__((aligned(64))) readers[RWLOCK_SLOTS];
+
+  int writers;               /**< The writers that hold, or wait for, the lock */
+  Mutex writer_lock;         /**< Serializes the writers */
+  Mutex wait_lock;           /**< Protects the sleeping of readers and writers */
+  CondVar readers_cv;        /**< Readers waiting for the writer to leave */
+  CondVar writer_cv;         /**< The writer waiting for the readers to leave */
+} RwLock;
+
+/** @brief  This macro is used to initialize reader-writer locks.
+
+   It is used as follows:
+  @code
+  RwLock my_rwlock = RWLOCK_INIT;
+  @endcode
+ */
+#define RWLOCK_INIT ((RwLock){ .writers = 0, .writer_lock = MUTEX_BLOCKING_INIT, \
+  .wait_lock = MUTEX_INIT, .readers_cv = COND_INIT, .writer_cv = COND_INIT })
+
+/** @brief Lock a reader-writer lock for reading.
+
+  The calling thread waits while a writer holds the lock, or waits for it.
+  Many threads may hold the lock for reading at the same time.
+
+  @see RwLock_ReadUnlock
+ */
+void RwLock_ReadLock(RwLock*);
+
+/** @brief Unlock a reader-writer lock that you locked for reading.
+  @see RwLock_ReadLock
+ */
+void RwLock_ReadUnlock(RwLock*);
+
+/** @brief Lock a reader-writer lock for writing.
+
+  The calling thread waits until the lock has no other writer and no readers.
+  Readers arriving meanwhile wait for the writer.
+
+  @see RwLock_WriteUnlock
+ */
+void RwLock_WriteLock(RwLock*);
+
+/** @brief Unlock a reader-writer lock that you locked for writing.
+  @see RwLock_WriteLock
+ */
+void RwLock_WriteUnlock(RwLock*);
+
+
+/** @brief Return the current time, in microseconds.
+
+  The time is measured by a monotonic clock, from some arbitrary
+  point in the past. It is meant for computing intervals and
+  deadlines for @c SleepUntil.
+
+  @returns the current time
+  @see SleepUntil
+  */
+usec_t GetTime();
+
+
+/** @brief Sleep for some time.
+
+  The calling thread sleeps for (at least) @c usec microseconds.
+  Unlike a timed wait on a condition variable, the timeout is not
+  rounded to milliseconds.
+
+  @param usec the time to sleep, in microseconds
+  @see SleepUntil
+  */
+void Sleep(usec_t usec);
+
+
+/** @brief Sleep until some time.
+
+  The calling thread sleeps until @c GetTime() reaches @c abstime. If 
+  @c abstime has already passed, it returns immediately. Periodic tasks 
+  should advance an absolute deadline by their period and sleep until
+  it, so that the delays of each wakeup do not accumulate:
+  @code
+  usec_t next = GetTime();
+  while(1) {
+    do_work();
+    next += period;
+    SleepUntil(next);
+  }
+  @endcode
+
+  @param abstime the time to wake up, in @c GetTime() time
+  @see Sleep
+  */
+void SleepUntil(usec_t abstime);
+
+
 /*******************************************
  *
  * Process creation
@@ -240,6 +450,21 @@ typedef int (*Task)(int, void*);
   */
 Pid_t Exec(Task task, int argl, void* args);
 
+/**
+  @brief Create a new process, with the given attributes for its main thread.
+
+  This call is the same as @c Exec, except that the main thread of the
+  new process is created with the attributes in @c attr.
+
+  @param attr the thread attributes, or NULL for the defaults
+  @returns the PID of the new process, or NOPROC on error. Possible errors are
+  those of @c Exec, and:
+   - the stack size is out of range.
+   - the affinity does not contain any existing core.
+  @see thread_attr
+  */
+Pid_t ExecEx(Task task, int argl, void* args, const thread_attr* attr);
+
 
 /** @brief Exit the current process.
 
@@ -319,6 +544,20 @@ Pid_t GetPPid(void);
   */
 Tid_t CreateThread(Task task, int argl, void* args);
 
+/**
+  @brief Create a new thread in the current process, with the given attributes.
+
+  This call is the same as @c CreateThread, except that the new thread
+  is created with the attributes in @c attr.
+
+  @param attr the thread attributes, or NULL for the defaults
+  @returns the tid of the new thread, or NOTHREAD on error. Possible errors are:
+   - the stack size is out of range.
+   - the affinity does not contain any existing core.
+  @see thread_attr
+  */
+Tid_t CreateThreadEx(Task task, int argl, void* args, const thread_attr* attr);
+
 /**
   @brief Return the Tid of the current thread.
  */
@@ -375,6 +614,37 @@ int ThreadDetach(Tid_t tid);
 void ThreadExit(int exitval);
 
 
+/**
+  @brief Set the cores that a thread may run on.
+
+  The thread will only be executed by cores contained in @c mask.
+  If the thread is currently running or queued on a core outside
+  the mask, it is moved to an allowed core. New threads and processes
+  inherit the affinity of their creator. Initially, a thread may
+  run on all cores.
+
+  @param tid the thread, which must belong to the current process
+  @param mask the allowed cores. Bits of cores that do not exist are ignored.
+  @returns 0 on success, and -1 on error. Possible errors are:
+    - there is no thread with the given tid in this process.
+    - the tid corresponds to an exited thread.
+    - @c mask does not contain any existing core.
+  */
+int SetThreadAffinity(Tid_t tid, cpu_mask_t mask);
+
+/**
+  @brief Get the cores that a thread may run on.
+
+  @param tid the thread, which must belong to the current process
+  @param mask a location where the mask of allowed cores is stored
+  @returns 0 on success, and -1 on error. Possible errors are:
+    - there is no thread with the given tid in this process.
+    - the tid corresponds to an exited thread.
+    - @c mask is NULL.
+  */
+int GetThreadAffinity(Tid_t tid, cpu_mask_t* mask);
+
+
 
 /*******************************************
  *
@@ -760,6 +1030,76 @@ typedef struct procinfo
 Fid_t OpenInfo();
 
 
+/**
+  @brief The number of wait channels in a @c threadinfo structure.
+  */
+#define THREADINFO_WCHANS (4)
+
+/**
+  @brief The max. length of a wait channel name in a @c threadinfo structure.
+  */
+#define THREADINFO_WCHAN_SIZE (24)
+
+/**
+	@brief A struct containing the times of a thread, or of a process.
+
+	The time of a thread is split into the time it ran, the time it was
+	ready to run but waited for a core, and the time it was blocked. The
+	blocked time is further split by wait channel, which is the name of
+	the kernel function the thread slept in (e.g., the pipe read).
+
+	All times are in microseconds.
+
+	This structure is returned by thread information streams.
+	@see OpenThreadInfo
+  */
+typedef struct threadinfo
+{
+	Pid_t pid;          /**< @brief The pid of the process. */
+	Tid_t tid;          /**< @brief The tid of the thread, or @c NOTHREAD.
+
+                    A record with @c NOTHREAD contains the total of the process,
+                    including the threads that have exited. */
+
+	usec_t cpu_time;      /**< @brief Time running on a core. */
+	usec_t ready_time;    /**< @brief Time ready to run, waiting for a core. */
+	usec_t blocked_time;  /**< @brief Time blocked. */
+	usec_t max_latency;   /**< @brief The longest wait for a core. */
+	unsigned long sleeps; /**< @brief The number of times the thread blocked. */
+
+	/** @brief The blocked time by wait channel.
+
+		Unused entries have a zero @c sleeps field. The name of the
+		last entry may be empty; then, it is the total of the wait
+		channels not reported separately.
+	  */
+	struct {
+		char name[THREADINFO_WCHAN_SIZE]; /**< @brief The wait channel */
+		usec_t time;                      /**< @brief Time blocked on it */
+		unsigned long sleeps;             /**< @brief Times blocked on it */
+	} wchan[THREADINFO_WCHANS];
+} threadinfo;
+
+
+/**
+	@brief Open a thread information stream.
+
+	This is a read-only stream that returns a sequence of
+	@c threadinfo structures, each packed into a block of size
+	@c sizeof(threadinfo). A @c Read with a smaller size fails.
+
+	For each used PCB, the stream returns the total of the process,
+	followed by one structure for each of its threads. As for @c OpenInfo,
+	a best-effort approach to return relevant information is made.
+
+	@returns a file id on success, or NOFILE on error. Possible reasons
+		for error are:
+		- the available file ids for the process are exhausted.
+	@see OpenInfo
+ */
+Fid_t OpenThreadInfo();
+
+
 
 
 /*******************************************
@@ -781,6 +1121,42 @@ Fid_t OpenInfo();
 void boot(unsigned int ncores, unsigned int terminals, Task boot_task, int argl, void* args);
 
 
+/** @brief The scheduling policies of tinyos3. */
+typedef enum sched_policy {
+  SCHED_POLICY_MLFQ,    /**< Multilevel feedback queues (the default) */
+  SCHED_POLICY_FAIR,    /**< Fair share, by weighted virtual runtime */
+  SCHED_POLICY_MAX      /**< The number of policies */
+} sched_policy;
+
+/** @brief Select the scheduling policy.
+
+   The policy is used by subsequent calls to @c boot().
+
+   @param policy the scheduling policy
+   @returns 0 on success, or -1 if @c policy is not valid.
+   */
+int boot_set_sched_policy(sched_policy policy);
+
+/** @brief Turn lock profiling on or off.
+
+   When on, subsequent calls to @c boot() keep statistics on the kernel 
+   locks and the mutexes, and print a report to @c stderr at shutdown.
+
+   @param flag non-zero to turn profiling on
+   */
+void boot_set_lock_profiling(int flag);
+
+/** @brief Get the lock profile of a mutex.
+
+   After a @c boot() with lock profiling on, the number of times @c mx was
+   locked, and how many of these times it was already held, are stored in
+   @c acquired and @c contended.
+
+   @returns 0 on success, or -1 if @c mx was not profiled.
+   */
+int boot_lock_profile(const Mutex* mx, unsigned long* acquired, unsigned long* contended);
+
+
 /** @} */
 
 #endif
@@ -21,6 +21,7 @@ int Repeat(size_t,const char**);
 int Hanoi(size_t,const char**);
 int HelpMessage(size_t,const char**);
 int SystemInfo(size_t,const char**);
+int ThreadInfo(size_t,const char**);
 int Capitalize(size_t,const char**);
 int LowerCase(size_t,const char**);
 int LineEnum(size_t,const char**);
@@ -39,6 +40,7 @@ COMMANDS[]  =
 	{"help", HelpMessage, 0, "A help message."},
 	{"ls", ListPrograms, 0, "List available programs programs."},
 	{"sysinfo", SystemInfo, 0, "Print some basic info about the current system."},
+	{"threads", ThreadInfo, 0, "Print where the threads of each process spend their time."},
 	{"runterm", RunTerm, 2, "runterm <term> <prog>  <args...> : execute '<prog> <args...>' on terminal <term>."},
 	{"sh", Shell, 0, "Run a shell."},
 	{"repeat", Repeat, 2, "repeat <n> <prog> <args...>: execute '<prog> <args...>' <n> times."},
@@ -204,6 +206,44 @@ int SystemInfo(size_t argc, const char** argv)
 }
 
 
+int ThreadInfo(size_t argc, const char** argv)
+{
+	Fid_t finfo = OpenThreadInfo();
+	if(finfo==NOFILE) {
+		printf("Cannot open the thread information stream.\n");
+		return 1;
+	}
+
+	threadinfo info;
+	int thread = 0;
+	printf("%5s %6s %6s %6s %6s %9s  %s\n",
+		"PID", "Thread", "CPU", "Ready", "Block", "Max wait", "Blocked in");
+	while(Read(finfo, (char*) &info, sizeof(info)) > 0) {
+		/* Threads are numbered in the order of the stream */
+		thread = (info.tid == NOTHREAD) ? 0 : thread+1;
+
+		usec_t total = info.cpu_time + info.ready_time + info.blocked_time;
+		if(total == 0) total = 1;
+		char tname[16];
+		if(thread) sprintf(tname, "%d", thread); else strcpy(tname, "all");
+
+		printf("%5d %6s %5.1f%% %5.1f%% %5.1f%% %6.1fms ",
+			info.pid, tname,
+			100.0*info.cpu_time/total, 100.0*info.ready_time/total, 
+			100.0*info.blocked_time/total, info.max_latency*1E-3);
+		for(int i=0; i<THREADINFO_WCHANS; i++) {
+			if(info.wchan[i].sleeps == 0) continue;
+			printf(" %s %.1f%%", info.wchan[i].name[0] ? info.wchan[i].name : "(other)",
+				100.0*info.wchan[i].time/total);
+		}
+		printf("\n");
+	}
+	Close(finfo);
+	printf("\n");
+	return 0;
+}
+
+
 int HelpMessage(size_t argc, const char** argv)
 {
 	printf("This is a simple shell for tinyos.\n\
@@ -18,6 +18,7 @@
 	This file defines the following:
 	- macros for error checking and message reporting
 	- a _resource list_ data structure
+	- a _pairing heap_ data structure
 
 	Resource list
 	--------------
@@ -450,7 +451,7 @@ static inline rlnode* rlist_pop_front(rlnode* list) { return rl_splice(list, lis
 	This function, applied on a non-empty list, will remove the tail of
 	the list and return in.
 */
-static inline rlnode* rlist_pop_back(rlnode* list) { return rl_splice(list, list->prev); }
+static inline rlnode* rlist_pop_back(rlnode* list) { return rl_splice(list->prev->prev, list->prev); }
 
 /**
 	@brief Return the length of a list.
@@ -580,6 +581,185 @@ static inline void rlist_select(rlnode* Lsrc, rlnode* Ldest, int (*pred)(rlnode*
 
 
 
+/*******************************************************
+ *
+ *
+ *******************************************************/
+
+/**
+	@defgroup pheaps  Pairing heaps
+	@brief  An intrusive priority queue.
+
+	A pairing heap is a min-heap of nodes, ordered by an integer key.
+	Like @c rlnode, a @c phnode is stored inside the object that it
+	represents, so that objects can be added to and removed from a heap
+	without memory allocation. For example,
+	@code
+	// a heap is just a pointer to its root node
+	phnode* heap = NULL;
+
+	// add a thread, using its virtual runtime as key
+	phnode_init(& tcb->run_node, tcb)->key = tcb->vruntime;
+	pheap_insert(& heap, & tcb->run_node);
+
+	// get the thread with the smallest key
+	TCB* next = pheap_pop(& heap)->tcb;
+	@endcode
+
+	Insertion and melding take @f$ O(1) @f$ time, while removing the minimum
+	or an arbitrary node takes amortized @f$ O(\log n) @f$ time.
+	Nodes with equal keys are returned in no particular order.
+
+	@{
+ */
+
+/** @brief A convenience typedef */
+typedef struct pairing_heap_node * phnode_ptr;
+
+/**
+	@brief Pairing heap node
+*/
+typedef struct pairing_heap_node {
+
+  /** @brief The object of the node, as in @c rlnode. */
+  union {
+    PCB* pcb;
+    TCB* tcb;
+    CCB* ccb;
+    void* obj;
+    intptr_t num;
+  };
+
+  uint64_t key;       /**< @brief The key of the node. Smaller keys come first. */
+
+  /* heap pointers */
+  phnode_ptr child;   /**< @brief The leftmost child */
+  phnode_ptr sibling; /**< @brief The next sibling to the right */
+  phnode_ptr prev;    /**< @brief The left sibling, or the parent for a leftmost child */
+} phnode;
+
+
+/**
+	@brief Initialize a heap node, not in any heap.
+
+	@param p the node to initialize
+	@param ptr the object of the node
+	@returns the node itself
+ */
+static inline phnode* phnode_init(phnode* p, void* ptr)
+{
+	p->obj = ptr;
+	p->child = p->sibling = p->prev = NULL;
+	return p;
+}
+
+/** @brief Check a heap for emptiness. */
+static inline int is_pheap_empty(phnode* heap) { return heap==NULL; }
+
+/**
+	@brief Meld two heaps and return the root of the result.
+
+	Both @c a and @c b must be roots of heaps (or NULL).
+ */
+static inline phnode* pheap_meld(phnode* a, phnode* b)
+{
+	if(a==NULL) return b;
+	if(b==NULL) return a;
+	if(b->key < a->key) { phnode* t=a; a=b; b=t; }
+
+	/* b becomes the leftmost child of a */
+	b->sibling = a->child;
+	if(a->child) a->child->prev = b;
+	b->prev = a;
+	a->child = b;
+	return a;
+}
+
+/**
+	@brief Meld a list of sibling heaps into one heap, in two passes.
+
+	This is a helper for @c pheap_pop and @c pheap_remove.
+ */
+static inline phnode* __pheap_merge_pairs(phnode* first)
+{
+	/* First pass: meld pairs left to right, stacking the results */
+	phnode* stack = NULL;
+	while(first) {
+		phnode* a = first;
+		phnode* b = a->sibling;
+		first = b ? b->sibling : NULL;
+
+		a->sibling = a->prev = NULL;
+		if(b) b->sibling = b->prev = NULL;
+		a = pheap_meld(a, b);
+
+		a->sibling = stack;
+		stack = a;
+	}
+
+	/* Second pass: meld the results right to left */
+	phnode* root = NULL;
+	while(stack) {
+		phnode* a = stack;
+		stack = a->sibling;
+		a->sibling = NULL;
+		root = pheap_meld(root, a);
+	}
+	return root;
+}
+
+/**
+	@brief Add a node to a heap.
+
+	The key of the node must be set before this call.
+ */
+static inline void pheap_insert(phnode** heap, phnode* node)
+{
+	node->child = node->sibling = node->prev = NULL;
+	*heap = pheap_meld(*heap, node);
+}
+
+/**
+	@brief Remove and return the node with the smallest key, or NULL if the heap is empty.
+ */
+static inline phnode* pheap_pop(phnode** heap)
+{
+	phnode* root = *heap;
+	if(root != NULL) {
+		*heap = __pheap_merge_pairs(root->child);
+		root->child = NULL;
+	}
+	return root;
+}
+
+/**
+	@brief Remove a node from the heap that contains it.
+ */
+static inline void pheap_remove(phnode** heap, phnode* node)
+{
+	if(node == *heap) {
+		pheap_pop(heap);
+		return;
+	}
+
+	/* Unlink the node from its parent or left sibling */
+	if(node->prev->child == node)
+		node->prev->child = node->sibling;
+	else
+		node->prev->sibling = node->sibling;
+	if(node->sibling)
+		node->sibling->prev = node->prev;
+
+	/* Meld its subtree back into the heap */
+	*heap = pheap_meld(*heap, __pheap_merge_pairs(node->child));
+	phnode_init(node, node->obj);
+}
+
+
+/* @} pheaps */
+
+
+
 /*
 	Some helpers for packing and unpacking vectors of strings into
 	(argl, args)
@@ -5,6 +5,9 @@
 #include <time.h>
 #include <math.h>
 #include <setjmp.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <sys/wait.h>
 
 #include "util.h"
 #include "symposium.h"
@@ -70,6 +73,232 @@ BARE_TEST(test_boot,
 
 
 
+BARE_TEST(test_boot_sched_policy,
+	"Test that boot_set_sched_policy() rejects invalid policies, and that\n"
+	"the VM boots and runs processes under each scheduling policy.")
+{
+	int nchildren = 0;
+
+	int child(int argl, void* args) {
+		return argl;
+	}
+
+	int run_children(int argl, void* args) {
+		for(int i=0; i<10; i++)
+			ASSERT(Exec(child, i, NULL)!=NOPROC);
+		int status;
+		for(int i=0; i<10; i++)
+			if(WaitChild(NOPROC, &status)!=NOPROC) nchildren++;
+		return 0;
+	}
+
+	ASSERT(boot_set_sched_policy(SCHED_POLICY_MAX)==-1);
+
+	for(sched_policy p=0; p<SCHED_POLICY_MAX; p++) {
+		ASSERT(boot_set_sched_policy(p)==0);
+		nchildren = 0;
+		boot(2, 0, run_children, 0, NULL);
+		ASSERT(nchildren==10);
+	}
+
+	ASSERT(boot_set_sched_policy(SCHED_POLICY_MLFQ)==0);
+}
+
+
+BARE_TEST(test_lock_profile,
+	"Test that lock profiling records the acquisitions of a contended mutex.")
+{
+	static Mutex mx = MUTEX_INIT;
+	const int N = 4, M = 200;
+
+	int locker(int argl, void* args) {
+		for(int i=0; i<M; i++) {
+			Mutex_Lock(&mx);
+			/* Sleeping with the mutex held makes the others contend for it */
+			if(i % 20 == 0) Sleep(1000);
+			fibo(8);
+			Mutex_Unlock(&mx);
+		}
+		return 0;
+	}
+
+	int contend(int argl, void* args) {
+		Tid_t tid[N];
+		for(int i=0; i<N; i++)
+			tid[i] = CreateThread(locker, 0, NULL);
+		for(int i=0; i<N; i++)
+			ASSERT(ThreadJoin(tid[i], NULL)==0);
+		return 0;
+	}
+
+	unsigned long acquired, contended;
+	ASSERT(boot_lock_profile(&mx, &acquired, &contended)==-1);
+
+	/* The report is printed at shutdown */
+	fflush(stderr);
+	int err = dup(2);
+	int devnull = open("/dev/null", O_WRONLY);
+	dup2(devnull, 2);
+	close(devnull);
+
+	boot_set_lock_profiling(1);
+	boot(2, 0, contend, 0, NULL);
+	boot_set_lock_profiling(0);
+
+	fflush(stderr);
+	dup2(err, 2);
+	close(err);
+
+	ASSERT(boot_lock_profile(&mx, &acquired, &contended)==0);
+	ASSERT(acquired == N*M);
+	ASSERT(contended > 0);
+}
+
+
+BARE_TEST(test_boot_irq_delivery,
+	"Test that the VM boots and runs processes under each interrupt delivery\n"
+	"method.")
+{
+	int nchildren = 0;
+
+	int child(int argl, void* args) {
+		return argl;
+	}
+
+	int run_children(int argl, void* args) {
+		for(int i=0; i<10; i++)
+			ASSERT(Exec(child, i, NULL)!=NOPROC);
+		int status;
+		for(int i=0; i<10; i++)
+			if(WaitChild(NOPROC, &status)!=NOPROC) nchildren++;
+		return 0;
+	}
+
+	irq_delivery modes[] = { IRQ_DELIVERY_SIGNAL, IRQ_DELIVERY_SHARED };
+	for(int m=0; m<2; m++) {
+		vm_set_irq_delivery(modes[m]);
+		nchildren = 0;
+		boot(2, 0, run_children, 0, NULL);
+		ASSERT(nchildren==10);
+	}
+}
+
+
+BARE_TEST(test_fair_share,
+	"Test that the fair scheduling policy gives an equal share of a core\n"
+	"to CPU-bound threads.",
+	.timeout = 20)
+{
+	const int N = 3;
+	volatile unsigned long count[N];
+	volatile int stop = 0;
+
+	int hog(int argl, void* args) {
+		while(! stop) count[argl]++;
+		return 0;
+	}
+
+	int run_hogs(int argl, void* args) {
+		Tid_t tid[N];
+		for(int i=0; i<N; i++) {
+			count[i] = 0;
+			tid[i] = CreateThread(hog, i, NULL);
+		}
+
+		/* Let them run for a while */
+		Mutex mx = MUTEX_INIT;
+		CondVar cv = COND_INIT;
+		Mutex_Lock(&mx);
+		Cond_TimedWait(&mx, &cv, 1000);
+		Mutex_Unlock(&mx);
+		stop = 1;
+
+		for(int i=0; i<N; i++)
+			ThreadJoin(tid[i], NULL);
+		return 0;
+	}
+
+	ASSERT(boot_set_sched_policy(SCHED_POLICY_FAIR)==0);
+	boot(1, 0, run_hogs, 0, NULL);
+	ASSERT(boot_set_sched_policy(SCHED_POLICY_MLFQ)==0);
+
+	unsigned long min = count[0], max = count[0];
+	for(int i=1; i<N; i++) {
+		if(count[i] < min) min = count[i];
+		if(count[i] > max) max = count[i];
+	}
+
+	/* Allow for the coarse resolution of the kernel clock */
+	ASSERT(min > 0);
+	ASSERT(3*max <= 4*min);
+}
+
+
+BARE_TEST(test_fair_migrate,
+	"Test that under the fair scheduling policy, a thread moved to a core\n"
+	"whose threads have received less service runs promptly.",
+	.timeout = 20)
+{
+	volatile int stop = 0;
+	volatile TimerDuration arrived = 0;
+	TimerDuration moved = 0;
+
+	int hog(int argl, void* args) {
+		while(! stop) fibo(10);
+		return 0;
+	}
+
+	int mover(int argl, void* args) {
+		while(cpu_core_id != 0) fibo(10);
+		arrived = bios_clock();
+		return hog(argl, args);
+	}
+
+	int run_hogs(int argl, void* args) {
+		Mutex mx = MUTEX_INIT;
+		CondVar cv = COND_INIT;
+		Tid_t tid[5];
+		ASSERT(SetThreadAffinity(ThreadSelf(), CPU_MASK(0))==0);
+		Mutex_Lock(&mx);
+
+		/* Build up service on core 1 */
+		tid[0] = CreateThread(mover, 0, NULL);
+		tid[1] = CreateThread(hog, 0, NULL);
+		tid[2] = CreateThread(hog, 0, NULL);
+		for(int i=0; i<3; i++)
+			ASSERT(SetThreadAffinity(tid[i], CPU_MASK(1))==0);
+		Cond_TimedWait(&mx, &cv, 900);
+
+		/* Start fresh threads on core 0 */
+		for(int i=3; i<5; i++) {
+			tid[i] = CreateThread(hog, 0, NULL);
+			ASSERT(SetThreadAffinity(tid[i], CPU_MASK(0))==0);
+		}
+		Cond_TimedWait(&mx, &cv, 50);
+
+		moved = bios_clock();
+		ASSERT(SetThreadAffinity(tid[0], CPU_MASK(0))==0);
+		for(int i=0; i<2000 && ! arrived; i++) 
+			Cond_TimedWait(&mx, &cv, 1);
+
+		Mutex_Unlock(&mx);
+		stop = 1;
+		for(int i=0; i<5; i++)
+			ThreadJoin(tid[i], NULL);
+		return 0;
+	}
+
+	ASSERT(boot_set_sched_policy(SCHED_POLICY_FAIR)==0);
+	boot(2, 0, run_hogs, 0, NULL);
+	ASSERT(boot_set_sched_policy(SCHED_POLICY_MLFQ)==0);
+
+	/* Without normalization, it would wait for the others to catch up
+	   with its vruntime, that is, for about 600msec. */
+	ASSERT(arrived != 0);
+	ASSERT(arrived - moved < 200000);
+}
+
+
 
 /*********************************************
  *
@@ -340,6 +569,39 @@ BOOT_TEST(test_orphans_adopted_by_init,
 }
 
 
+BOOT_TEST(test_exec_wait_contention,
+	"Test that many processes can Exec and WaitChild concurrently, contending for the kernel lock."
+	)
+{
+	int leaf(int argl, void* args)
+	{
+		return argl;
+	}
+	int spawner(int argl, void* args)
+	{
+		int sum = 0;
+		for(int i=0;i<200;i++) {
+			Pid_t pid = Exec(leaf, i, NULL);
+			ASSERT(pid!=NOPROC);
+			int status;
+			ASSERT(WaitChild(pid, &status)==pid);
+			sum += status;
+		}
+		return (sum == 199*200/2) ? 0 : 1;
+	}
+
+	for(int i=0;i<8;i++)
+		ASSERT(Exec(spawner,0,NULL)!=NOPROC);
+
+	for(int i=0;i<8;i++) {
+		int status;
+		ASSERT(WaitChild(NOPROC, &status) != NOPROC);
+		ASSERT(status == 0);
+	}
+	return 0;
+}
+
+
 
 /*********************************************
  *
@@ -356,6 +618,104 @@ BOOT_TEST(test_orphans_adopted_by_init,
 	Test that a timed wait on a condition variable terminates after the timeout.
  */
 
+BOOT_TEST(test_bios_hrtimers,
+	"Test that hrtimers expire in the order of their deadlines, not earlier\n"
+	"than their deadlines, and that canceled hrtimers do not expire."
+	)
+{
+	const int N = 4;
+	static volatile uint64_t fired_at[4];
+	static volatile int nfired;
+	static int order[4];
+	static bios_hrtimer timer[4];
+
+	void on_expire(bios_hrtimer* t) {
+		int i = t - timer;
+		fired_at[i] = bios_clock_ns();
+		order[nfired++] = i;
+	}
+
+	nfired = 0;
+	uint64_t now = bios_clock_ns();
+	uint64_t delay[] = { 3000000, 1000000, 2000000, 1500000 };
+	for(int i=0; i<N; i++) {
+		fired_at[i] = 0;
+		bios_hrtimer_init(&timer[i], on_expire);
+		bios_hrtimer_start(&timer[i], now + delay[i]);
+	}
+	ASSERT(bios_hrtimer_cancel(&timer[3])==1);
+	ASSERT(bios_hrtimer_cancel(&timer[3])==0);
+
+	/* Spin until all have expired */
+	while(nfired < N-1 && bios_clock_ns() < now + 1000000000ull);
+
+	ASSERT(nfired == N-1);
+	ASSERT(order[0]==1 && order[1]==2 && order[2]==0);
+	for(int i=0; i<N-1; i++)
+		ASSERT(fired_at[i] >= timer[i].deadline);
+	ASSERT(fired_at[3] == 0);
+	ASSERT(bios_hrtimer_cancel(&timer[0])==0);
+	return 0;
+}
+
+
+BOOT_TEST(test_sleep,
+	"Test that Sleep does not return early, and that it is not rounded\n"
+	"up to milliseconds."
+	)
+{
+	const int N = 20;
+	int short_sleeps = 0;
+	usec_t start = GetTime();
+	for(int i=0; i<N; i++) {
+		usec_t t1 = GetTime();
+		Sleep(200);
+		usec_t t2 = GetTime();
+		ASSERT(t2 >= t1 + 200);
+		if(t2 - t1 < 1000) short_sleeps++;
+	}
+	/* Rounding to msec would make all of them long; allow for host noise */
+	ASSERT(short_sleeps >= N/2);
+
+	/* Zero, or deadlines in the past, do not sleep */
+	Sleep(0);
+	SleepUntil(start);
+	return 0;
+}
+
+
+BOOT_TEST(test_sleep_until_periodic,
+	"Test that a periodic task using SleepUntil wakes up at its deadlines,\n"
+	"without accumulating delays, in the presence of other sleeping threads."
+	)
+{
+	const usec_t period = 1500;
+	const int N = 20;
+
+	int sleeper(int argl, void* args) {
+		for(int i=0; i<N; i++) Sleep(argl);
+		return 0;
+	}
+
+	Tid_t t1 = CreateThread(sleeper, 700, NULL);
+	Tid_t t2 = CreateThread(sleeper, 3100, NULL);
+
+	usec_t start = GetTime();
+	usec_t next = start;
+	for(int i=0; i<N; i++) {
+		next += period;
+		SleepUntil(next);
+		ASSERT(GetTime() >= next);
+	}
+	/* Delays do not accumulate */
+	ASSERT(GetTime() - start < N*period + 20000);
+
+	ThreadJoin(t1, NULL);
+	ThreadJoin(t2, NULL);
+	return 0;
+}
+
+
 BOOT_TEST(test_cond_timedwait_timeout,
 	"Test that timed waits on a condition variable terminate without blocking after the timeout."
 	)
@@ -404,6 +764,61 @@ BOOT_TEST(test_cond_timedwait_timeout,
 }
 
 
+/*
+	Test that many timed waits, with deadlines spread over a long
+	period, each terminate close to their timeout.
+ */
+
+BOOT_TEST(test_cond_timedwait_many,
+	"Test that many concurrent timed waits on a condition variable, with different\n"
+	"timeouts, each terminate close to their own timeout."
+	)
+{
+
+	unsigned long tspec2msec(struct timespec t)
+	{
+		return 1000ul*t.tv_sec + t.tv_nsec/1000000ul;
+	}
+
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+
+	int do_timeout(int argl, void* args) {
+		timeout_t t = argl;
+
+		struct timespec t1, t2;
+		clock_gettime(CLOCK_REALTIME, &t1);
+
+		Mutex_Lock(&mx);
+		Cond_TimedWait(&mx, &cv, t);
+		Mutex_Unlock(&mx);
+
+		clock_gettime(CLOCK_REALTIME, &t2);
+
+		unsigned long Dt = tspec2msec(t2)-tspec2msec(t1);
+
+		/* Not early (beyond the resolution of the kernel clock) */
+		ASSERT(Dt + 20 >= t);
+		/* Not too late, allowing a large, 20% error */
+		ASSERT(Dt*5 <= t*6 + 50);
+
+		return 0;
+	}
+
+	/* Some of the timeouts are longer than a revolution of the timeout wheel */
+	const int N = 50;
+	Tid_t tids[N];
+	for(int i=0; i<N; i++) {
+		tids[i] = CreateThread(do_timeout, 1000-20*i, NULL);
+	}
+
+	for(int i=0; i<N; i++) {
+		ASSERT(ThreadJoin(tids[i], NULL)==0);
+	}
+	return 0;
+}
+
+
 /*
 	Test that a timed wait on a condition variable terminates at a signal.
  */
@@ -871,6 +1286,11 @@ TEST_SUITE(basic_tests,
 	)
 {
 	&test_boot,
+	&test_boot_sched_policy,
+	&test_boot_irq_delivery,
+	&test_lock_profile,
+	&test_fair_share,
+	&test_fair_migrate,
 	&test_pid_of_init_is_one,
 	&test_waitchild_error_on_nonchild,
 	&test_waitchild_error_on_invalid_pid,
@@ -880,7 +1300,12 @@ TEST_SUITE(basic_tests,
 	&test_main_return_returns_status,
 	&test_wait_for_any_child,
 	&test_orphans_adopted_by_init,
+	&test_exec_wait_contention,
+	&test_bios_hrtimers,
+	&test_sleep,
+	&test_sleep_until_periodic,
 	&test_cond_timedwait_timeout,
+	&test_cond_timedwait_many,
 	&test_cond_timedwait_signal,
 	&test_cond_timedwait_broadcast,
 	&test_null_device,
@@ -970,12 +1395,574 @@ BOOT_TEST(test_exit_many_threads,
 
 
 
+BOOT_TEST(test_thread_churn,
+	"Test that many short-lived threads can be created and joined, one after\n"
+	"the other, as their memory is recycled."
+	)
+{
+	volatile int count = 0;
+
+	int task(int argl, void* args) {
+		ASSERT(argl == count);
+		count++;
+		return 0;
+	}
+
+	for(int i=0; i<1000; i++) {
+		Tid_t t = CreateThread(task, i, NULL);
+		ASSERT(t != NOTHREAD);
+		ASSERT(ThreadJoin(t, NULL)==0);
+	}
+	ASSERT(count == 1000);
+	return 0;
+}
+
+
+BOOT_TEST(test_thread_deep_stack,
+	"Test that a thread can use most of its default stack of 128 kbytes, also\n"
+	"when the stack is reused after its pages were returned to the host."
+	)
+{
+	/* Each level uses a bit more than 1 kbyte */
+	int deep(int n) {
+		volatile char buf[1024];
+		for(int i=0; i<sizeof(buf); i+=64) buf[i] = (char) n;
+		int r = (n==0) ? 0 : deep(n-1);
+		for(int i=0; i<sizeof(buf); i+=64) ASSERT(buf[i] == (char) n);
+		return r + 1;
+	}
+
+	int task(int argl, void* args) {
+		ASSERT(deep(argl) == argl+1);
+		return 0;
+	}
+
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+
+	for(int round=0; round<3; round++) {
+		Tid_t t[8];
+		for(int i=0; i<8; i++)
+			ASSERT((t[i] = CreateThread(task, 100, NULL)) != NOTHREAD);
+		for(int i=0; i<8; i++)
+			ASSERT(ThreadJoin(t[i], NULL)==0);
+
+		/* Let the idle cores trim their thread pools */
+		Mutex_Lock(&mx);
+		Cond_TimedWait(&mx, &cv, 20);
+		Mutex_Unlock(&mx);
+	}
+	return 0;
+}
+
+
+BARE_TEST(test_thread_stack_overflow,
+	"Test that a thread that overflows its stack hits the guard page,\n"
+	"and that the VM aborts."
+	)
+{
+	int overflow(int n) {
+		volatile char buf[1024];
+		buf[0] = (char) n;
+		return (n < 1000000) ? overflow(n+1) + buf[0] : 0;
+	}
+
+	int task(int argl, void* args) {
+		return overflow(0);
+	}
+
+	pid_t pid = fork();
+	ASSERT(pid != -1);
+	if(pid == 0) {
+		/* Silence the report of the overflow */
+		int fd = open("/dev/null", O_WRONLY);
+		if(fd != -1) dup2(fd, 2);
+		boot(1, 0, task, 0, NULL);
+		_exit(0);
+	}
+
+	int status;
+	ASSERT(waitpid(pid, &status, 0) == pid);
+	ASSERT(WIFSIGNALED(status) && WTERMSIG(status) == SIGABRT);
+}
+
+
+BOOT_TEST(test_create_thread_ex,
+	"Test that threads and processes can be created with a given stack size\n"
+	"and affinity, and that bad attributes are rejected."
+	)
+{
+	/* Use about 512 kbytes of stack */
+	int deep(int n) {
+		volatile char buf[1024];
+		buf[0] = 1;
+		return (n==0) ? 0 : deep(n-1) + buf[0];
+	}
+
+	int task(int argl, void* args) {
+		ASSERT(deep(argl) == argl);
+		return 0;
+	}
+
+	thread_attr attr = { 0 };
+
+	/* Bad attributes */
+	attr.stack_size = THREAD_STACK_MIN - 1;
+	ASSERT(CreateThreadEx(task, 0, NULL, &attr) == NOTHREAD);
+	ASSERT(ExecEx(task, 0, NULL, &attr) == NOPROC);
+	attr.stack_size = THREAD_STACK_MAX + 1;
+	ASSERT(CreateThreadEx(task, 0, NULL, &attr) == NOTHREAD);
+	if(cpu_cores() < 8*sizeof(cpu_mask_t)) {
+		attr.stack_size = 0;
+		attr.affinity = ~(CPU_MASK(cpu_cores())-1);
+		ASSERT(CreateThreadEx(task, 0, NULL, &attr) == NOTHREAD);
+		ASSERT(ExecEx(task, 0, NULL, &attr) == NOPROC);
+	}
+
+	/* Defaults */
+	Tid_t t = CreateThreadEx(task, 10, NULL, NULL);
+	ASSERT(t != NOTHREAD);
+	ASSERT(ThreadJoin(t, NULL)==0);
+
+	/* A small stack */
+	attr = (thread_attr) { .stack_size = 16*1024, .affinity = CPU_MASK(0) };
+	t = CreateThreadEx(task, 4, NULL, &attr);
+	ASSERT(t != NOTHREAD);
+	cpu_mask_t mask;
+	ASSERT(GetThreadAffinity(t, &mask)==0);
+	ASSERT(mask == CPU_MASK(0));
+	ASSERT(ThreadJoin(t, NULL)==0);
+
+	/* A large stack */
+	attr = (thread_attr) { .stack_size = 1024*1024, .weight = 2*THREAD_WEIGHT_DEFAULT };
+	t = CreateThreadEx(task, 500, NULL, &attr);
+	ASSERT(t != NOTHREAD);
+	ASSERT(ThreadJoin(t, NULL)==0);
+
+	Pid_t pid = ExecEx(task, 500, NULL, &attr);
+	ASSERT(pid != NOPROC);
+	ASSERT(WaitChild(pid, NULL)==pid);
+
+	return 0;
+}
+
+
+BOOT_TEST(test_thread_affinity_errors,
+	"Test that SetThreadAffinity and GetThreadAffinity check their arguments."
+	)
+{
+	cpu_mask_t mask;
+	cpu_mask_t all = (cpu_cores() < 8*sizeof(cpu_mask_t)) ? CPU_MASK(cpu_cores())-1 : CPU_MASK_ALL;
+
+	ASSERT(SetThreadAffinity(NOTHREAD, CPU_MASK(0))==-1);
+	ASSERT(GetThreadAffinity(NOTHREAD, &mask)==-1);
+	ASSERT(SetThreadAffinity(ThreadSelf()+1, CPU_MASK(0))==-1);
+	ASSERT(GetThreadAffinity(ThreadSelf()+1, &mask)==-1);
+	ASSERT(GetThreadAffinity(ThreadSelf(), NULL)==-1);
+
+	/* Initially, we can run anywhere */
+	ASSERT(GetThreadAffinity(ThreadSelf(), &mask)==0);
+	ASSERT((mask & all) == all);
+
+	/* The mask must contain an existing core */
+	ASSERT(SetThreadAffinity(ThreadSelf(), 0)==-1);
+	if(cpu_cores() < 8*sizeof(cpu_mask_t))
+		ASSERT(SetThreadAffinity(ThreadSelf(), ~all)==-1);
+
+	ASSERT(SetThreadAffinity(ThreadSelf(), CPU_MASK(0))==0);
+	ASSERT(GetThreadAffinity(ThreadSelf(), &mask)==0);
+	ASSERT(mask == CPU_MASK(0));
+	ASSERT(SetThreadAffinity(ThreadSelf(), CPU_MASK_ALL)==0);
+	return 0;
+}
+
+
+BOOT_TEST(test_thread_affinity_pinned,
+	"Test that threads only run on the cores of their affinity, that the\n"
+	"affinity is inherited and that running threads are moved.",
+	.minimum_cores = 2
+	)
+{
+	uint last = cpu_cores()-1;
+	volatile int moved = 0;
+
+	int pinned(int argl, void* args) {
+		cpu_mask_t mask;
+		ASSERT(GetThreadAffinity(ThreadSelf(), &mask)==0);
+		ASSERT(mask == CPU_MASK(last));
+		for(int i=0; i<20; i++) {
+			ASSERT(cpu_core_id == last);
+			fibo(20);
+		}
+		return 0;
+	}
+
+	int spinner(int argl, void* args) {
+		while(! moved) fibo(10);
+		/* The move may take effect a bit later */
+		for(int i=0; i<100000 && cpu_core_id != 0; i++) fibo(10);
+		for(int i=0; i<20; i++) {
+			ASSERT(cpu_core_id == 0);
+			fibo(20);
+		}
+		return 0;
+	}
+
+	/* Move ourselves */
+	ASSERT(SetThreadAffinity(ThreadSelf(), CPU_MASK(last))==0);
+	ASSERT(cpu_core_id == last);
+
+	/* New threads inherit our mask */
+	Tid_t t[4];
+	for(int i=0; i<4; i++)
+		t[i] = CreateThread(pinned, 0, NULL);
+	for(int i=0; i<4; i++)
+		ASSERT(ThreadJoin(t[i], NULL)==0);
+
+	/* Move a running thread */
+	ASSERT(SetThreadAffinity(ThreadSelf(), CPU_MASK_ALL)==0);
+	Tid_t s = CreateThread(spinner, 0, NULL);
+	ASSERT(SetThreadAffinity(s, CPU_MASK(0))==0);
+	moved = 1;
+	ASSERT(ThreadJoin(s, NULL)==0);
+
+	return 0;
+}
+
+
+BOOT_TEST(test_thread_affinity_churn,
+	"Test that the affinity of threads can be changed repeatedly, while\n"
+	"they sleep, wake up and are stolen between cores.",
+	.minimum_cores = 2, .timeout = 10
+	)
+{
+	const int N = 6;
+	uint ncores = cpu_cores();
+	volatile int stop = 0;
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+
+	int worker(int argl, void* args) {
+		while(! stop) {
+			fibo(12);
+			Mutex_Lock(&mx);
+			Cond_TimedWait(&mx, &cv, 1);
+			Mutex_Unlock(&mx);
+		}
+		return 0;
+	}
+
+	Tid_t t[N];
+	for(int i=0; i<N; i++)
+		t[i] = CreateThread(worker, 0, NULL);
+
+	for(int k=0; k<3000; k++) {
+		cpu_mask_t mask = (k % 3 == 0) ? CPU_MASK_ALL : CPU_MASK(k % ncores);
+		ASSERT(SetThreadAffinity(t[k % N], mask)==0);
+		if(k % 16 == 0) fibo(12);
+	}
+
+	for(int i=0; i<N; i++)
+		ASSERT(SetThreadAffinity(t[i], CPU_MASK_ALL)==0);
+	stop = 1;
+	for(int i=0; i<N; i++)
+		ASSERT(ThreadJoin(t[i], NULL)==0);
+	return 0;
+}
+
+
+BOOT_TEST(test_preempt_on_remote_wakeup,
+	"Test that a thread running alone on a core is preempted, when another\n"
+	"core wakes up a thread for it.",
+	.minimum_cores = 2, .timeout = 10
+	)
+{
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+	volatile int waiting = 0, go = 0, stop = 0;
+
+	int hog(int argl, void* args) {
+		while(! stop) fibo(10);
+		return 0;
+	}
+
+	int waiter(int argl, void* args) {
+		Mutex_Lock(&mx);
+		waiting = 1;
+		while(! go) Cond_Wait(&mx, &cv);
+		Mutex_Unlock(&mx);
+		stop = 1;
+		return 0;
+	}
+
+	/* Run on core 1, and let the other threads run on core 0 */
+	ASSERT(SetThreadAffinity(ThreadSelf(), CPU_MASK(1))==0);
+	Tid_t w = CreateThread(waiter, 0, NULL);
+	ASSERT(SetThreadAffinity(w, CPU_MASK(0))==0);
+	while(! waiting) fibo(10);
+
+	Tid_t h = CreateThread(hog, 0, NULL);
+	ASSERT(SetThreadAffinity(h, CPU_MASK(0))==0);
+
+	/* Let the hog run alone for a while */
+	Mutex_Lock(&mx);
+	Cond_TimedWait(&mx, &cv, 50);
+	go = 1;
+	Cond_Signal(&cv);
+	Mutex_Unlock(&mx);
+
+	ASSERT(ThreadJoin(w, NULL)==0);
+	ASSERT(ThreadJoin(h, NULL)==0);
+	return 0;
+}
+
+
+BOOT_TEST(test_mutex_exclusion,
+	"Test that a mutex provides mutual exclusion to many threads."
+	)
+{
+	enum { NTHREADS = 4, NLOOPS = 20000 };
+	Mutex mx = MUTEX_INIT;
+	volatile int counter = 0;
+
+	int incr(int argl, void* args) {
+		for(int i=0; i<NLOOPS; i++) {
+			Mutex_Lock(&mx);
+			int c = counter;
+			if((i & 15) == 0) fibo(5);
+			counter = c+1;
+			Mutex_Unlock(&mx);
+		}
+		return 0;
+	}
+
+	Tid_t t[NTHREADS];
+	for(int i=0; i<NTHREADS; i++)
+		t[i] = CreateThread(incr, 0, NULL);
+	for(int i=0; i<NTHREADS; i++)
+		ThreadJoin(t[i], NULL);
+
+	ASSERT(counter == NTHREADS*NLOOPS);
+	return 0;
+}
+
+
+BOOT_TEST(test_blocking_mutex,
+	"Test that a blocking mutex provides mutual exclusion, also to holders\n"
+	"that sleep in the critical section, and that it works with Cond_Wait."
+	)
+{
+	enum { NTHREADS = 4, NLOOPS = 2000 };
+	Mutex mx = MUTEX_BLOCKING_INIT;
+	CondVar done_cv = COND_INIT;
+	volatile int counter = 0;
+	int done = 0;
+
+	int incr(int argl, void* args) {
+		for(int i=0; i<NLOOPS; i++) {
+			Mutex_Lock(&mx);
+			int c = counter;
+			if((i & 255) == 0) Sleep(100);  /* Make the waiters go to sleep */
+			else if((i & 15) == 0) fibo(5);
+			counter = c+1;
+			Mutex_Unlock(&mx);
+		}
+		Mutex_Lock(&mx);
+		done++;
+		Cond_Signal(&done_cv);
+		Mutex_Unlock(&mx);
+		return 0;
+	}
+
+	for(int i=0; i<NTHREADS; i++)
+		CreateThread(incr, 0, NULL);
+
+	Mutex_Lock(&mx);
+	while(done < NTHREADS)
+		Cond_Wait(&mx, &done_cv);
+	ASSERT(counter == NTHREADS*NLOOPS);
+	Mutex_Unlock(&mx);
+	return 0;
+}
+
+
+BOOT_TEST(test_broadcast_blocking_mutex,
+	"Test that Cond_Broadcast wakes up all the waiters of a blocking mutex,\n"
+	"as the mutex is passed from one to the next."
+	)
+{
+	enum { NTHREADS = 8, ROUNDS = 50 };
+	Mutex mx = MUTEX_BLOCKING_INIT;
+	CondVar go = COND_INIT, arrived = COND_INIT;
+	int round = 0, waiting = 0, seen = 0;
+
+	int waiter(int argl, void* args) {
+		Mutex_Lock(&mx);
+		for(int r=1; r<=ROUNDS; r++) {
+			waiting++;
+			Cond_Signal(&arrived);
+			while(round < r)
+				Cond_Wait(&mx, &go);
+			seen++;
+		}
+		Mutex_Unlock(&mx);
+		return 0;
+	}
+
+	for(int i=0; i<NTHREADS; i++)
+		CreateThread(waiter, 0, NULL);
+
+	Mutex_Lock(&mx);
+	for(int r=1; r<=ROUNDS; r++) {
+		while(waiting < r*NTHREADS)
+			Cond_Wait(&mx, &arrived);
+		round = r;
+		Cond_Broadcast(&go);
+	}
+	while(seen < ROUNDS*NTHREADS) {
+		Mutex_Unlock(&mx);
+		Sleep(1000);
+		Mutex_Lock(&mx);
+	}
+	Mutex_Unlock(&mx);
+	return 0;
+}
+
+
+BOOT_TEST(test_rwlock,
+	"Test that a reader-writer lock excludes the writer from the readers,\n"
+	"and that the writers get the lock while readers keep coming."
+	)
+{
+	enum { NREADERS = 4, NWRITES = 200 };
+	RwLock rw = RWLOCK_INIT;
+	Mutex mx = MUTEX_BLOCKING_INIT;
+	CondVar done_cv = COND_INIT;
+	volatile int a = 0, b = 0;
+	volatile int writes = 0;
+	int done = 0, errors = 0;
+
+	/* Readers read for as long as the writer writes */
+	int reader(int argl, void* args) {
+		int err = 0;
+		while(writes < NWRITES) {
+			RwLock_ReadLock(&rw);
+			int x = a;
+			fibo(5);
+			if(x != b) err++;
+			RwLock_ReadUnlock(&rw);
+		}
+		Mutex_Lock(&mx);
+		errors += err;
+		done++;
+		Cond_Signal(&done_cv);
+		Mutex_Unlock(&mx);
+		return 0;
+	}
+
+	int writer(int argl, void* args) {
+		for(int i=0; i<NWRITES; i++) {
+			RwLock_WriteLock(&rw);
+			a++;
+			fibo(5);
+			b++;
+			writes++;
+			RwLock_WriteUnlock(&rw);
+		}
+		Mutex_Lock(&mx);
+		done++;
+		Cond_Signal(&done_cv);
+		Mutex_Unlock(&mx);
+		return 0;
+	}
+
+	for(int i=0; i<NREADERS; i++)
+		CreateThread(reader, 0, NULL);
+	CreateThread(writer, 0, NULL);
+
+	Mutex_Lock(&mx);
+	while(done < NREADERS+1)
+		Cond_Wait(&mx, &done_cv);
+	Mutex_Unlock(&mx);
+
+	ASSERT(errors == 0);
+	ASSERT(a == NWRITES && b == NWRITES);
+	return 0;
+}
+
+
+BOOT_TEST(test_thread_info,
+	"Test that the thread information stream reports the process and its\n"
+	"threads, and accounts the blocked time to the right wait channel."
+	)
+{
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+	int done = 0;
+
+	int sleeper(int argl, void* args) {
+		Mutex_Lock(&mx);
+		Cond_TimedWait(&mx, &cv, 50);
+		done = 1;
+		Cond_Signal(&cv);
+		Mutex_Unlock(&mx);
+		return 0;
+	}
+
+	CreateThread(sleeper, 0, NULL);
+	Mutex_Lock(&mx);
+	while(! done)
+		Cond_Wait(&mx, &cv);
+	Mutex_Unlock(&mx);
+
+	Fid_t fid = OpenThreadInfo();
+	ASSERT(fid != NOFILE);
+
+	threadinfo info;
+	ASSERT(Read(fid, (char*) &info, sizeof(info)-1) == -1);
+
+	int found_proc = 0, found_self = 0;
+	while(Read(fid, (char*) &info, sizeof(info)) == sizeof(info)) {
+		if(info.pid != GetPid()) continue;
+		if(info.tid == NOTHREAD) {
+			found_proc = 1;
+			ASSERT(info.blocked_time >= 50000);
+			usec_t timedwait = 0;
+			for(int i=0; i<THREADINFO_WCHANS; i++)
+				if(strcmp(info.wchan[i].name, "Cond_TimedWait")==0)
+					timedwait = info.wchan[i].time;
+			ASSERT(timedwait >= 50000);
+		}
+		if(info.tid == ThreadSelf()) {
+			found_self = 1;
+			ASSERT(info.cpu_time > 0);
+		}
+	}
+	ASSERT(found_proc && found_self);
+	ASSERT(Close(fid) == 0);
+	return 0;
+}
+
+
 TEST_SUITE(thread_tests,
 	"A suite of tests for threads."
 	)
 {
 	&test_create_join_thread,
 	&test_exit_many_threads,
+	&test_thread_churn,
+	&test_thread_deep_stack,
+	&test_thread_stack_overflow,
+	&test_create_thread_ex,
+	&test_thread_affinity_errors,
+	&test_thread_affinity_pinned,
+	&test_thread_affinity_churn,
+	&test_preempt_on_remote_wakeup,
+	&test_mutex_exclusion,
+	&test_blocking_mutex,
+	&test_broadcast_blocking_mutex,
+	&test_rwlock,
+	&test_thread_info,
 	NULL
 };
 
@@ -1193,6 +2180,116 @@ BOOT_TEST(test_pipe_multi_producer,
 }
 
 
+BOOT_TEST(test_pipe_concurrent_pairs,
+	"Test that many pipes can be used concurrently by the threads of a process, "
+	"without losing or mixing data."
+	)
+{
+	enum { PAIRS = 4, NBYTES = 200000 };
+	pipe_t pipes[PAIRS];
+	int errors[PAIRS];
+	int done = 0;
+	Mutex mx = MUTEX_INIT;
+	CondVar all_done = COND_INIT;
+
+	void finished() {
+		Mutex_Lock(&mx);
+		done++;
+		Cond_Broadcast(&all_done);
+		Mutex_Unlock(&mx);
+	}
+
+	for(int i=0;i<PAIRS;i++) {
+		ASSERT(Pipe(&pipes[i])==0);
+		errors[i] = 0;
+	}
+
+	/* Each writer sends a stream that depends on its pipe */
+	int writer(int argl, void* args) {
+		char buf[1000];
+		unsigned int pos = 0;
+		while(pos < NBYTES) {
+			unsigned int len = (NBYTES - pos < sizeof(buf)) ? NBYTES - pos : sizeof(buf);
+			for(unsigned int j=0;j<len;j++)
+				buf[j] = (char)((pos + j) * (argl + 1) % 251);
+			int n = Write(pipes[argl].write, buf, len);
+			assert(n>0);
+			pos += n;
+		}
+		Close(pipes[argl].write);
+		finished();
+		return 0;
+	}
+
+	int reader(int argl, void* args) {
+		char buf[777];
+		unsigned int pos = 0;
+		int n;
+		while((n = Read(pipes[argl].read, buf, sizeof(buf))) > 0) {
+			for(int j=0;j<n;j++)
+				if(buf[j] != (char)((pos + j) * (argl + 1) % 251))
+					errors[argl]++;
+			pos += n;
+		}
+		if(pos != NBYTES) errors[argl]++;
+		Close(pipes[argl].read);
+		finished();
+		return 0;
+	}
+
+	for(int i=0;i<PAIRS;i++) {
+		ASSERT(CreateThread(writer, i, NULL)!=NOTHREAD);
+		ASSERT(CreateThread(reader, i, NULL)!=NOTHREAD);
+	}
+
+	Mutex_Lock(&mx);
+	while(done < 2*PAIRS)
+		Cond_Wait(&mx, &all_done);
+	Mutex_Unlock(&mx);
+
+	for(int i=0;i<PAIRS;i++)
+		ASSERT(errors[i]==0);
+	return 0;
+}
+
+
+BOOT_TEST(test_pipe_ping_pong,
+	"Test request/response traffic over a pair of pipes, where every write\n"
+	"wakes up a reader and the writer blocks right after."
+	)
+{
+	enum { ROUNDS = 5000 };
+	pipe_t ping, pong;
+	ASSERT(Pipe(&ping)==0);
+	ASSERT(Pipe(&pong)==0);
+
+	int server(int argl, void* args) {
+		unsigned char c;
+		while(Read(ping.read, (char*)&c, 1) == 1) {
+			c++;
+			ASSERT(Write(pong.write, (char*)&c, 1) == 1);
+		}
+		Close(pong.write);
+		return 0;
+	}
+
+	Tid_t t = CreateThread(server, 0, NULL);
+	ASSERT(t != NOTHREAD);
+
+	for(int i=0; i<ROUNDS; i++) {
+		unsigned char c = i;
+		ASSERT(Write(ping.write, (char*)&c, 1) == 1);
+		ASSERT(Read(pong.read, (char*)&c, 1) == 1);
+		ASSERT(c == (unsigned char)(i+1));
+	}
+
+	Close(ping.write);
+	unsigned char c;
+	ASSERT(Read(pong.read, (char*)&c, 1) == 0);
+	return 0;
+}
+
+
 TEST_SUITE(pipe_tests,
 	"A suite of tests for pipes. We are focusing on correctness, not performance."
 	)
@@ -1203,6 +2300,8 @@ TEST_SUITE(pipe_tests,
 	&test_pipe_close_writer,
 	&test_pipe_single_producer,
 	&test_pipe_multi_producer,
+	&test_pipe_concurrent_pairs,
+	&test_pipe_ping_pong,
 	NULL
 };
 